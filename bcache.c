@@ -0,0 +1,197 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bcache.h"
+#include "efs.h"
+
+/*
+ * A fixed-size cache of 512-byte blocks, keyed by block number.
+ *
+ * All entries are allocated up front. Lookups go through a chained
+ * hash table; recency is tracked with a doubly-linked list, most
+ * recently used at the head. When the cache is full the tail entry
+ * is recycled. All public functions take the cache's lock, so one
+ * cache can be shared by several threads.
+ */
+
+#define BCACHE_NONE ((size_t)-1)
+
+struct bcache_ent {
+	size_t bn;
+	size_t hnext;		/* next entry in hash chain */
+	size_t prev, next;	/* LRU list */
+	uint8_t data[BLKSIZ];
+};
+
+struct bcache {
+	struct bcache_ent *ents;
+	size_t nents;
+	size_t used;
+	size_t *buckets;
+	size_t nbuckets;	/* power of two */
+	size_t head, tail;
+	struct bcache_stats st;
+	pthread_mutex_t lock;
+};
+
+static size_t bcache_hash(bcache_t *bc, size_t bn)
+{
+	return (bn * 2654435761UL) & (bc->nbuckets - 1);
+}
+
+bcache_t *bcache_init(size_t nbytes)
+{
+	__label__ out_error;
+	bcache_t *bc;
+	size_t i;
+
+	bc = calloc(1, sizeof(*bc));
+	if (!bc) goto out_error;
+
+	bc->nents = nbytes / BLKSIZ;
+	if (!bc->nents) goto out_error;
+
+	bc->ents = calloc(bc->nents, sizeof(*bc->ents));
+	if (!bc->ents) goto out_error;
+
+	bc->nbuckets = 1;
+	while (bc->nbuckets < bc->nents)
+		bc->nbuckets <<= 1;
+	bc->buckets = malloc(bc->nbuckets * sizeof(*bc->buckets));
+	if (!bc->buckets) goto out_error;
+	for (i = 0; i < bc->nbuckets; i++)
+		bc->buckets[i] = BCACHE_NONE;
+
+	bc->head = bc->tail = BCACHE_NONE;
+	bc->st.maxblocks = bc->nents;
+	pthread_mutex_init(&bc->lock, NULL);
+
+	return bc;
+
+out_error:
+	bcache_free(bc);
+	return NULL;
+}
+
+void bcache_free(bcache_t *bc)
+{
+	if (!bc)
+		return;
+	if (bc->st.maxblocks)
+		pthread_mutex_destroy(&bc->lock);
+	free(bc->buckets);
+	free(bc->ents);
+	free(bc);
+}
+
+static void _bcache_unlink(bcache_t *bc, size_t i)
+{
+	struct bcache_ent *e = &bc->ents[i];
+
+	if (e->prev != BCACHE_NONE)
+		bc->ents[e->prev].next = e->next;
+	else
+		bc->head = e->next;
+	if (e->next != BCACHE_NONE)
+		bc->ents[e->next].prev = e->prev;
+	else
+		bc->tail = e->prev;
+}
+
+static void _bcache_push_head(bcache_t *bc, size_t i)
+{
+	struct bcache_ent *e = &bc->ents[i];
+
+	e->prev = BCACHE_NONE;
+	e->next = bc->head;
+	if (bc->head != BCACHE_NONE)
+		bc->ents[bc->head].prev = i;
+	bc->head = i;
+	if (bc->tail == BCACHE_NONE)
+		bc->tail = i;
+}
+
+static size_t _bcache_find(bcache_t *bc, size_t bn)
+{
+	size_t i;
+
+	for (i = bc->buckets[bcache_hash(bc, bn)]; i != BCACHE_NONE; i = bc->ents[i].hnext)
+		if (bc->ents[i].bn == bn)
+			return i;
+
+	return BCACHE_NONE;
+}
+
+static void _bcache_unhash(bcache_t *bc, size_t i)
+{
+	size_t *p;
+
+	for (p = &bc->buckets[bcache_hash(bc, bc->ents[i].bn)]; *p != BCACHE_NONE; p = &bc->ents[*p].hnext) {
+		if (*p == i) {
+			*p = bc->ents[i].hnext;
+			return;
+		}
+	}
+}
+
+/*
+ * Copy block bn into buf and return true if it is cached.
+ */
+bool bcache_lookup(bcache_t *bc, size_t bn, void *buf)
+{
+	size_t i;
+
+	pthread_mutex_lock(&bc->lock);
+	i = _bcache_find(bc, bn);
+	if (i == BCACHE_NONE) {
+		bc->st.misses++;
+		pthread_mutex_unlock(&bc->lock);
+		return false;
+	}
+
+	memcpy(buf, bc->ents[i].data, BLKSIZ);
+	_bcache_unlink(bc, i);
+	_bcache_push_head(bc, i);
+	bc->st.hits++;
+	pthread_mutex_unlock(&bc->lock);
+	return true;
+}
+
+void bcache_insert(bcache_t *bc, size_t bn, const void *buf)
+{
+	size_t i, h;
+
+	pthread_mutex_lock(&bc->lock);
+	i = _bcache_find(bc, bn);
+	if (i != BCACHE_NONE) {
+		/* already cached, just refresh it */
+		_bcache_unlink(bc, i);
+	} else {
+		if (bc->used < bc->nents) {
+			i = bc->used++;
+		} else {
+			/* recycle the least recently used entry */
+			i = bc->tail;
+			_bcache_unlink(bc, i);
+			_bcache_unhash(bc, i);
+			bc->st.evictions++;
+		}
+		bc->ents[i].bn = bn;
+		h = bcache_hash(bc, bn);
+		bc->ents[i].hnext = bc->buckets[h];
+		bc->buckets[h] = i;
+	}
+
+	memcpy(bc->ents[i].data, buf, BLKSIZ);
+	_bcache_push_head(bc, i);
+	pthread_mutex_unlock(&bc->lock);
+}
+
+void bcache_get_stats(bcache_t *bc, struct bcache_stats *st)
+{
+	pthread_mutex_lock(&bc->lock);
+	*st = bc->st;
+	st->nblocks = bc->used;
+	pthread_mutex_unlock(&bc->lock);
+}
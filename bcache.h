@@ -0,0 +1,19 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+struct bcache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	size_t nblocks;		/* blocks currently cached */
+	size_t maxblocks;	/* capacity */
+};
+
+typedef struct bcache bcache_t;
+
+extern bcache_t *bcache_init(size_t nbytes);
+extern void bcache_free(bcache_t *bc);
+extern bool bcache_lookup(bcache_t *bc, size_t bn, void *buf);
+extern void bcache_insert(bcache_t *bc, size_t bn, const void *buf);
+extern void bcache_get_stats(bcache_t *bc, struct bcache_stats *st);
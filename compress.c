@@ -0,0 +1,436 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+#include "err.h"
+#include "pool.h"
+
+#define MIN(a,b) (a>b?b:a)
+
+/* blocks waiting for, or being, compressed, per worker thread */
+#define COMPRESS_INFLIGHT_PER_THREAD	2
+
+struct cblock {
+	uint8_t *in;
+	size_t inlen;
+	uint8_t *out;
+	size_t outlen, outcap;
+	bool done;		/* protected by compress.lock */
+	bool failed;
+};
+
+struct compress {
+	int fd;
+	enum compress_fmt fmt;
+	size_t blksize;
+	pool_t *pool;
+
+	pthread_mutex_t lock;
+	pthread_cond_t done;	/* signalled when a block is compressed */
+
+	/* ring of blocks; the one after the last in flight is being filled */
+	struct cblock *blocks;
+	size_t nblocks, head, count;
+	uint64_t total;		/* blocks submitted so far */
+
+	bool error;
+};
+
+static const struct {
+	const char *suffix;
+	enum compress_fmt fmt;
+} compress_suffixes[] = {
+	{ ".gz",	COMPRESS_GZIP },
+	{ ".tgz",	COMPRESS_GZIP },
+	{ ".xz",	COMPRESS_XZ },
+	{ ".txz",	COMPRESS_XZ },
+	{ ".zst",	COMPRESS_ZSTD },
+	{ ".tzst",	COMPRESS_ZSTD },
+	{ NULL,		COMPRESS_NONE },
+};
+
+/*
+ * Pick the output format from the file name suffix.
+ */
+enum compress_fmt compress_fmt_from_path(const char *path)
+{
+	size_t len, slen;
+	int i;
+
+	len = strlen(path);
+	for (i = 0; compress_suffixes[i].suffix; i++) {
+		slen = strlen(compress_suffixes[i].suffix);
+		if ((len > slen)
+		  && !strcasecmp(path + len - slen, compress_suffixes[i].suffix))
+			return compress_suffixes[i].fmt;
+	}
+	return COMPRESS_NONE;
+}
+
+const char *compress_fmt_name(enum compress_fmt fmt)
+{
+	switch (fmt) {
+	case COMPRESS_NONE:
+		return "uncompressed";
+	case COMPRESS_GZIP:
+		return "gzip";
+	case COMPRESS_XZ:
+		return "xz";
+	case COMPRESS_ZSTD:
+		return "zstd";
+	}
+	return "unknown";
+}
+
+/*
+ * Was this program built with a compressor for fmt?
+ */
+bool compress_fmt_available(enum compress_fmt fmt)
+{
+	switch (fmt) {
+	case COMPRESS_NONE:
+		return true;
+	case COMPRESS_GZIP:
+#ifdef HAVE_ZLIB
+		return true;
+#else
+		return false;
+#endif
+	case COMPRESS_XZ:
+#ifdef HAVE_LZMA
+		return true;
+#else
+		return false;
+#endif
+	case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD
+		return true;
+#else
+		return false;
+#endif
+	}
+	return false;
+}
+
+/*
+ * Input bytes per block. A block is compressed with no knowledge of
+ * the ones before it, so it should be several times the compressor's
+ * window; beyond that, bigger blocks only cost memory.
+ */
+static size_t compress_blksize(enum compress_fmt fmt)
+{
+	switch (fmt) {
+	case COMPRESS_XZ:
+		return 8 * 1024 * 1024;		/* the dictionary at -6 */
+	case COMPRESS_ZSTD:
+		return 4 * 1024 * 1024;
+	default:
+		return 1024 * 1024;
+	}
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_LZMA) || defined(HAVE_ZSTD)
+static bool _cblock_reserve(struct cblock *b, size_t size)
+{
+	uint8_t *p;
+
+	if (b->outcap >= size)
+		return true;
+	p = realloc(b->out, size);
+	if (!p)
+		return false;
+	b->out = p;
+	b->outcap = size;
+	return true;
+}
+#endif
+
+#ifdef HAVE_ZLIB
+static bool _compress_gzip(struct cblock *b)
+{
+	z_stream zs;
+	int rc;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+	  Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	/* enough for deflate() to finish in one call */
+	if (!_cblock_reserve(b, deflateBound(&zs, b->inlen))) {
+		deflateEnd(&zs);
+		return false;
+	}
+	zs.next_in = b->in;
+	zs.avail_in = b->inlen;
+	zs.next_out = b->out;
+	zs.avail_out = b->outcap;
+	rc = deflate(&zs, Z_FINISH);
+	b->outlen = zs.total_out;
+	deflateEnd(&zs);
+
+	return rc == Z_STREAM_END;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static bool _compress_xz(struct cblock *b)
+{
+	size_t pos = 0;
+	lzma_ret rc;
+
+	if (!_cblock_reserve(b, lzma_stream_buffer_bound(b->inlen)))
+		return false;
+	rc = lzma_easy_buffer_encode(LZMA_PRESET_DEFAULT, LZMA_CHECK_CRC64,
+		NULL, b->in, b->inlen, b->out, &pos, b->outcap);
+	b->outlen = pos;
+
+	return rc == LZMA_OK;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static bool _compress_zstd(struct cblock *b)
+{
+	size_t n;
+
+	if (!_cblock_reserve(b, ZSTD_compressBound(b->inlen)))
+		return false;
+	n = ZSTD_compress(b->out, b->outcap, b->in, b->inlen, 3);
+	if (ZSTD_isError(n))
+		return false;
+	b->outlen = n;
+
+	return true;
+}
+#endif
+
+/*
+ * Runs on a pool worker.
+ */
+static void _compress_block(void *item, void *arg)
+{
+	compress_t *c = arg;
+	struct cblock *b = item;
+	bool ok = false;
+
+	switch (c->fmt) {
+#ifdef HAVE_ZLIB
+	case COMPRESS_GZIP:
+		ok = _compress_gzip(b);
+		break;
+#endif
+#ifdef HAVE_LZMA
+	case COMPRESS_XZ:
+		ok = _compress_xz(b);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		ok = _compress_zstd(b);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	b->failed = !ok;
+	b->done = true;
+	pthread_cond_broadcast(&c->done);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static int _compress_out(int fd, const uint8_t *p, size_t len)
+{
+	ssize_t rc;
+
+	while (len) {
+		rc = write(fd, p, len);
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+/*
+ * Write out compressed blocks from the head of the ring, in order:
+ * those that are finished, and then, waiting for them, as many more
+ * as it takes to leave no more than keep in flight.
+ */
+static int _compress_drain(compress_t *c, size_t keep)
+{
+	struct cblock *b;
+
+	while (c->count) {
+		b = &c->blocks[c->head];
+
+		pthread_mutex_lock(&c->lock);
+		if (!b->done && (c->count <= keep)) {
+			pthread_mutex_unlock(&c->lock);
+			break;
+		}
+		while (!b->done)
+			pthread_cond_wait(&c->done, &c->lock);
+		pthread_mutex_unlock(&c->lock);
+
+		if (b->failed || (!c->error && _compress_out(c->fd, b->out, b->outlen)))
+			c->error = true;
+		b->inlen = 0;
+		c->head = (c->head + 1) % c->nblocks;
+		c->count--;
+	}
+
+	return c->error ? -1 : 0;
+}
+
+static void _compress_submit(compress_t *c)
+{
+	struct cblock *b;
+
+	b = &c->blocks[(c->head + c->count) % c->nblocks];
+	b->done = false;
+	c->count++;
+	c->total++;
+	pool_submit(c->pool, b);
+}
+
+static unsigned compress_ncpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0)
+		return n;
+#endif
+	return 1;
+}
+
+/*
+ * Write fmt-compressed data to fd, using nthreads worker threads, or
+ * one per CPU if nthreads is 0. fd is not closed by compress_close().
+ */
+compress_t *compress_create(int fd, enum compress_fmt fmt, unsigned nthreads)
+{
+	compress_t *c;
+
+	if ((fmt == COMPRESS_NONE) || !compress_fmt_available(fmt)) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+	if (!nthreads)
+		nthreads = compress_ncpus();
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	c->fd = fd;
+	c->fmt = fmt;
+	c->blksize = compress_blksize(fmt);
+	c->nblocks = nthreads * COMPRESS_INFLIGHT_PER_THREAD;
+	c->blocks = calloc(c->nblocks, sizeof(*c->blocks));
+	if (!c->blocks) {
+		free(c);
+		return NULL;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->done, NULL);
+	c->pool = pool_create(nthreads, _compress_block, c);
+
+	return c;
+}
+
+/*
+ * Compress len bytes from buf. Returns -1 once anything has failed to
+ * compress or to be written.
+ */
+int compress_write(compress_t *c, const void *buf, size_t len)
+{
+	const uint8_t *src = buf;
+	struct cblock *b;
+	size_t n;
+
+	while (len) {
+		/* the block to fill must not still be in flight */
+		if ((c->count == c->nblocks) && _compress_drain(c, c->nblocks - 1))
+			return -1;
+
+		b = &c->blocks[(c->head + c->count) % c->nblocks];
+		if (!b->in) {
+			b->in = malloc(c->blksize);
+			if (!b->in) {
+				c->error = true;
+				return -1;
+			}
+		}
+		n = MIN(len, c->blksize - b->inlen);
+		memcpy(b->in + b->inlen, src, n);
+		b->inlen += n;
+		src += n;
+		len -= n;
+
+		if (b->inlen == c->blksize) {
+			_compress_submit(c);
+			if (_compress_drain(c, c->nblocks))
+				return -1;
+		}
+	}
+
+	return c->error ? -1 : 0;
+}
+
+/*
+ * Compress and write whatever is left, then free c.
+ */
+int compress_close(compress_t *c)
+{
+	struct cblock *b;
+	size_t i;
+	int rc;
+
+	if (!c)
+		return 0;
+
+	/*
+	 * With the ring full, nothing has been put in the next block yet.
+	 * An empty stream is still compressed, to make a valid file.
+	 */
+	if (c->count < c->nblocks) {
+		b = &c->blocks[(c->head + c->count) % c->nblocks];
+		if (b->inlen || !c->total)
+			_compress_submit(c);
+	}
+	rc = _compress_drain(c, 0);
+
+	pool_destroy(c->pool);
+	pthread_cond_destroy(&c->done);
+	pthread_mutex_destroy(&c->lock);
+	for (i = 0; i < c->nblocks; i++) {
+		free(c->blocks[i].in);
+		free(c->blocks[i].out);
+	}
+	free(c->blocks);
+	free(c);
+
+	return rc;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A compressed output stream. The data is cut into blocks, which are
+ * compressed independently on worker threads and written out in order,
+ * each as a complete gzip member, xz stream or zstd frame. Decompressors
+ * treat such a concatenation as one file.
+ */
+
+enum compress_fmt {
+	COMPRESS_NONE = 0,
+	COMPRESS_GZIP,
+	COMPRESS_XZ,
+	COMPRESS_ZSTD
+};
+
+typedef struct compress compress_t;
+
+extern enum compress_fmt compress_fmt_from_path(const char *path);
+extern const char *compress_fmt_name(enum compress_fmt fmt);
+extern bool compress_fmt_available(enum compress_fmt fmt);
+
+extern compress_t *compress_create(int fd, enum compress_fmt fmt, unsigned nthreads);
+extern int compress_write(compress_t *c, const void *buf, size_t len);
+extern int compress_close(compress_t *c);
@@ -0,0 +1,384 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dcache.h"
+#include "efs.h"
+
+/*
+ * Directory entry cache.
+ *
+ * Parsed directories are kept as open-addressed hash tables mapping
+ * names to inode numbers, so a lookup is a few probes instead of a
+ * re-read and linear scan of the directory. The directories
+ * themselves are found through a chained hash on the directory's
+ * inode number and are evicted least recently used first.
+ *
+ * Separately, recently resolved paths are remembered in a ring, so
+ * repeated lookups under the same prefix skip straight to it.
+ *
+ * The memory taken by both can be capped as well, in which case
+ * directories are evicted to make room, and whatever still doesn't
+ * fit is just not cached.
+ *
+ * All public functions take the cache's lock.
+ */
+
+struct dcache_name {
+	const char *name;	/* NULL if slot is empty */
+	size_t len;
+	efs_ino_t ino;
+};
+
+struct dcache_dir {
+	efs_ino_t ino;
+	struct dcache_name *slots;
+	size_t nslots;		/* power of two */
+	char *names;		/* storage for all names */
+	size_t nbytes;		/* memory taken by all of the above */
+	struct dcache_dir *hnext;
+	struct dcache_dir *prev, *next;
+};
+
+struct dcache_path {
+	char *path;		/* NULL if slot is empty */
+	size_t len;
+	efs_ino_t ino;
+	struct dcache_path *hnext;
+};
+
+struct dcache {
+	struct dcache_dir **dirhash;
+	size_t ndirhash;
+	struct dcache_dir *head, *tail;
+	size_t ndirs, maxdirs;
+
+	struct dcache_path *paths;	/* ring of maxpaths entries */
+	size_t maxpaths, nextpath;
+	struct dcache_path **pathhash;
+	size_t npathhash;
+
+	size_t nbytes;		/* memory in use, tables included */
+	size_t maxbytes;	/* 0 if unlimited */
+
+	pthread_mutex_t lock;
+};
+
+static uint32_t dcache_strhash(const char *s, size_t len)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (uint8_t)s[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static size_t dcache_pow2(size_t n)
+{
+	size_t out = 1;
+	while (out < n)
+		out <<= 1;
+	return out;
+}
+
+dcache_t *dcache_init(size_t maxdirs, size_t maxpaths)
+{
+	__label__ out_error;
+	dcache_t *dc;
+
+	dc = calloc(1, sizeof(*dc));
+	if (!dc) goto out_error;
+
+	dc->maxdirs = maxdirs? maxdirs: 1;
+	dc->ndirhash = dcache_pow2(dc->maxdirs);
+	dc->dirhash = calloc(dc->ndirhash, sizeof(*dc->dirhash));
+	if (!dc->dirhash) goto out_error;
+
+	dc->maxpaths = maxpaths? maxpaths: 1;
+	dc->paths = calloc(dc->maxpaths, sizeof(*dc->paths));
+	if (!dc->paths) goto out_error;
+	dc->npathhash = dcache_pow2(dc->maxpaths);
+	dc->pathhash = calloc(dc->npathhash, sizeof(*dc->pathhash));
+	if (!dc->pathhash) goto out_error;
+
+	dc->nbytes = sizeof(*dc) + dc->ndirhash * sizeof(*dc->dirhash)
+	  + dc->maxpaths * sizeof(*dc->paths)
+	  + dc->npathhash * sizeof(*dc->pathhash);
+	pthread_mutex_init(&dc->lock, NULL);
+	return dc;
+
+out_error:
+	dcache_free(dc);
+	return NULL;
+}
+
+static void _dcache_free_dir(struct dcache_dir *d)
+{
+	free(d->slots);
+	free(d->names);
+	free(d);
+}
+
+void dcache_free(dcache_t *dc)
+{
+	struct dcache_dir *d, *next;
+	size_t i;
+
+	if (!dc)
+		return;
+
+	for (d = dc->head; d; d = next) {
+		next = d->next;
+		_dcache_free_dir(d);
+	}
+	if (dc->paths) {
+		for (i = 0; i < dc->maxpaths; i++)
+			free(dc->paths[i].path);
+	}
+	if (dc->pathhash)
+		pthread_mutex_destroy(&dc->lock);
+	free(dc->paths);
+	free(dc->pathhash);
+	free(dc->dirhash);
+	free(dc);
+}
+
+static struct dcache_dir **_dcache_dirslot(dcache_t *dc, efs_ino_t ino)
+{
+	struct dcache_dir **p;
+
+	p = &dc->dirhash[(ino * 2654435761u) & (dc->ndirhash - 1)];
+	while (*p && ((*p)->ino != ino))
+		p = &(*p)->hnext;
+	return p;
+}
+
+static void _dcache_unlink(dcache_t *dc, struct dcache_dir *d)
+{
+	if (d->prev) d->prev->next = d->next;
+	else dc->head = d->next;
+	if (d->next) d->next->prev = d->prev;
+	else dc->tail = d->prev;
+}
+
+static void _dcache_push_head(dcache_t *dc, struct dcache_dir *d)
+{
+	d->prev = NULL;
+	d->next = dc->head;
+	if (dc->head) dc->head->prev = d;
+	dc->head = d;
+	if (!dc->tail) dc->tail = d;
+}
+
+/* drop the least recently used directory */
+static void _dcache_evict(dcache_t *dc)
+{
+	struct dcache_dir *victim = dc->tail;
+
+	_dcache_unlink(dc, victim);
+	*_dcache_dirslot(dc, victim->ino) = victim->hnext;
+	dc->nbytes -= victim->nbytes;
+	_dcache_free_dir(victim);
+	dc->ndirs--;
+}
+
+/*
+ * Remember the contents of directory dir. ents is terminated by an
+ * entry with d_ino == 0, as returned by _efs_read_dirblks().
+ */
+static void _dcache_add_dir(dcache_t *dc, efs_ino_t dir, const struct efs_dirent *ents)
+{
+	struct dcache_dir *d, **p;
+	const struct efs_dirent *de;
+	size_t n = 0, namebytes = 0;
+	char *cursor;
+
+	p = _dcache_dirslot(dc, dir);
+	if (*p)
+		return;
+
+	for (de = ents; de->d_ino; de++) {
+		n++;
+		namebytes += strlen(de->d_name) + 1;
+	}
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return;
+	d->ino = dir;
+	d->nslots = dcache_pow2(2 * n + 1);
+	d->nbytes = sizeof(*d) + d->nslots * sizeof(*d->slots) + namebytes + 1;
+	d->slots = calloc(d->nslots, sizeof(*d->slots));
+	d->names = malloc(namebytes + 1);
+	if (!d->slots || !d->names) {
+		_dcache_free_dir(d);
+		return;
+	}
+
+	cursor = d->names;
+	for (de = ents; de->d_ino; de++) {
+		size_t len, i;
+
+		len = strlen(de->d_name);
+		memcpy(cursor, de->d_name, len + 1);
+		i = dcache_strhash(cursor, len) & (d->nslots - 1);
+		while (d->slots[i].name)
+			i = (i + 1) & (d->nslots - 1);
+		d->slots[i].name = cursor;
+		d->slots[i].len = len;
+		d->slots[i].ino = de->d_ino;
+		cursor += len + 1;
+	}
+
+	/* evict the least recently used directories if we're full */
+	while (dc->ndirs && ((dc->ndirs >= dc->maxdirs)
+	  || (dc->maxbytes && (dc->nbytes + d->nbytes > dc->maxbytes)))) {
+		_dcache_evict(dc);
+		p = _dcache_dirslot(dc, dir);
+	}
+	if (dc->maxbytes && (dc->nbytes + d->nbytes > dc->maxbytes)) {
+		_dcache_free_dir(d);
+		return;
+	}
+
+	*p = d;
+	_dcache_push_head(dc, d);
+	dc->ndirs++;
+	dc->nbytes += d->nbytes;
+}
+
+/*
+ * Look up name in directory dir. Returns 1 and sets *ino if found,
+ * 0 if dir is cached but has no such name, or -1 if dir is not
+ * cached.
+ */
+static int _dcache_lookup(dcache_t *dc, efs_ino_t dir, const char *name, size_t namelen, efs_ino_t *ino)
+{
+	struct dcache_dir *d;
+	size_t i;
+
+	d = *_dcache_dirslot(dc, dir);
+	if (!d)
+		return -1;
+
+	if (d != dc->head) {
+		_dcache_unlink(dc, d);
+		_dcache_push_head(dc, d);
+	}
+
+	i = dcache_strhash(name, namelen) & (d->nslots - 1);
+	for (; d->slots[i].name; i = (i + 1) & (d->nslots - 1)) {
+		if ((d->slots[i].len == namelen) && !memcmp(d->slots[i].name, name, namelen)) {
+			*ino = d->slots[i].ino;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static struct dcache_path **_dcache_pathslot(dcache_t *dc, const char *path, size_t len)
+{
+	struct dcache_path **p;
+
+	p = &dc->pathhash[dcache_strhash(path, len) & (dc->npathhash - 1)];
+	while (*p && (((*p)->len != len) || memcmp((*p)->path, path, len)))
+		p = &(*p)->hnext;
+	return p;
+}
+
+static void _dcache_add_path(dcache_t *dc, const char *path, size_t len, efs_ino_t ino)
+{
+	struct dcache_path *e, **p;
+
+	p = _dcache_pathslot(dc, path, len);
+	if (*p)
+		return;
+
+	/* reuse the oldest slot in the ring */
+	e = &dc->paths[dc->nextpath];
+	dc->nextpath = (dc->nextpath + 1) % dc->maxpaths;
+	if (e->path) {
+		*_dcache_pathslot(dc, e->path, e->len) = e->hnext;
+		free(e->path);
+		e->path = NULL;
+		dc->nbytes -= e->len + 1;
+		p = _dcache_pathslot(dc, path, len);
+	}
+
+	if (dc->maxbytes && (dc->nbytes + len + 1 > dc->maxbytes))
+		return;
+	e->path = malloc(len + 1);
+	if (!e->path)
+		return;
+	memcpy(e->path, path, len);
+	e->path[len] = '\0';
+	e->len = len;
+	e->ino = ino;
+	e->hnext = NULL;
+	*p = e;
+	dc->nbytes += len + 1;
+}
+
+static bool _dcache_lookup_path(dcache_t *dc, const char *path, size_t len, efs_ino_t *ino)
+{
+	struct dcache_path *e;
+
+	e = *_dcache_pathslot(dc, path, len);
+	if (!e)
+		return false;
+
+	*ino = e->ino;
+	return true;
+}
+
+void dcache_add_dir(dcache_t *dc, efs_ino_t dir, const struct efs_dirent *ents)
+{
+	pthread_mutex_lock(&dc->lock);
+	_dcache_add_dir(dc, dir, ents);
+	pthread_mutex_unlock(&dc->lock);
+}
+
+int dcache_lookup(dcache_t *dc, efs_ino_t dir, const char *name, size_t namelen, efs_ino_t *ino)
+{
+	int rc;
+
+	pthread_mutex_lock(&dc->lock);
+	rc = _dcache_lookup(dc, dir, name, namelen, ino);
+	pthread_mutex_unlock(&dc->lock);
+	return rc;
+}
+
+void dcache_add_path(dcache_t *dc, const char *path, size_t len, efs_ino_t ino)
+{
+	pthread_mutex_lock(&dc->lock);
+	_dcache_add_path(dc, path, len, ino);
+	pthread_mutex_unlock(&dc->lock);
+}
+
+bool dcache_lookup_path(dcache_t *dc, const char *path, size_t len, efs_ino_t *ino)
+{
+	bool rc;
+
+	pthread_mutex_lock(&dc->lock);
+	rc = _dcache_lookup_path(dc, path, len, ino);
+	pthread_mutex_unlock(&dc->lock);
+	return rc;
+}
+
+/*
+ * Cap the memory the cache takes at nbytes, or lift the cap if it's
+ * zero. Directories over the cap are evicted right away.
+ */
+void dcache_set_max_bytes(dcache_t *dc, size_t nbytes)
+{
+	pthread_mutex_lock(&dc->lock);
+	dc->maxbytes = nbytes;
+	while (nbytes && dc->ndirs && (dc->nbytes > nbytes))
+		_dcache_evict(dc);
+	pthread_mutex_unlock(&dc->lock);
+}
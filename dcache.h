@@ -0,0 +1,21 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include "efs.h"
+
+/* number of parsed directories kept per filesystem */
+#define DCACHE_DEFAULT_DIRS	256
+/* number of resolved paths kept per filesystem */
+#define DCACHE_DEFAULT_PATHS	1024
+
+typedef struct dcache dcache_t;
+
+extern dcache_t *dcache_init(size_t maxdirs, size_t maxpaths);
+extern void dcache_free(dcache_t *dc);
+extern void dcache_set_max_bytes(dcache_t *dc, size_t nbytes);
+
+extern void dcache_add_dir(dcache_t *dc, efs_ino_t dir, const struct efs_dirent *ents);
+extern int dcache_lookup(dcache_t *dc, efs_ino_t dir, const char *name, size_t namelen, efs_ino_t *ino);
+
+extern void dcache_add_path(dcache_t *dc, const char *path, size_t len, efs_ino_t ino);
+extern bool dcache_lookup_path(dcache_t *dc, const char *path, size_t len, efs_ino_t *ino);
@@ -1,15 +1,32 @@
 #define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#ifndef __MINGW32__
+#define HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#include "dcache.h"
 #include "efs.h"
 #include "endian.h"
 #include "err.h"
+#include "isofs.h"
 #include "progname.h"
 #include "queue.h"
 
+#define MAX(a,b) (a>b?a:b)
+#define MIN(a,b) (a>b?b:a)
+
 static struct efs_dirent *_efs_read_dirblks(efs_t *ctx, efs_ino_t ino);
 static efs_ino_t efs_namei(efs_t *ctx, const char *name);
 
@@ -100,43 +117,92 @@ static struct efs_dinode efs_dinodetoh(struct efs_dinode inode)
 	return out;
 }
 
-static efs_err_t efs_get_blocks(efs_t *ctx, void *buf, size_t firstlbn, size_t nblks)
+efs_err_t efs_get_blocks(efs_t *ctx, void *buf, size_t firstlbn, size_t nblks)
 {
-	__label__ out_error, out_ok;
-	int rc;
-	size_t sz;
-	efs_err_t erc;
+	ssize_t rc;
+	size_t i;
+	bool cacheable;
 #if 0
 	printf("efs_get_blocks(%p, %p, %zu, %zu);\n", ctx, buf, firstlbn, nblks);
 #endif
 
-	rc = fsseek(ctx->fs, BLKSIZ * firstlbn, SEEK_SET);
-	if (rc == -1) {
-		erc = EFS_ERR_READFAIL;
-		goto out_error;
+	/* Short reads are metadata: try the block cache first. */
+	cacheable = ctx->bcache && (nblks <= EFS_CACHE_MAXRUN);
+	if (cacheable) {
+		for (i = 0; i < nblks; i++) {
+			if (!bcache_lookup(ctx->bcache, firstlbn + i, (uint8_t *)buf + BLKSIZ * i))
+				break;
+		}
+		if (i == nblks)
+			return EFS_ERR_OK;
 	}
 
+	rc = fspread(ctx->fs, buf, BLKSIZ * nblks, BLKSIZ * firstlbn);
 #if 0
-	printf("fsread(%p, %u, %lu, %p);\n", buf, BLKSIZ, nblks, ctx->fs);
-#endif
-	sz = fsread(buf, BLKSIZ, nblks, ctx->fs);
-#if 0
-	printf("fsread: returning %d\n", sz;
+	printf("fspread: returning %zd\n", rc);
 	hexdump(buf, BLKSIZ * nblks);
 #endif
-	if (sz != nblks) {
-		erc = EFS_ERR_READFAIL;
-		goto out_error;
+	if (rc != (ssize_t)(BLKSIZ * nblks))
+		return EFS_ERR_READFAIL;
+
+	if (cacheable) {
+		for (i = 0; i < nblks; i++)
+			bcache_insert(ctx->bcache, firstlbn + i, (uint8_t *)buf + BLKSIZ * i);
 	}
-	goto out_ok;
 
-out_ok:
 	return EFS_ERR_OK;
-out_error:
-	return erc;
 }
 
-efs_err_t efs_open(efs_t **ctx, fileslice_t *fs)
+/*
+ * Resize the block cache to nbytes, dropping everything in it.
+ * A size of zero disables caching.
+ */
+efs_err_t efs_set_cache_size(efs_t *ctx, size_t nbytes)
+{
+	bcache_free(ctx->bcache);
+	ctx->bcache = NULL;
+
+	if (nbytes < BLKSIZ)
+		return EFS_ERR_OK;
+
+	ctx->bcache = bcache_init(nbytes);
+	if (!ctx->bcache)
+		return EFS_ERR_NOMEM;
+
+	return EFS_ERR_OK;
+}
+
+/*
+ * Cap the memory the directory cache takes at nbytes, or lift the cap
+ * if it's zero.
+ */
+void efs_set_dcache_size(efs_t *ctx, size_t nbytes)
+{
+	if (ctx->dcache)
+		dcache_set_max_bytes(ctx->dcache, nbytes);
+}
+
+/*
+ * Set the readahead window size for files opened from now on.
+ */
+void efs_set_readahead(efs_t *ctx, size_t nbytes)
+{
+	nbytes -= nbytes % BLKSIZ;
+	if (nbytes < BLKSIZ)
+		nbytes = BLKSIZ;
+	ctx->readahead = nbytes;
+}
+
+void efs_get_cache_stats(efs_t *ctx, struct bcache_stats *st)
+{
+	if (ctx->bcache) {
+		bcache_get_stats(ctx->bcache, st);
+	} else {
+		memset(st, 0, sizeof(*st));
+	}
+}
+
+efs_err_t efs_open(efs_t **ctx, fileslice_t *fs, int flags)
 {
 	__label__ out_error;
 	efs_err_t erc;
@@ -150,6 +216,7 @@ efs_err_t efs_open(efs_t **ctx, fileslice_t *fs)
 	}
 
 	(*ctx)->fs = fs;
+	(*ctx)->fstype = EFS_FSTYPE_EFS;
 
 	/* Read superblock */
 	rc = efs_get_blocks(*ctx, &(*ctx)->sb, 1, 1);
@@ -166,10 +233,35 @@ efs_err_t efs_open(efs_t **ctx, fileslice_t *fs)
 
 	/* Convert superblock to native endianness */
 	(*ctx)->sb = efstoh((*ctx)->sb);
+	(*ctx)->ipcg = EFS_COMPUTE_IPCG(&(*ctx)->sb);
+	(*ctx)->readahead = EFS_READAHEAD_DEFAULT;
+
+	/* Set up the block cache */
+	erc = efs_set_cache_size(*ctx, EFS_CACHE_DEFAULT);
+	if (erc != EFS_ERR_OK)
+		goto out_error;
+
+	/* Set up the directory cache */
+	(*ctx)->dcache = dcache_init(DCACHE_DEFAULT_DIRS, DCACHE_DEFAULT_PATHS);
+	if (!(*ctx)->dcache) {
+		erc = EFS_ERR_NOMEM;
+		goto out_error;
+	}
+
+	/*
+	 * Load the inode tables if asked. This is only an optimization:
+	 * if it fails (say, the image is truncated), efs_get_inode()
+	 * just goes back to reading inodes one BB at a time.
+	 */
+	if (flags & EFS_OPEN_INODES)
+		(void)efs_load_inodes(*ctx);
 
 	return EFS_ERR_OK;
 out_error:
-	if (*ctx) free(*ctx);
+	if (*ctx) {
+		bcache_free((*ctx)->bcache);
+		free(*ctx);
+	}
 	*ctx = NULL;
 	return erc;
 }
@@ -180,9 +272,103 @@ void efs_close(efs_t *ctx)
 	if (ctx->dvh)
 		dvh_close(ctx->dvh);
 	fsclose(ctx->fs);
+	bcache_free(ctx->bcache);
+	dcache_free(ctx->dcache);
+	free(ctx->itab);
+	free(ctx->iso);
 	free(ctx);
 }
 
+/*
+ * How much memory efs_load_inodes() takes, or would take.
+ */
+size_t efs_inodes_size(efs_t *ctx)
+{
+	if ((ctx->fstype == EFS_FSTYPE_ISO9660)
+	  || (ctx->sb.fs_ncg <= 0) || (ctx->sb.fs_cgisize <= 0))
+		return 0;
+	return (size_t)ctx->sb.fs_ncg * ctx->sb.fs_cgisize * EFS_INOPBB
+	  * sizeof(struct efs_dinode);
+}
+
+/*
+ * Read the inode table of every cylinder group into ctx->itab,
+ * converted to native endianness, so that efs_get_inode() never
+ * has to touch the disk. Each table is contiguous on disk, so this
+ * is a handful of large sequential reads instead of one small
+ * random read per inode.
+ */
+efs_err_t efs_load_inodes(efs_t *ctx)
+{
+	__label__ out_error;
+	efs_err_t erc;
+	struct efs_dinode *itab = NULL;
+	struct efs_dinode *buf = NULL;
+	const struct efs_dinode *src;
+	size_t ncg, cgisize, ninodes, cg, bb, nbbs, i, out;
+	ssize_t rc;
+
+	/* ISO9660 has no inode tables */
+	if (ctx->itab || (ctx->fstype == EFS_FSTYPE_ISO9660))
+		return EFS_ERR_OK;
+
+	ncg = ctx->sb.fs_ncg;
+	cgisize = ctx->sb.fs_cgisize;
+	if ((ctx->sb.fs_ncg <= 0) || (ctx->sb.fs_cgisize <= 0)
+	  || (ctx->sb.fs_cgfsize < ctx->sb.fs_cgisize)) {
+		erc = EFS_ERR_INVAL;
+		goto out_error;
+	}
+
+	ninodes = ncg * cgisize * EFS_INOPBB;
+	itab = calloc(ninodes, sizeof(*itab));
+	if (!itab) {
+		erc = EFS_ERR_NOMEM;
+		goto out_error;
+	}
+
+	/* Only needed if the slice isn't mapped. */
+	buf = malloc(EFS_ITAB_CHUNK * BLKSIZ);
+	if (!buf) {
+		erc = EFS_ERR_NOMEM;
+		goto out_error;
+	}
+
+	out = 0;
+	for (cg = 0; cg < ncg; cg++) {
+		for (bb = 0; bb < cgisize; bb += nbbs) {
+			size_t firstbb, nbytes;
+
+			nbbs = MIN(cgisize - bb, EFS_ITAB_CHUNK);
+			firstbb = ctx->sb.fs_firstcg + cg * ctx->sb.fs_cgfsize + bb;
+			nbytes = nbbs * BLKSIZ;
+
+			src = fsptr(ctx->fs, BLKSIZ * firstbb, nbytes);
+			if (!src) {
+				rc = fspread(ctx->fs, buf, nbytes, BLKSIZ * firstbb);
+				if ((rc < 0) || ((size_t)rc != nbytes)) {
+					erc = EFS_ERR_READFAIL;
+					goto out_error;
+				}
+				src = buf;
+			}
+
+			for (i = 0; i < nbbs * EFS_INOPBB; i++)
+				itab[out++] = efs_dinodetoh(src[i]);
+		}
+	}
+
+	free(buf);
+	ctx->itab = itab;
+	ctx->ninodes = ninodes;
+	return EFS_ERR_OK;
+
+out_error:
+	free(buf);
+	free(itab);
+	return erc;
+}
+
 struct efs_ino_inf_s {
 	size_t bb;
 	unsigned slot;
@@ -208,9 +394,22 @@ static struct efs_ino_inf_s efs_get_inode_info(efs_t *ctx, efs_ino_t ino)
 static struct efs_dinode efs_get_inode(efs_t *ctx, unsigned ino)
 {
 	struct efs_dinode inodes[4];
+	const struct efs_dinode *mapped;
 
 	struct efs_ino_inf_s info;
+
+	if (ctx->fstype == EFS_FSTYPE_ISO9660)
+		return isofs_get_inode(ctx, ino);
+	if (ino < ctx->ninodes)
+		return ctx->itab[ino];
+
 	info = efs_get_inode_info(ctx, ino);
+
+	/* If the slice is mapped, read the inode in place. */
+	mapped = fsptr(ctx->fs, BLKSIZ * info.bb, BLKSIZ);
+	if (mapped)
+		return efs_dinodetoh(mapped[info.slot]);
+
 	efs_get_blocks(ctx, &inodes, info.bb, 1);
 	inodes[info.slot] = efs_dinodetoh(inodes[info.slot]);
 #if 0
@@ -232,27 +431,29 @@ static int compar(const void *a, const void *b)
 	return strcmp(de_a->d_name, de_b->d_name);
 }
 
-efs_dir_t *efs_opendir(efs_t *efs, const char *dirname)
+efs_dir_t *efs_opendiri(efs_t *efs, efs_ino_t ino)
 {
 	__label__ out_ok, out_error;
 	efs_dir_t *dirp;
 	size_t nel = 0;
 	struct efs_dirent *de;
 
+	if (ino == EFS_BADINO) return NULL;
+
 	dirp = calloc(1, sizeof(*dirp));
 	if (!dirp) goto out_error;
 
-	dirp->ino = efs_namei(efs, dirname);
-#if 0
-	printf("--ino: %u\n", dirp->ino);
-#endif
-	if (dirp->ino == EFS_BADINO) goto out_error;
+	dirp->ino = ino;
 
 	dirp->dirent = _efs_read_dirblks(efs, dirp->ino);
 	if (!dirp->dirent)
 		goto out_error;
 	dirp->_dirent_memobj = dirp->dirent;
 
+	/* We have the directory parsed anyway, so remember it. */
+	if (efs->dcache)
+		dcache_add_dir(efs->dcache, dirp->ino, dirp->dirent);
+
 	for (de = dirp->dirent; de->d_ino; de++) {
 		nel++;
 	}
@@ -268,6 +469,17 @@ out_error:
 	return NULL;
 }
 
+efs_dir_t *efs_opendir(efs_t *efs, const char *dirname)
+{
+	efs_ino_t ino;
+
+	ino = efs_namei(efs, dirname);
+#if 0
+	printf("--ino: %u\n", ino);
+#endif
+	return efs_opendiri(efs, ino);
+}
+
 int efs_closedir(efs_dir_t *dirp)
 {
 	free(dirp->_dirent_memobj);
@@ -288,11 +500,8 @@ void efs_rewinddir(efs_dir_t *dirp)
 	dirp->dirent = dirp->_dirent_memobj;
 }
 
-static int efs_stati(efs_t *ctx, efs_ino_t ino, struct efs_stat *statbuf)
+static void _efs_dinode_stat(efs_ino_t ino, struct efs_dinode dinode, struct efs_stat *statbuf)
 {
-	struct efs_dinode dinode;
-	dinode = efs_get_inode(ctx, ino);
-
 	statbuf->st_ino = ino;
 	statbuf->st_mode = dinode.di_mode;
 	statbuf->st_nlink = dinode.di_nlink;
@@ -316,7 +525,11 @@ static int efs_stati(efs_t *ctx, efs_ino_t ino, struct efs_stat *statbuf)
 
 	statbuf->st_ctimespec.tv_sec = dinode.di_ctime;
 	statbuf->st_ctimespec.tv_nsec = 0;
+}
 
+int efs_stati(efs_t *ctx, efs_ino_t ino, struct efs_stat *statbuf)
+{
+	_efs_dinode_stat(ino, efs_get_inode(ctx, ino), statbuf);
 	return 0;
 }
 
@@ -358,26 +571,38 @@ char *mkpath(char *path, char *name)
 	return out;
 }
 
-int efs_nftw(
+/*
+ * Walk the tree below dirpath, calling fn for every entry with the
+ * entry's path, its stat, and the inode of the directory containing
+ * it. Directories are tracked by inode number, so no path is ever
+ * resolved again after dirpath itself.
+ */
+int efs_nftwi(
 	efs_t *efs,
 	const char *dirpath,
-	int (*fn)(const char *fpath, const struct efs_stat *sb)
+	efs_nftwi_fn fn,
+	void *arg
 ) {
-	int rc;
+	int rc = EFS_FTW_CONTINUE;
 	queue_t q;
 	struct qent_s *qe;
+	efs_ino_t ino;
+
+	ino = efs_namei(efs, dirpath);
+	if (ino == EFS_BADINO)
+		errx(1, "couldn't open directory: '%s'", dirpath);
 
 	q = queue_init();
 	if (!q)
 		return -1;
-	queue_add_head(q, strdup(dirpath));
+	queue_add_head_ino(q, strdup(dirpath), ino);
 
 	while ((qe = queue_dequeue(q))) {
 		efs_dir_t *dirp;
 		queue_t dirq;
 		struct efs_dirent *de;
 
-		dirp = efs_opendir(efs, qe->path);
+		dirp = efs_opendiri(efs, qe->ino);
 		if (!dirp)
 			errx(1, "couldn't open directory: '%s'", qe->path);
 
@@ -390,39 +615,147 @@ int efs_nftw(
 			struct efs_stat sb;
 			char *path;
 
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
 			rc = efs_stati(efs, de->d_ino, &sb);
 			if (rc == -1)
 				err(1, "couldn't get stat for '%s'", de->d_name);
 			path = mkpath(qe->path, de->d_name);
 			if (!path)
 				goto nextfile;
-			if ((sb.st_mode & IFMT) == IFDIR) {
-				if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
-					goto nextfile;
-				}
-				queue_add_head(dirq, strdup(path));
-			}
 
 			if (fn) {
-				rc = fn(path, &sb);
-				if (rc != 0) {
-					/* TODO: stop walk */
-				}
+				rc = fn(path, de->d_ino, qe->ino, &sb, arg);
 			} else {
 				printf("%s\n", path);
+				rc = EFS_FTW_CONTINUE;
 			}
+			if (rc == EFS_FTW_STOP) {
+				free(path);
+				break;
+			}
+			if (((sb.st_mode & IFMT) == IFDIR) && (rc != EFS_FTW_SKIP_SUBTREE))
+				queue_add_head_ino(dirq, strdup(path), de->d_ino);
 nextfile:
 			free(path);
 		}
 		efs_closedir(dirp);
 		free(qe->path);
 		free(qe);
+		if (rc == EFS_FTW_STOP) {
+			queue_free(dirq);
+			break;
+		}
 		queue_add_queue_head(q, dirq);
 	}
 	queue_free(q);
 
+	return (rc == EFS_FTW_STOP)? EFS_FTW_STOP: 0;
+}
 
-	return 0;
+/*
+ * Call fn for every allocated inode, in inode number order, reading the
+ * inode tables of the cylinder groups front to back. This finds every
+ * inode in a fraction of the reads efs_nftwi() needs, including those
+ * no directory refers to any more. A part of the tables that can't be
+ * read is skipped, and the number of inodes lost that way is added to
+ * *nbad if nbad isn't NULL. Returns -1 if there are no inode tables
+ * (ISO9660, or a broken superblock), otherwise as efs_nftwi().
+ */
+int efs_scani(efs_t *ctx, efs_scani_fn fn, void *arg, size_t *nbad)
+{
+	struct efs_dinode *buf;
+	const struct efs_dinode *src;
+	struct efs_stat sb;
+	size_t ncg, cgisize, cg, bb, nbbs, i;
+	efs_ino_t ino;
+	ssize_t rc;
+	int frc = EFS_FTW_CONTINUE;
+
+	if (ctx->fstype == EFS_FSTYPE_ISO9660)
+		return -1;
+	ncg = ctx->sb.fs_ncg;
+	cgisize = ctx->sb.fs_cgisize;
+	if ((ctx->sb.fs_ncg <= 0) || (ctx->sb.fs_cgisize <= 0)
+	  || (ctx->sb.fs_cgfsize < ctx->sb.fs_cgisize))
+		return -1;
+
+	buf = malloc(EFS_ITAB_CHUNK * BLKSIZ);
+	if (!buf)
+		return -1;
+
+	for (cg = 0; (cg < ncg) && (frc != EFS_FTW_STOP); cg++) {
+		for (bb = 0; (bb < cgisize) && (frc != EFS_FTW_STOP); bb += nbbs) {
+			size_t firstbb, nbytes;
+
+			nbbs = MIN(cgisize - bb, EFS_ITAB_CHUNK);
+			firstbb = ctx->sb.fs_firstcg + cg * ctx->sb.fs_cgfsize + bb;
+			nbytes = nbbs * BLKSIZ;
+			ino = (cg * cgisize + bb) * EFS_INOPBB;
+
+			/* already converted if efs_load_inodes() was called */
+			if (ctx->itab) {
+				src = &ctx->itab[ino];
+			} else {
+				src = fsptr(ctx->fs, BLKSIZ * firstbb, nbytes);
+				if (!src) {
+					rc = fspread(ctx->fs, buf, nbytes, BLKSIZ * firstbb);
+					if ((rc < 0) || ((size_t)rc != nbytes)) {
+						if (nbad)
+							*nbad += nbbs * EFS_INOPBB;
+						continue;
+					}
+					src = buf;
+				}
+			}
+
+			for (i = 0; i < nbbs * EFS_INOPBB; i++, ino++) {
+				struct efs_dinode dinode;
+
+				dinode = ctx->itab? src[i]: efs_dinodetoh(src[i]);
+				if ((ino < EFS_ROOTINO) || !dinode.di_mode)
+					continue;
+				_efs_dinode_stat(ino, dinode, &sb);
+				frc = fn(ino, &sb, arg);
+				if (frc == EFS_FTW_STOP)
+					break;
+			}
+		}
+	}
+	free(buf);
+
+	return (frc == EFS_FTW_STOP)? EFS_FTW_STOP: 0;
+}
+
+struct _efs_nftw_arg {
+	int (*fn)(const char *fpath, const struct efs_stat *sb);
+};
+
+static int _efs_nftw_trampoline(
+	const char *fpath,
+	efs_ino_t ino,
+	efs_ino_t parent,
+	const struct efs_stat *sb,
+	void *arg
+) {
+	struct _efs_nftw_arg *a = arg;
+	(void)ino;
+	(void)parent;
+	return a->fn(fpath, sb);
+}
+
+int efs_nftw(
+	efs_t *efs,
+	const char *dirpath,
+	int (*fn)(const char *fpath, const struct efs_stat *sb)
+) {
+	struct _efs_nftw_arg a;
+
+	if (!fn)
+		return efs_nftwi(efs, dirpath, NULL, NULL);
+
+	a.fn = fn;
+	return efs_nftwi(efs, dirpath, _efs_nftw_trampoline, &a);
 }
 
 const char *efs_strerror(efs_err_t e)
@@ -453,9 +786,11 @@ const char *efs_strerror(efs_err_t e)
 		case EFS_ERR_IS_BSD:
 			return "RISCos format is not supported";
 		case EFS_ERR_IS_ISO9660:
-			return "ISO9660 format is not supported";
+			return "ISO9660 image without a volume header";
 		case EFS_ERR_IS_XFS:
 			return "XFS format is not supported";
+		case EFS_ERR_WRITEFAIL:
+			return "write error";
 		default:
 			return "unknown error";
 	}
@@ -493,11 +828,8 @@ void errefs(int eval, efs_err_t e, const char *fmt, ...)
 	va_end(ap);
 }
 
-#define MAX(a,b) (a>b?a:b)
-#define MIN(a,b) (a>b?b:a)
-
 static struct efs_extent *_efs_get_extents(efs_t *ctx, struct efs_dinode *dinode);
-static struct efs_extent *_efs_find_extent(struct efs_extent *exs, unsigned numextents, size_t pos);
+static const struct efs_extmap_ent *_efs_find_extent(efs_file_t *file, size_t lbn);
 static efs_ino_t _efs_nameiat(efs_t *ctx, efs_ino_t ino, const char *name);
 static efs_file_t *_efs_file_openi(efs_t *ctx, efs_ino_t ino);
 
@@ -639,57 +971,127 @@ out_error:
 	return NULL;
 }
 
-static struct efs_extent *_efs_find_extent(struct efs_extent *exs, unsigned numextents, size_t pos)
+/*
+ * Return the extents of inode ino, decoded and in file order, in a
+ * malloc'd array that the caller must free. The number of extents
+ * is stored in *nents. Returns NULL on error.
+ */
+static struct efs_extmap_ent *_efs_get_extmap(efs_t *ctx, struct efs_dinode *dinode)
 {
-	unsigned i;
+	struct efs_extent *exs;
+	struct efs_extmap_ent *out;
+	size_t i, numextents;
+
+	if (dinode->di_numextents < 0)
+		return NULL;
+	numextents = dinode->di_numextents;
+
+	exs = _efs_get_extents(ctx, dinode);
+	if (!exs)
+		return NULL;
+
+	out = calloc(numextents + 1, sizeof(*out));
+	if (!out) {
+		free(exs);
+		return NULL;
+	}
+
 	for (i = 0; i < numextents; i++) {
-		struct efs_extent *ex;
-		ex = &exs[i];
-		/* too low? */
-		if ((efs_extent_get_offset(*ex) * BLKSIZ) > pos)
-			continue;
-		/* too high? */
-		if (((efs_extent_get_offset(*ex) + ex->ex_length) * BLKSIZ) <= pos)
-			continue;
-		return ex;
+		out[i].bn = efs_extent_get_bn(exs[i]);
+		out[i].offset = efs_extent_get_offset(exs[i]);
+		out[i].length = exs[i].ex_length;
 	}
-	return NULL;
+
+	free(exs);
+	return out;
 }
 
-static unsigned _efs_nbytes_this_extent(
-	struct efs_extent *ex,
-	unsigned pos,
-	unsigned nbytes
-) {
-	__label__ out_error;
-	size_t start, end;
-	unsigned bytes_left_in_extent;
-	start = BLKSIZ * efs_extent_get_offset(*ex);
-	end = BLKSIZ * (efs_extent_get_offset(*ex) + ex->ex_length);
+struct efs_extmap_ent *efs_get_extmap(efs_t *ctx, efs_ino_t ino, size_t *nents)
+{
+	struct efs_dinode dinode;
+	struct efs_extmap_ent *out;
 
-	/* assert position is within extent */
-	if (pos < start)
-		goto out_error;
-	if (pos > end)
-		goto out_error;
+	if (ctx->fstype == EFS_FSTYPE_ISO9660)
+		return isofs_get_extmap(ctx, ino, nents);
 
-	/* move pos to be relative to start of extent */
-	pos -= start;
-	bytes_left_in_extent = end - start - pos;
-	return MIN(bytes_left_in_extent, nbytes);
-out_error:
-	return 0;
+	dinode = efs_get_inode(ctx, ino);
+	out = _efs_get_extmap(ctx, &dinode);
+	if (out)
+		*nents = dinode.di_numextents;
+	return out;
 }
 
-static unsigned _efs_nbytes_firstbn(
-	struct efs_extent *ex,
-	unsigned pos
-) {
-	unsigned blkOff, newpos;
+/*
+ * Return the extent map of an open file. The map belongs to the file
+ * and is valid until it is closed.
+ */
+const struct efs_extmap_ent *efs_fextmap(efs_file_t *file, size_t *nents)
+{
+	*nents = file->numextents;
+	return file->map;
+}
+
+/*
+ * Find the extent holding file block lbn. Sequential reads almost
+ * always stay in the current extent or move on to the next one, so
+ * try those first and only then binary search the map.
+ */
+static const struct efs_extmap_ent *_efs_find_extent(efs_file_t *file, size_t lbn)
+{
+	const struct efs_extmap_ent *ex;
+	size_t lo, hi, mid;
+
+#define IN_EXTENT(ex, lbn) \
+	(((lbn) >= (ex)->offset) && ((lbn) < (ex)->offset + (ex)->length))
+
+	if (file->cur < file->numextents) {
+		ex = &file->map[file->cur];
+		if (IN_EXTENT(ex, lbn))
+			return ex;
+		if ((file->cur + 1 < file->numextents) && IN_EXTENT(ex + 1, lbn)) {
+			file->cur++;
+			return ex + 1;
+		}
+	}
+
+	/* extents are sorted by offset; find the last one at or before lbn */
+	lo = 0;
+	hi = file->numextents;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (file->map[mid].offset <= lbn)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+
+	ex = &file->map[lo - 1];
+	if (!IN_EXTENT(ex, lbn))
+		return NULL;
+	file->cur = lo - 1;
+	return ex;
+
+#undef IN_EXTENT
+}
 
-	newpos = pos - (BLKSIZ * efs_extent_get_offset(*ex));
-	blkOff = newpos / BLKSIZ;
-	return blkOff;
+/*
+ * Read blocks of an open file. Directories are metadata and go through
+ * the block cache like inodes do; file contents go around it, so that
+ * reading files doesn't push out the blocks the walk still needs.
+ */
+static efs_err_t _efs_file_get_blocks(efs_file_t *file, void *buf, size_t firstlbn, size_t nblks)
+{
+	ssize_t rc;
+
+	if ((file->dinode.di_mode & IFMT) == IFDIR)
+		return efs_get_blocks(file->ctx, buf, firstlbn, nblks);
+
+	rc = fspread(file->ctx->fs, buf, BLKSIZ * nblks, BLKSIZ * firstlbn);
+	if (rc != (ssize_t)(BLKSIZ * nblks))
+		return EFS_ERR_READFAIL;
+	return EFS_ERR_OK;
 }
 
 size_t efs_fread_blocks(
@@ -699,7 +1101,7 @@ size_t efs_fread_blocks(
 	efs_file_t *file
 ) {
 	efs_err_t erc;
-	struct efs_extent *ex;
+	const struct efs_extmap_ent *ex;
 	unsigned done;
 
 	if (!ptr) {
@@ -714,19 +1116,15 @@ size_t efs_fread_blocks(
 		file
 	);
 #endif
-	if ((numblocks==1) && (file->blocknum == lbn)) {
-		memcpy(ptr, file->blockbuf, BLKSIZ);
-		return 1;
-	}
 	done = 0;
 	while (done < numblocks) {
 		unsigned offset_in_extent;
 		unsigned blocks_this_extent;
 
-		ex = _efs_find_extent(file->exs, file->numextents, lbn * BLKSIZ);
+		ex = _efs_find_extent(file, lbn);
 		if (!ex) errx(1, "in efs_fread_blocks");
-		offset_in_extent = lbn - efs_extent_get_offset(*ex);
-		blocks_this_extent = MIN(numblocks, ex->ex_length - offset_in_extent);
+		offset_in_extent = lbn - ex->offset;
+		blocks_this_extent = MIN(numblocks - done, ex->length - offset_in_extent);
 #if 0
 		printf("blocks_this_extent: %u\n", blocks_this_extent);
 #endif
@@ -736,26 +1134,70 @@ size_t efs_fread_blocks(
 		hexdump(ptr, blocks_this_extent * BLKSIZ);
 #endif
 
-		erc = efs_get_blocks(file->ctx, ptr, efs_extent_get_bn(*ex) + offset_in_extent, blocks_this_extent);
+		erc = _efs_file_get_blocks(file, ptr, ex->bn + offset_in_extent, blocks_this_extent);
 		if (erc) errefs(1, erc, "in efs_fread_blocks");
 #if 0
 		printf("after:\n");
 		hexdump(ptr, blocks_this_extent * BLKSIZ);
 #endif
 		ptr += blocks_this_extent * BLKSIZ;
+		lbn += blocks_this_extent;
 		done += blocks_this_extent;
 	}
-	if (numblocks == 1) {
-		file->blocknum = lbn;
-		memcpy(file->blockbuf, ptr - BLKSIZ, BLKSIZ);
-	}
-
 #if 0
 	printf("efs_fread_blocks returning: %zu\n", numblocks);
 #endif
 	return numblocks;
 }
 
+/* the buffer the readahead window is in */
+static uint8_t *_efs_window(efs_file_t *file)
+{
+	return file->rabuf? file->rabuf: file->blockbuf;
+}
+
+/*
+ * Fill the readahead window starting at file block lbn, with as many
+ * blocks as fit, stopping at the end of the extent and of the file.
+ * The window is a single block inside the file until a read picks up
+ * right where the last one stopped; only then is the full window
+ * allocated, no bigger than what's left of the file.
+ */
+static bool _efs_fill_window(efs_file_t *file, size_t lbn)
+{
+	const struct efs_extmap_ent *ex;
+	size_t nblks, lastblk;
+	efs_err_t erc;
+
+	lastblk = (file->nbytes + BLKSIZ - 1) / BLKSIZ;
+	if (!file->rabuf && file->ranblks && (lbn == file->rablk + file->ranblks)
+	  && (lbn + 1 < lastblk) && (file->rasize > BLKSIZ)) {
+		file->rabufsize = MIN(file->rasize, (lastblk - lbn) * BLKSIZ);
+		file->rabuf = malloc(file->rabufsize);
+		/* without it, carry on a block at a time */
+	}
+
+	ex = _efs_find_extent(file, lbn);
+	if (!ex)
+		return false;
+
+	nblks = file->rabuf? file->rabufsize / BLKSIZ: 1;
+	nblks = MIN(nblks, ex->offset + ex->length - lbn);
+	if (lbn < lastblk)
+		nblks = MIN(nblks, lastblk - lbn);
+	else
+		nblks = 1;
+
+	file->ranblks = 0;
+	erc = _efs_file_get_blocks(file, _efs_window(file), ex->bn + (lbn - ex->offset), nblks);
+	if (erc != EFS_ERR_OK)
+		return false;
+
+	file->rablk = lbn;
+	file->ranblks = nblks;
+	return true;
+}
+
 static size_t _efs_fread_aux(
 	void *ptr,
 	size_t size,
@@ -770,67 +1212,67 @@ static size_t _efs_fread_aux(
 #endif
 	if (!size) return 0;
 
-	/* start with a partial block? */
-	if (file->pos % BLKSIZ) {
-		unsigned start, len, blknum;
+	while (size) {
+		size_t start, len, blknum;
 		size_t rc;
-		uint8_t *buf = calloc(BLKSIZ, 1);
 
 		start = file->pos % BLKSIZ;
-		len = MIN(size, (BLKSIZ - start));
 		blknum = file->pos / BLKSIZ;
 
-		rc = efs_fread_blocks(buf, blknum, 1, file);
-		if (rc != 1) return 0;
-
-		memcpy(ptr, &buf[start], len);
-		file->pos += len;
-		ptr += len;
-		size -= len;
-		free(buf);
-		buf = NULL;
-	}
+		/* already in the readahead window? */
+		if (file->ranblks && (blknum >= file->rablk)
+		  && (blknum < file->rablk + file->ranblks)) {
+			start = file->pos - file->rablk * BLKSIZ;
+			len = MIN(size, file->ranblks * BLKSIZ - start);
+			memcpy(ptr, &_efs_window(file)[start], len);
+			file->pos += len;
+			ptr += len;
+			size -= len;
+			continue;
+		}
 
-	/* whole blocks? */
-	if (!(file->pos % BLKSIZ) && (size >= BLKSIZ)) {
-		unsigned startblk, nblks;
-		size_t rc;
+		/* reads at least as big as the window go straight to the caller */
+		if (!start && (size >= file->rasize)) {
+			unsigned nblks;
 
-		startblk = file->pos / BLKSIZ;
-		nblks = size / BLKSIZ;
+			nblks = size / BLKSIZ;
 #if 0
-		printf("file->pos: %u, size: %lu\n", file->pos, size);
-		printf("nblks: %u, startblk: %u\n", nblks, startblk);
+			printf("file->pos: %u, size: %lu\n", file->pos, size);
+			printf("nblks: %u, startblk: %zu\n", nblks, blknum);
 #endif
-		rc = efs_fread_blocks(ptr, startblk, nblks, file);
-		if (rc != nblks) return 0;
+			rc = efs_fread_blocks(ptr, blknum, nblks, file);
+			if (rc != nblks) return 0;
 
-		file->pos += nblks * BLKSIZ;
-		ptr += nblks * BLKSIZ;
-		size -= nblks * BLKSIZ;
-	}
-
-	/* end with a partial block? */
-	if (!(file->pos % BLKSIZ) && size > 0 && size < BLKSIZ) {
-		size_t rc;
-		uint8_t *buf = calloc(BLKSIZ, 1);
-		unsigned blknum;
-
-		blknum = file->pos / BLKSIZ;
-
-		rc = efs_fread_blocks(buf, blknum, 1, file);
-		if (rc != 1) return 0;
+			file->pos += nblks * BLKSIZ;
+			ptr += nblks * BLKSIZ;
+			size -= nblks * BLKSIZ;
+			continue;
+		}
 
-		memcpy(ptr, buf, size);
-		file->pos += size;
-		ptr += size;
-		free(buf);
-		buf = NULL;
+		if (!_efs_fill_window(file, blknum))
+			return 0;
 	}
 
 	return 1;
 }
 
+/*
+ * Set the size of the readahead window of an open file. Sizes are
+ * rounded down to whole blocks, with a minimum of one block.
+ */
+void efs_fset_readahead(efs_file_t *file, size_t nbytes)
+{
+	nbytes -= nbytes % BLKSIZ;
+	if (nbytes < BLKSIZ)
+		nbytes = BLKSIZ;
+
+	free(file->rabuf);
+	file->rabuf = NULL;
+	file->rabufsize = 0;
+	file->ranblks = 0;
+	file->rasize = nbytes;
+}
+
 size_t efs_fread(
 	void *ptr,
 	size_t size,
@@ -903,6 +1345,208 @@ efs_file_t *efs_fopen(
 	return efs_fopenat(ctx, &dir, path);
 }
 
+efs_file_t *efs_fopeni(efs_t *ctx, efs_ino_t ino)
+{
+	if (ino == EFS_BADINO) {
+		errno = ENOENT;
+		return NULL;
+	}
+	return _efs_file_openi(ctx, ino);
+}
+
+/*
+ * Like readlink(2): places the target of the symlink at ino in buf,
+ * truncated to bufsiz bytes and not null-terminated. Returns the
+ * number of bytes placed in buf, or -1 on error.
+ */
+ssize_t efs_readlinki(efs_t *ctx, efs_ino_t ino, char *buf, size_t bufsiz)
+{
+	efs_file_t *f;
+	size_t len;
+	size_t sz;
+
+	/* Rock Ridge keeps the target in the directory record */
+	if (ctx->fstype == EFS_FSTYPE_ISO9660)
+		return isofs_readlinki(ctx, ino, buf, bufsiz);
+
+	f = efs_fopeni(ctx, ino);
+	if (!f)
+		return -1;
+
+	if ((f->dinode.di_mode & IFMT) != IFLNK) {
+		efs_fclose(f);
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = MIN(f->nbytes, bufsiz);
+	if (len) {
+		sz = efs_fread(buf, len, 1, f);
+		if (sz != 1) {
+			efs_fclose(f);
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	efs_fclose(f);
+	return len;
+}
+
+static efs_err_t _efs_write_all(int fd, const void *buf, size_t nbytes)
+{
+	ssize_t rc;
+
+	while (nbytes) {
+		rc = write(fd, buf, nbytes);
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			return EFS_ERR_WRITEFAIL;
+		}
+		buf = (const uint8_t *)buf + rc;
+		nbytes -= rc;
+	}
+
+	return EFS_ERR_OK;
+}
+
+/*
+ * Write nbytes starting at offset in the partition to fd. If the
+ * partition is mapped, the data is written straight out of the
+ * mapping; on Linux the kernel is asked to copy between the two
+ * descriptors. Otherwise, or if that fails, it goes through *bufp,
+ * which is allocated on first use and freed by the caller.
+ */
+static efs_err_t _efs_copy_range(efs_t *ctx, int fd, size_t offset, size_t nbytes, uint8_t **bufp)
+{
+	fileslice_t *fs = ctx->fs;
+	const void *src;
+	efs_err_t erc;
+	ssize_t rc;
+
+	if ((offset > fs->size) || (nbytes > fs->size - offset))
+		return EFS_ERR_READFAIL;
+
+	src = fsptr(fs, offset, nbytes);
+	if (src)
+		return _efs_write_all(fd, src, nbytes);
+
+#ifdef __linux__
+	{
+		off_t off = fs->base + offset;
+
+		while (nbytes) {
+			rc = copy_file_range(fs->fd, &off, fd, NULL, nbytes, 0);
+			if ((rc == -1) && (errno == EINTR))
+				continue;
+			if (rc <= 0)
+				break;
+			nbytes -= rc;
+		}
+		while (nbytes) {
+			rc = sendfile(fd, fs->fd, &off, nbytes);
+			if ((rc == -1) && (errno == EINTR))
+				continue;
+			if (rc <= 0)
+				break;
+			nbytes -= rc;
+		}
+		offset = off - fs->base;
+	}
+#endif
+
+	while (nbytes) {
+		size_t len;
+
+		if (!*bufp) {
+			*bufp = malloc(EFS_MAXEXTENTLEN * BLKSIZ);
+			if (!*bufp)
+				return EFS_ERR_NOMEM;
+		}
+
+		len = MIN(nbytes, EFS_MAXEXTENTLEN * BLKSIZ);
+		rc = fspread(fs, *bufp, len, offset);
+		if ((rc < 0) || ((size_t)rc != len))
+			return EFS_ERR_READFAIL;
+		erc = _efs_write_all(fd, *bufp, len);
+		if (erc != EFS_ERR_OK)
+			return erc;
+		offset += len;
+		nbytes -= len;
+	}
+
+	return EFS_ERR_OK;
+}
+
+/*
+ * Write the contents of inode ino to fd, at its current position.
+ * The file is copied one extent at a time, each in as few calls as
+ * the backend allows.
+ */
+efs_err_t efs_copyi(efs_t *ctx, efs_ino_t ino, int fd)
+{
+	struct efs_dinode dinode;
+	struct efs_extmap_ent *map;
+	size_t nents;
+	efs_err_t erc;
+
+	dinode = efs_get_inode(ctx, ino);
+	if (dinode.di_size < 0)
+		return EFS_ERR_INVAL;
+
+	map = efs_get_extmap(ctx, ino, &nents);
+	if (!map)
+		return EFS_ERR_READFAIL;
+
+	erc = efs_copy_extmap(ctx, map, nents, dinode.di_size, fd);
+	free(map);
+	return erc;
+}
+
+/*
+ * Like efs_copyi(), for a file of size bytes whose extent map is
+ * already known, say from an index, so its inode needn't be read.
+ */
+efs_err_t efs_copy_extmap(efs_t *ctx, const struct efs_extmap_ent *map, size_t nents, size_t size, int fd)
+{
+	__label__ out;
+	uint8_t *buf = NULL;
+	size_t i, done;
+	efs_err_t erc = EFS_ERR_OK;
+
+	done = 0;
+	for (i = 0; (i < nents) && (done < size); i++) {
+		size_t nbytes;
+
+		/* EFS files have no holes */
+		if (map[i].offset * BLKSIZ != done) {
+			erc = EFS_ERR_READFAIL;
+			goto out;
+		}
+
+		nbytes = MIN(map[i].length * BLKSIZ, size - done);
+		erc = _efs_copy_range(ctx, fd, map[i].bn * BLKSIZ, nbytes, &buf);
+		if (erc != EFS_ERR_OK)
+			goto out;
+		done += nbytes;
+	}
+	if (done < size)
+		erc = EFS_ERR_READFAIL;
+
+out:
+	free(buf);
+	return erc;
+}
+
+/*
+ * Look up name, which may contain slashes, relative to directory dir.
+ */
+efs_ino_t efs_lookupi(efs_t *ctx, efs_ino_t dir, const char *name)
+{
+	return _efs_nameiat(ctx, dir, name);
+}
+
 static efs_file_t *_efs_file_openi(efs_t *ctx, efs_ino_t ino)
 {
 	__label__ out_error, out_ok;
@@ -919,7 +1563,7 @@ static efs_file_t *_efs_file_openi(efs_t *ctx, efs_ino_t ino)
 	out->error = false;
 	out->dinode = efs_get_inode(ctx, ino);
 	out->nbytes = out->dinode.di_size;
-	out->blocknum = -1;
+	out->rasize = ctx->readahead;
 
 	/* validate inode */
 	if (out->dinode.di_version != 0)
@@ -936,9 +1580,16 @@ static efs_file_t *_efs_file_openi(efs_t *ctx, efs_ino_t ino)
 		goto out_error;
 	}
 
-	out->numextents = out->dinode.di_numextents;
-	out->exs = _efs_get_extents(ctx, &(out->dinode));
-	if (!out->exs)
+	if (ctx->fstype == EFS_FSTYPE_ISO9660) {
+		size_t nents;
+
+		out->map = isofs_get_extmap(ctx, ino, &nents);
+		out->numextents = nents;
+	} else {
+		out->numextents = out->dinode.di_numextents;
+		out->map = _efs_get_extmap(ctx, &(out->dinode));
+	}
+	if (!out->map)
 		goto out_error;
 
 	goto out_ok;
@@ -952,7 +1603,8 @@ out_error:
 
 int efs_fclose(efs_file_t *file)
 {
-	free(file->exs);
+	free(file->rabuf);
+	free(file->map);
 	free(file);
 	return 0;
 }
@@ -1039,6 +1691,9 @@ static struct efs_dirent *_efs_read_dirblks(efs_t *ctx, efs_ino_t ino)
 	efs_file_t *file;
 	unsigned blk;
 
+	if (ctx->fstype == EFS_FSTYPE_ISO9660)
+		return isofs_read_dir(ctx, ino);
+
 	di = efs_get_inode(ctx, ino);
 	if ((di.di_mode & IFMT) != IFDIR)
 		return NULL;
@@ -1066,14 +1721,21 @@ static struct efs_dirent *_efs_read_dirblks(efs_t *ctx, efs_ino_t ino)
 	}
 #endif
 
+	/* callers decide whether an unreadable directory is fatal */
 	file = _efs_file_openi(ctx, ino);
-	if (!file)
-		errx(1, "in _efs_read_dirblks while opening directory");
+	if (!file) {
+		free(out);
+		return NULL;
+	}
 	for (blk = 0; blk < (file->nbytes / BLKSIZ); blk++) {
 		unsigned slot;
 		memset(&dirblk, 0xba, sizeof(dirblk));
 		sRc = efs_fread(&dirblk, sizeof(dirblk), 1, file);
-		if (sRc != 1) errx(1, "while reading dirblk blk");
+		if (sRc != 1) {
+			efs_fclose(file);
+			free(out);
+			return NULL;
+		}
 		if (dirblk.magic != htobe16(EFS_DIRBLK_MAGIC)) {
 			warnx("skipping block %u", blk);
 #if 0
@@ -1088,6 +1750,10 @@ static struct efs_dirent *_efs_read_dirblks(efs_t *ctx, efs_ino_t ino)
 				struct efs_dirent de;
 				slotOffset = dirblk.space[slot] << 1;
 				dent = (struct efs_dent *)((uint8_t *)(&dirblk) + slotOffset);
+				/* a damaged block can point past its own end */
+				if ((slotOffset + sizeof(*dent) > sizeof(dirblk))
+				  || (slotOffset + sizeof(*dent) + dent->d_namelen > sizeof(dirblk)))
+					continue;
 				memcpy(&de.d_name, dent->d_name, dent->d_namelen);
 				de.d_name[dent->d_namelen] = '\0';
 				de.d_ino = be32toh(dent->l);
@@ -1121,135 +1787,199 @@ static struct efs_dirent *_efs_read_dirblks(efs_t *ctx, efs_ino_t ino)
 	return out;
 }
 
-/* returns the leftmost path part in firstpart[],
- *
+/*
+ * Find the entry called name (len bytes, not null-terminated) in
+ * directory dir. The directory is parsed and cached on first use.
  */
-static int _efs_nextpath(
-	const char *in,
-	char *firstpart,
-	const char **remaining
-) {
-	const char *t;
-	off_t len;
+static efs_ino_t _efs_dir_lookup(efs_t *ctx, efs_ino_t dir, const char *name, size_t len)
+{
+	struct efs_dirent *dirents, *de;
+	efs_ino_t out = EFS_BADINO;
+	int rc;
 
-	if (!in) {
-		return -1;
+	if (ctx->dcache) {
+		rc = dcache_lookup(ctx->dcache, dir, name, len, &out);
+		if (rc == 1)
+			return out;
+		if (rc == 0)
+			return EFS_BADINO;
 	}
 
-	/* name too large */
-	if (strlen(in) > EFS_MAX_NAME) {
-		return -1;
-	}
+	dirents = _efs_read_dirblks(ctx, dir);
+	if (!dirents)
+		return EFS_BADINO;
+	if (ctx->dcache)
+		dcache_add_dir(ctx->dcache, dir, dirents);
 
-	/* empty name */
-	if (!strcmp("", in) || !strcmp("/", in)) {
-		strcpy(firstpart, ".");
-		*remaining = NULL;
-		return 0;
+	for (de = dirents; de->d_ino; de++) {
+		if ((strlen(de->d_name) == len) && !memcmp(de->d_name, name, len)) {
+#if 0
+			printf("found it at inode %x\n", de->d_ino);
+#endif
+			out = de->d_ino;
+			break;
+		}
 	}
 
-	/* no slashes */
-	t = strchr(in, '/');
-	if (!t) {
-		strncpy(firstpart, in, EFS_MAX_NAME);
-		*remaining = NULL;
-		return 0;
-	}
+	free(dirents);
+	return out;
+}
 
-	len = t - in;
-	if (len > EFS_MAX_NAME) {
-		return -1;
+/*
+ * Resolve name one component at a time, starting from directory ino.
+ * If path is not NULL, name points somewhere inside it, path is
+ * relative to the root, and every directory prefix resolved along
+ * the way is remembered in the path cache.
+ *
+ * An empty name, or one ending in a slash, must name a directory.
+ */
+static efs_ino_t _efs_resolve(efs_t *ctx, efs_ino_t ino, const char *path, const char *name)
+{
+	const char *p, *end;
+	size_t len;
+
+	p = name;
+	for (;;) {
+		while (*p == '/')
+			p++;
+		if (!*p)
+			break;
+
+		end = strchr(p, '/');
+		if (!end)
+			end = p + strlen(p);
+		len = end - p;
+		if (len > EFS_MAX_NAME)
+			return EFS_BADINO;
+
+		ino = _efs_dir_lookup(ctx, ino, p, len);
+		if (ino == EFS_BADINO)
+			return EFS_BADINO;
+		if (path && ctx->dcache)
+			dcache_add_path(ctx->dcache, path, end - path, ino);
+		p = end;
 	}
 
-	strncpy(firstpart, in, len);
-	firstpart[len] = '\0';
-	*remaining = (const char *)(t + 1);
-	return 0;
+	/* "" and "foo/" only make sense for directories */
+	if ((p == name) || (p[-1] == '/'))
+		ino = _efs_dir_lookup(ctx, ino, ".", 1);
+
+	return ino;
 }
 
 static efs_ino_t _efs_nameiat(efs_t *ctx, efs_ino_t ino, const char *name)
 {
-	int rc;
-	struct efs_dirent *dirents;
-	char firstpart[EFS_MAX_NAME + 1];
-	const char *remaining;
-	struct efs_dirent *de;
-	efs_ino_t myino;
-
 	/*
 	printf("_efs_nameiat: ctx %p, name '%s', ino %u\n",
 	       ctx, name, ino);
 	*/
 
-	dirents = _efs_read_dirblks(ctx, ino);
-	if (!dirents)
+	if (!name)
 		return EFS_BADINO;
 
-	rc = _efs_nextpath(name, firstpart, &remaining);
-	if (rc == -1) {
-		free(dirents);
-		return EFS_BADINO;
-	}
-#if 0
-	printf("firstpart: '%s'\n", firstpart);
-	printf("remaining: '%s'\n", remaining);
-#endif
+	return _efs_resolve(ctx, ino, NULL, name);
+}
 
-	for (de = dirents; (myino = de->d_ino); de++) {
-		if (!strcmp(de->d_name, firstpart)) {
-#if 0
-			printf("found it at inode %x\n", de->d_ino);
-#endif
-			if (!remaining) {
-				free(dirents);
-				return myino;
-			} else {
-				free(dirents);
-				return _efs_nameiat(ctx, myino, remaining);
-			}
-		}
-	}
+static efs_ino_t efs_namei(efs_t *ctx, const char *name)
+{
+	efs_ino_t ino;
+	size_t len, plen;
 
-	free(dirents);
+	if (!name)
+		return EFS_BADINO;
+	if (!ctx->dcache)
+		return _efs_resolve(ctx, EFS_BLK_ROOTINO, NULL, name);
+
+	len = strlen(name);
+	if (dcache_lookup_path(ctx->dcache, name, len, &ino))
+		return ino;
+
+	/* Start from the longest prefix we've resolved before. */
+	for (plen = len; plen > 0; plen--) {
+		if ((name[plen - 1] == '/')
+		  && dcache_lookup_path(ctx->dcache, name, plen - 1, &ino))
+			return _efs_resolve(ctx, ino, name, name + plen - 1);
+	}
 
-	return EFS_BADINO;
+	return _efs_resolve(ctx, EFS_BLK_ROOTINO, name, name);
 }
 
-static efs_ino_t efs_namei(efs_t *ctx, const char *name)
+
+#ifdef HAVE_MMAP
+/*
+ * Try to map the whole slice into memory. The mapping is clipped to
+ * the end of the file, since touching pages past EOF raises SIGBUS.
+ * On failure the slice is left unmapped and reads use pread().
+ */
+static void _fsmap(fileslice_t *fs, size_t filesize)
 {
-	return _efs_nameiat(ctx, EFS_BLK_ROOTINO, name);
+	long pagesize;
+	uint64_t aligned;
+	size_t len;
+	void *map;
+
+	if (fs->base >= filesize)
+		return;
+	len = MIN(fs->size, filesize - fs->base);
+	if (!len)
+		return;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (pagesize <= 0)
+		return;
+	aligned = fs->base & ~((uint64_t)pagesize - 1);
+
+	map = mmap(NULL, len + (fs->base - aligned), PROT_READ, MAP_SHARED,
+		fs->fd, (off_t)aligned);
+	if (map == MAP_FAILED)
+		return;
+
+	fs->map = map;
+	fs->maplen = len + (fs->base - aligned);
+	fs->mapoff = fs->base - aligned;
+	fs->size = len;
 }
+#endif
 
-
-fileslice_t *fsopen(FILE *f, size_t base, size_t size)
+/*
+ * Open a window of size bytes starting at byte base of fd. A size of
+ * zero means "up to the end of the file". The slice does not own fd;
+ * the caller must keep it open until fsclose().
+ */
+fileslice_t *fsopen(int fd, uint64_t base, size_t size)
 {
 	__label__ out_error;
 	fileslice_t *fs;
-	fpos_t old_pos;
+	struct stat st;
+	off_t total;
 	int rc;
-	(void)size;
 
 	fs = calloc(1, sizeof(fileslice_t));
 	if (!fs) goto out_error;
 
-	/* Save old position */
-	rc = fgetpos(f, &old_pos);
+	rc = fstat(fd, &st);
 	if (rc == -1) goto out_error;
 
-	/* Seek to base address */
-	rc = fseek(f, base, SEEK_SET);
-	if (rc == -1) goto out_error;
-
-	/* Save as base pos */
-	rc = fgetpos(f, &fs->base);
-	if (rc == -1) goto out_error;
+	if (!size) {
+		/* block devices, like a CD drive, report a size of 0 */
+		if (S_ISREG(st.st_mode))
+			total = st.st_size;
+		else
+			total = lseek(fd, 0, SEEK_END);
+		if ((total <= 0) || (base >= (uint64_t)total))
+			goto out_error;
+		size = (uint64_t)total - base;
+	}
 
-	/* Restore old position */
-	rc = fsetpos(f, &old_pos);
-	if (rc == -1) goto out_error;
+	fs->fd = fd;
+	fs->base = base;
+	fs->size = size;
+	fs->pos = 0;
 
-	fs->f = f;
-	fs->cur = fs->base;
+#ifdef HAVE_MMAP
+	if (S_ISREG(st.st_mode) && (st.st_size > 0))
+		_fsmap(fs, (size_t)st.st_size);
+#endif
 
 	return fs;
 
@@ -1260,100 +1990,116 @@ out_error:
 
 int fsclose(fileslice_t *fs)
 {
+	if (!fs)
+		return 0;
+#ifdef HAVE_MMAP
+	if (fs->map)
+		munmap(fs->map, fs->maplen);
+#endif
 	free(fs);
 	return 0;
 }
 
-size_t fsread(void *ptr, size_t size, size_t nmemb, fileslice_t *fs)
+/*
+ * Returns a pointer to len bytes at offset within a mapped slice,
+ * or NULL if the slice is not mapped or the range is out of bounds.
+ */
+const void *fsptr(fileslice_t *fs, size_t offset, size_t len)
 {
-	__label__ out_error;
-	ssize_t rc, rc2;
-	fpos_t old_pos;
+	if (!fs->map)
+		return NULL;
+	if ((offset > fs->size) || (len > fs->size - offset))
+		return NULL;
+	return fs->map + fs->mapoff + offset;
+}
 
-	/* Save old position */
-	rc = fgetpos(fs->f, &old_pos);
-	if (rc == -1) goto out_error;
+/*
+ * Read up to nbytes at offset within the slice, without touching the
+ * slice cursor. Reads are clipped at the end of the slice, so a read
+ * can never spill into the next partition. Returns the number of
+ * bytes read, or -1 on error.
+ *
+ * This is safe to call from several threads on the same slice.
+ */
+ssize_t fspread(fileslice_t *fs, void *buf, size_t nbytes, size_t offset)
+{
+	size_t done = 0;
 
-	/* Restore cursor */
-	rc = fsetpos(fs->f, &fs->cur);
-	if (rc == -1) goto out_error;
+	if (offset >= fs->size)
+		return 0;
+	nbytes = MIN(nbytes, fs->size - offset);
 
-	/* Do the read */
-#if 0
-	printf("fread: ptr: %p, size: %zu, nmemb: %zu, fslice: %p, pos: %ld\n",
-		ptr,
-		size,
-		nmemb,
-		fs,
-		ftell(fs->f)
-	);
+	if (fs->map) {
+		memcpy(buf, fs->map + fs->mapoff + offset, nbytes);
+		return nbytes;
+	}
+
+	while (done < nbytes) {
+		ssize_t rc;
+#ifdef __MINGW32__
+		/* no pread here, so keep the seek and read together */
+		static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+		pthread_mutex_lock(&lock);
+		if (lseek(fs->fd, fs->base + offset + done, SEEK_SET) == -1) {
+			pthread_mutex_unlock(&lock);
+			return -1;
+		}
+		rc = read(fs->fd, (uint8_t *)buf + done, nbytes - done);
+		pthread_mutex_unlock(&lock);
+#else
+		rc = pread(fs->fd, (uint8_t *)buf + done, nbytes - done,
+			(off_t)(fs->base + offset + done));
 #endif
-	rc2 = fread(ptr, size, nmemb, fs->f);
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (rc == 0)
+			break;
+		done += rc;
+	}
 
-	/* Save cursor */
-	rc = fgetpos(fs->f, &fs->cur);
-	if (rc == -1) goto out_error;
+	return done;
+}
 
-	/* Restore old position */
-	rc = fsetpos(fs->f, &old_pos);
-	if (rc == -1) goto out_error;
+size_t fsread(void *ptr, size_t size, size_t nmemb, fileslice_t *fs)
+{
+	ssize_t rc;
 
-	return rc2;
+	if (!size)
+		return 0;
 
-out_error:
-	return 0;
+	rc = fspread(fs, ptr, size * nmemb, fs->pos);
+	if (rc == -1)
+		return 0;
+	fs->pos += rc;
+
+	return rc / size;
 }
 
 int fsseek(fileslice_t *fs, long offset, int whence)
 {
-	__label__ out_error;
-	int rc;
-	fpos_t old_pos;
-
-#if 0
-	printf("fseek(%p, %lu, %d\n", fs, offset, whence);
-#endif
+	long newpos;
 
-	if ((whence != SEEK_SET) && (whence != SEEK_CUR)) {
+	switch (whence) {
+	case SEEK_SET:
+		newpos = 0;
+		break;
+	case SEEK_CUR:
+		newpos = fs->pos;
+		break;
+	default:
 		/* SEEK_END is not supported */
-		goto out_error;
-	}
-
-	/* Save old position */
-	rc = fgetpos(fs->f, &old_pos);
-	if (rc == -1) goto out_error;
-
-#if 0
-	printf("fsread: pos before %lu\n", ftell(fs->f));
-#endif
-
-	/* Handle whence */
-	if (whence == SEEK_SET) {
-		rc = fsetpos(fs->f, &fs->base);
-	} else if (whence == SEEK_CUR) {
-		rc = fsetpos(fs->f, &fs->cur);
-	} else {
-		goto out_error;
+		return -1;
 	}
-	if (rc == -1) goto out_error;
-
-	/* Seek */
-	rc = fseek(fs->f, offset, SEEK_CUR);
-	if (rc == -1) goto out_error;
-
-	/* Save cursor */
-	rc = fgetpos(fs->f, &fs->cur);
-	if (rc == -1) goto out_error;
-
 
-	/* Restore old position */
-	rc = fsetpos(fs->f, &old_pos);
-	if (rc == -1) goto out_error;
+	newpos += offset;
+	if (newpos < 0)
+		return -1;
 
+	fs->pos = newpos;
 	return 0;
-
-out_error:
-	return -1;
 }
 
 void fsrewind(fileslice_t *fs)
@@ -1367,6 +2113,7 @@ efs_err_t dvh_open(dvh_t **ctx, const char *filename)
 {
 	__label__ out_error;
 	int rc;
+	ssize_t zrc;
 	efs_err_t erc;
 	struct dvh_s dvh;
 	uint32_t sum = 0;
@@ -1379,35 +2126,38 @@ efs_err_t dvh_open(dvh_t **ctx, const char *filename)
 		erc = EFS_ERR_NOMEM;
 		goto out_error;
 	}
+	(*ctx)->fd = -1;
 
 	/* Open file */
-	(*ctx)->f = fopen(filename, "rb");
-	if (!(*ctx)->f) {
+	(*ctx)->fd = open(filename, O_RDONLY | O_BINARY);
+	if ((*ctx)->fd == -1) {
 		erc = EFS_ERR_NOENT;
 		goto out_error;
 	}
 
+	/* All reads of the image go through a slice covering all of it */
+	(*ctx)->img = fsopen((*ctx)->fd, 0, 0);
+	if (!(*ctx)->img) {
+		erc = EFS_ERR_READFAIL;
+		goto out_error;
+	}
+
 	/* Read volume header */
-	rc = fread(&dvh, sizeof(dvh), 1, (*ctx)->f);
-	if (rc != 1) {
+	zrc = fspread((*ctx)->img, &dvh, sizeof(dvh), 0);
+	if (zrc != sizeof(dvh)) {
 		erc = EFS_ERR_READFAIL;
 		goto out_error;
 	}
 
 	/* Validate volume header magic */
 	if (be32toh(dvh.vh_magic) != VHMAGIC) {
-		size_t zrc;
 		const uint8_t isomagic[8] = {0x01, 0x43, 0x44, 0x30, 0x30, 0x31, 0x01, 0x00};
 		uint8_t buf[sizeof(isomagic)];
 		erc = EFS_ERR_NOVH;
 
 		/* Quick diagnostic: is this ISO9660? */
-		rc = fseek((*ctx)->f, 0x8000, SEEK_SET);
-		if (rc == -1)
-			goto out_error;
-
-		zrc = fread(buf, sizeof(buf), 1, (*ctx)->f);
-		if (zrc != 1)
+		zrc = fspread((*ctx)->img, buf, sizeof(buf), 0x8000);
+		if (zrc != sizeof(buf))
 			goto out_error;
 
 		rc = memcmp(buf, isomagic, sizeof(isomagic));
@@ -1436,7 +2186,8 @@ efs_err_t dvh_open(dvh_t **ctx, const char *filename)
 	return EFS_ERR_OK;
 
 out_error:
-	if (*ctx && (*ctx)->f) fclose((*ctx)->f);
+	if (*ctx) fsclose((*ctx)->img);
+	if (*ctx && ((*ctx)->fd != -1)) close((*ctx)->fd);
 	if (*ctx) free(*ctx);
 	*ctx = NULL;
 	return erc;
@@ -1445,7 +2196,8 @@ out_error:
 efs_err_t dvh_close(dvh_t *ctx)
 {
 	if (ctx) {
-		fclose(ctx->f);
+		fsclose(ctx->img);
+		close(ctx->fd);
 		free(ctx);
 	}
 
@@ -1500,7 +2252,7 @@ fileslice_t *dvh_getParSlice(dvh_t *ctx, int parNum)
 	if (pt.pt_nblks == 0)
 		goto out_error;
 
-	fs = fsopen(ctx->f, BLKSIZ * pt.pt_firstlbn, BLKSIZ * pt.pt_nblks);
+	fs = fsopen(ctx->fd, BLKSIZ * (uint64_t)pt.pt_firstlbn, BLKSIZ * (size_t)pt.pt_nblks);
 	return fs;
 
 out_error:
@@ -1535,25 +2287,22 @@ struct dvh_vd_s dvh_getFileInfo(dvh_t *ctx, int fileNum)
 
 void *dvh_readFile(dvh_t *ctx, int fileNum)
 {
-	int rc;
-	size_t sRc;
+	ssize_t sRc;
 	struct dvh_vd_s vd;
 	void *buf;
 
 	vd = dvh_getFileInfo(ctx, fileNum);
 	if (vd.vd_lbn == 0)
 		return NULL;
-
-	rc = fseek(ctx->f, 512L * (long)vd.vd_lbn, SEEK_SET);
-	if (rc == -1)
+	if (vd.vd_nbytes < 0)
 		return NULL;
-	
+
 	buf = malloc(vd.vd_nbytes);
 	if (!buf)
 		return NULL;
 	
-	sRc = fread(buf, (long)vd.vd_nbytes, 1, ctx->f);
-	if (sRc != 1) {
+	sRc = fspread(ctx->img, buf, vd.vd_nbytes, 512UL * (size_t)vd.vd_lbn);
+	if (sRc != vd.vd_nbytes) {
 		free(buf);
 		return NULL;
 	}
@@ -1606,6 +2355,8 @@ efs_err_t efs_easy_open(efs_t **ctx, const char *filename)
 
 	/* Open DVH. */
 	erc = dvh_open(&dvh, filename);
+	if (erc == EFS_ERR_IS_ISO9660)
+		return isofs_easy_open(ctx, filename);
 	if (erc != EFS_ERR_OK) {
 		goto out_error;
 	}
@@ -1649,7 +2400,7 @@ efs_err_t efs_easy_open(efs_t **ctx, const char *filename)
 		goto out_error;
 	}
 
-	erc = efs_open(&efs, par);
+	erc = efs_open(&efs, par, 0);
 	if (erc != EFS_ERR_OK)
 		goto out_error;
 	
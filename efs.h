@@ -4,7 +4,10 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/types.h>
+#include "bcache.h"
 
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof(*x))
 
@@ -27,6 +30,19 @@
 #define EFS_MAXEXTENTLEN (256 - 8)
 #define EFS_EFSINOSHIFT	7
 
+/* default size of the per-filesystem block cache, in bytes */
+#define EFS_CACHE_DEFAULT	(4 * 1024 * 1024)
+/* reads longer than this many BBs are file data and bypass the cache */
+#define EFS_CACHE_MAXRUN	8
+
+/* default size of the readahead window of each open file, in bytes */
+#define EFS_READAHEAD_DEFAULT	(64 * 1024)
+
+/* efs_open() flags */
+#define EFS_OPEN_INODES	(1 << 0)	/* load all inode tables up front */
+/* inode tables are read this many BBs at a time */
+#define EFS_ITAB_CHUNK	256
+
 #define IFMT	0170000
 #define IFIFO	0010000
 #define IFCHR	0020000
@@ -129,10 +145,24 @@
 #define NPTYPES 16
 #define BLKSIZ 512
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 typedef struct _fileslice_s {
-	FILE *f;
-	fpos_t base;
-	fpos_t cur;
+	int fd;
+	uint64_t base;	/* byte offset of the slice within fd */
+	size_t size;	/* reads past this are refused */
+	size_t pos;	/* cursor for fsread()/fsseek() */
+
+	/*
+	 * If the slice could be mapped into memory, map is non-NULL
+	 * and reads are served from it instead of from fd. The slice
+	 * starts mapoff bytes into the mapping.
+	 */
+	uint8_t *map;
+	size_t maplen;
+	size_t mapoff;
 } fileslice_t;
 
 enum partition_type_e {
@@ -195,7 +225,8 @@ struct dvh_s {
 } __attribute__((packed));
 
 typedef struct dvh_ctx {
-	FILE *f;
+	int fd;
+	fileslice_t *img;	/* the whole image */
 	struct dvh_s dvh;
 } dvh_t;
 
@@ -241,6 +272,17 @@ struct efs_extent {
 */
 } __attribute__((packed));
 
+/*
+ * One extent of a file, decoded. All fields are in BBs: the extent
+ * covers blocks offset..offset+length-1 of the file, stored at
+ * blocks bn..bn+length-1 of the partition.
+ */
+struct efs_extmap_ent {
+	size_t bn;
+	size_t offset;
+	size_t length;
+};
+
 struct efs_edevs {
 	uint16_t odev;
 	uint32_t ndev;
@@ -281,15 +323,23 @@ struct efs_dirblk {
 enum efs_fstype {
 	EFS_FSTYPE_NONE = 0,
 	EFS_FSTYPE_EFS,
-	EFS_FSTYPE_VH
+	EFS_FSTYPE_VH,
+	EFS_FSTYPE_ISO9660
 };
 
 typedef struct efs_ctx {
 	dvh_t *dvh;
 	fileslice_t *fs;
+	enum efs_fstype fstype;	/* EFS, or ISO9660 through isofs.c */
+	struct isofs *iso;	/* ISO9660 only */
 	struct efs_sb sb;
 	size_t nblks;
 	efs_ino_t ipcg;
+	struct efs_dinode *itab;	/* every inode, native endian, or NULL */
+	size_t ninodes;
+	size_t readahead;	/* window size for newly opened files */
+	bcache_t *bcache;	/* NULL if caching is disabled */
+	struct dcache *dcache;	/* parsed directories and resolved paths */
 } efs_t;
 
 struct efs_dirent {
@@ -316,15 +366,20 @@ typedef struct efs_dir {
 typedef struct efs_file {
 	struct efs_dinode dinode;
 	unsigned numextents;
-	struct efs_extent *exs;
+	struct efs_extmap_ent *map;
+	unsigned cur;		/* extent of the last read */
 	efs_t *ctx;
 	efs_ino_t ino;
 	unsigned pos;
 	unsigned nbytes;
 	bool eof;
 	bool error;
-	uint8_t blockbuf[BLKSIZ];
-	int blocknum;	/* set to -1 if blockbuf is not filled */
+	uint8_t blockbuf[BLKSIZ];	/* window until reads turn sequential */
+	uint8_t *rabuf;		/* readahead window, NULL until then */
+	size_t rasize;		/* window size in bytes, whole blocks */
+	size_t rabufsize;	/* bytes allocated at rabuf */
+	size_t rablk;		/* first file block in the window */
+	size_t ranblks;		/* valid blocks in the window */
 } efs_file_t;
 
 struct efs_stat {
@@ -355,7 +410,8 @@ typedef enum {
 	EFS_ERR_BADPAR,
 	EFS_ERR_IS_BSD,
 	EFS_ERR_IS_ISO9660,
-	EFS_ERR_IS_XFS
+	EFS_ERR_IS_XFS,
+	EFS_ERR_WRITEFAIL
 } efs_err_t;
 
 extern char *mkpath(char *path, char *name);
@@ -367,11 +423,13 @@ extern struct dvh_vd_s dvh_getFileInfo(dvh_t *ctx, int fileNum);
 extern void *dvh_readFile(dvh_t *ctx, int fileNum);
 extern const char *dvh_getNameForType(unsigned parType);
 
-extern fileslice_t *fsopen(FILE *f, size_t base, size_t size);
+extern fileslice_t *fsopen(int fd, uint64_t base, size_t size);
 extern int fsclose(fileslice_t *fs);
+extern ssize_t fspread(fileslice_t *fs, void *buf, size_t nbytes, size_t offset);
 extern int fsseek(fileslice_t *fs, long offset, int whence);
 extern void fsrewind(fileslice_t *fs);
 extern size_t fsread(void *ptr, size_t size, size_t nmemb, fileslice_t *fs);
+extern const void *fsptr(fileslice_t *fs, size_t offset, size_t len);
 
 extern const char *efs_strerror(efs_err_t e);
 extern void vwarnefs(efs_err_t e, const char *fmt, va_list args);
@@ -380,6 +438,11 @@ extern void warnefs(efs_err_t e, const char *fmt, ...);
 extern void errefs(int eval, efs_err_t e, const char *fmt, ...);
 
 extern efs_file_t *efs_fopen(efs_t *ctx, const char *path);
+extern efs_file_t *efs_fopeni(efs_t *ctx, efs_ino_t ino);
+extern ssize_t efs_readlinki(efs_t *ctx, efs_ino_t ino, char *buf, size_t bufsiz);
+extern efs_err_t efs_copyi(efs_t *ctx, efs_ino_t ino, int fd);
+extern efs_err_t efs_copy_extmap(efs_t *ctx, const struct efs_extmap_ent *map, size_t nents, size_t size, int fd);
+extern efs_ino_t efs_lookupi(efs_t *ctx, efs_ino_t dir, const char *name);
 extern int efs_fclose(efs_file_t *file);
 extern size_t efs_fread(void *ptr, size_t size, size_t nmemb, efs_file_t *file);
 extern int efs_fseek(efs_file_t *file, long offset, int whence);
@@ -388,21 +451,69 @@ extern void efs_rewind(efs_file_t *file);
 extern void efs_clearerr(efs_file_t *file);
 extern int efs_feof(efs_file_t *file);
 extern int efs_ferror(efs_file_t *file);
+extern void efs_fset_readahead(efs_file_t *file, size_t nbytes);
 
 extern int efs_stat(efs_t *ctx, const char *pathname, struct efs_stat *statbuf);
+extern int efs_stati(efs_t *ctx, efs_ino_t ino, struct efs_stat *statbuf);
 extern int efs_fstat(efs_file_t *file, struct efs_stat *statbuf);
+extern struct efs_extmap_ent *efs_get_extmap(efs_t *ctx, efs_ino_t ino, size_t *nents);
+extern const struct efs_extmap_ent *efs_fextmap(efs_file_t *file, size_t *nents);
+extern efs_err_t efs_get_blocks(efs_t *ctx, void *buf, size_t firstlbn, size_t nblks);
 
 extern efs_dir_t *efs_opendir(efs_t *efs, const char *dirname);
+extern efs_dir_t *efs_opendiri(efs_t *efs, efs_ino_t ino);
 extern int efs_closedir(efs_dir_t *dirp);
 extern struct efs_dirent *efs_readdir(efs_dir_t *dirp);
 extern void efs_rewinddir(efs_dir_t *dirp);
 
-extern efs_err_t efs_open(efs_t **ctx, fileslice_t *f);
+extern efs_err_t efs_open(efs_t **ctx, fileslice_t *f, int flags);
 extern void efs_close(efs_t *ctx);
+extern efs_err_t efs_load_inodes(efs_t *ctx);
+extern size_t efs_inodes_size(efs_t *ctx);
 extern efs_err_t efs_easy_open(efs_t **ctx, const char *filename);
+extern efs_err_t efs_set_cache_size(efs_t *ctx, size_t nbytes);
+extern void efs_set_dcache_size(efs_t *ctx, size_t nbytes);
+extern void efs_get_cache_stats(efs_t *ctx, struct bcache_stats *st);
+extern void efs_set_readahead(efs_t *ctx, size_t nbytes);
 
 extern int efs_nftw(
 	efs_t *efs,
 	const char *dirpath,
 	int (*fn)(const char *fpath, const struct efs_stat *sb)
 );
+
+/*
+ * Callback for efs_nftwi(). ino is the entry's inode number (also in
+ * sb->st_ino), parent is the inode of the directory containing it.
+ * It returns one of the EFS_FTW_* codes below.
+ */
+#define EFS_FTW_CONTINUE	0	/* keep walking */
+#define EFS_FTW_SKIP_SUBTREE	1	/* don't descend into this directory */
+#define EFS_FTW_STOP		2	/* end the walk, efs_nftwi() returns this */
+
+typedef int (*efs_nftwi_fn)(
+	const char *fpath,
+	efs_ino_t ino,
+	efs_ino_t parent,
+	const struct efs_stat *sb,
+	void *arg
+);
+
+extern int efs_nftwi(
+	efs_t *efs,
+	const char *dirpath,
+	efs_nftwi_fn fn,
+	void *arg
+);
+
+/*
+ * Callback for efs_scani(), given each allocated inode. It returns
+ * EFS_FTW_STOP to end the scan, or EFS_FTW_CONTINUE.
+ */
+typedef int (*efs_scani_fn)(
+	efs_ino_t ino,
+	const struct efs_stat *sb,
+	void *arg
+);
+
+extern int efs_scani(efs_t *ctx, efs_scani_fn fn, void *arg, size_t *nbad);
@@ -10,31 +10,63 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#include <cdio/iso9660.h>
-#include <cdio/logging.h>
-
 #ifndef __MINGW32__
 #include <sys/sysmacros.h>
 #endif
 
+#include "asprintf.h"
+#include "compress.h"
 #include "efs.h"
 #include "endian.h"
 #include "err.h"
+#include "fnmatch.h"
 #include "hexdump.h"
+#include "idx.h"
+#include "isofs.h"
+#include "linkmap.h"
 #include "pdscan.h"
+#include "pool.h"
 #include "progname.h"
-#include "queue.h"
 #include "tar.h"
 #include "version.h"
 
+#define MIN(a,b) (a>b?b:a)
+
+int aflag = 0;
 int qflag = 0;
+int Dflag = 0;
 int lflag = 0;
 int Lflag = 0;
+int Sflag = 0;
 int Wflag = 0;
 int Xflag = 0;
 int force = 0;
+enum pd_format Wformat = PD_FORMAT_TEXT;
+int Fflag = 0;
+int Iflag = 0;
+long cachekb = -1;
+long njobs = -1;
+int parnum = -1;
 char *outfile = NULL;
+char *batchfile = NULL;	/* -B: list of images */
+char **patterns = NULL;	/* paths and globs to extract */
+bool *matched = NULL;	/* has patterns[i] matched anything? */
+int npatterns = 0;
+char **excludes = NULL;	/* paths and globs to leave out */
+int nexcludes = 0;
 efs_t *efs;
+const char *prefix = NULL;	/* with -a, the directory for this partition */
+idx_t *idx = NULL;
+tar_t *tar = NULL;
+linkmap_t *links = NULL;	/* first path of each multiply-linked inode */
+FILE *listfp;		/* where file names go, stderr if the tar does not */
+pool_t *pool = NULL;
+
+/* what the current image came to, for the -B summary */
+unsigned long nfiles = 0;
+unsigned long nproducts = 0;	/* with -W */
+uint64_t nbytes = 0;
+struct bcache_stats imgstats;
 
 static void tryhelp(void);
 static void usage(void);
@@ -107,86 +139,285 @@ int mode2color(uint16_t mode)
 	}
 }
 
-void emit_regfile(efs_t *efs, const char *path)
+static FILE *create_regfile(const char *path, const char *mode)
 {
-	struct efs_stat sb;
 	int rc;
 	FILE *dst;
-	efs_file_t *src;
-	char blk[BLKSIZ];
-	size_t sz;
-	size_t bytesLeft;
-	size_t blockNum;
 
-	rc = efs_stat(efs, path, &sb);
-	if (rc == -1)
-		err(1, "couldn't get stat for '%s'", path);
-
-	src = efs_fopen(efs, path);
-	if (!src)
-		errx(1, "couldn't open efs file '%s'", path);
-
-	dst = fopen(path, "wb");
+	dst = fopen(path, mode);
 	if (!dst && errno == EACCES && force) {
 		rc = unlink(path);
 		if (rc == -1)
 			err(1, "couldn't remove file '%s'", path);
-		dst = fopen(path, "wb");
+		dst = fopen(path, mode);
 	}
 	if (!dst)
 		err(1, "couldn't open destination file '%s'", path);
 
-	for (blockNum = 0; blockNum < (sb.st_size / 512UL); blockNum++) {
-		sz = efs_fread(blk, BLKSIZ, 1, src);
-		if (sz != 1)
-			err(1, "couldn't read from source file '%s'", path);
-		sz = fwrite(blk, BLKSIZ, 1, dst);
-		if (sz != 1)
-			err(1, "couldn't write to destination file '%s'", path);
+	return dst;
+}
+
+/*
+ * map, if not NULL, is the file's extent map from the index, which
+ * saves reading its inode. Here and below, it's freed once used.
+ */
+void emit_regfile(efs_t *efs, const char *path, const struct efs_stat *sb,
+	struct efs_extmap_ent *map, size_t nents)
+{
+	int rc;
+	FILE *dst;
+	efs_err_t erc;
+
+	dst = create_regfile(path, "wb");
+
+	if (map)
+		erc = efs_copy_extmap(efs, map, nents, sb->st_size, fileno(dst));
+	else
+		erc = efs_copyi(efs, sb->st_ino, fileno(dst));
+	free(map);
+	if (erc == EFS_ERR_WRITEFAIL)
+		err(1, "couldn't write to destination file '%s'", path);
+	else if (erc != EFS_ERR_OK)
+		errefs(1, erc, "couldn't read from source file '%s'", path);
+
+	if (fclose(dst))
+		err(1, "couldn't write to destination file '%s'", path);
+
+	rc = chmod(path, sb->st_mode & 0777);
+	if (rc == -1)
+		err(1, "couldn't set permissions on '%s'", path);
+}
+
+/*
+ * Disk-order extraction.
+ *
+ * While walking the tree, regular files are only created, and each
+ * of their extents is queued as a piece. Afterwards the pieces are
+ * sorted by block number and copied in that order, so the partition
+ * is read front to back in a single pass. Permissions are set once
+ * all data has been written.
+ */
+struct dfile {
+	char *path;
+	uint16_t mode;
+};
+
+/* longest piece; ISO9660 extents are split up into these */
+#define DPIECE_MAXBLKS	256
+
+struct dpiece {
+	size_t bn;		/* first BB on disk */
+	size_t nblks;
+	size_t file;		/* index into dfiles */
+	size_t offset;		/* byte offset in file */
+	size_t nbytes;
+};
+
+struct dfile *dfiles = NULL;
+size_t ndfiles = 0, maxdfiles = 0;
+struct dpiece *dpieces = NULL;
+size_t ndpieces = 0, maxdpieces = 0;
+
+void queue_regfile(efs_t *efs, const char *path, const struct efs_stat *sb,
+	struct efs_extmap_ent *map, size_t nents)
+{
+	size_t i, covered;
+	FILE *dst;
+
+	dst = create_regfile(path, "wb");
+	fclose(dst);
+
+	if (ndfiles == maxdfiles) {
+		maxdfiles = maxdfiles? maxdfiles * 2: 256;
+		dfiles = realloc(dfiles, maxdfiles * sizeof(*dfiles));
+		if (!dfiles)
+			err(1, "in realloc");
 	}
-	bytesLeft = sb.st_size & (BLKSIZ - 1);
-	if (bytesLeft) {
-		sz = efs_fread(blk, bytesLeft, 1, src);
-		if (sz != 1)
-			err(1, "couldn't read from source file '%s'", path);
-		sz = fwrite(blk, bytesLeft, 1, dst);
+	dfiles[ndfiles].path = strdup(path);
+	if (!dfiles[ndfiles].path)
+		err(1, "in strdup");
+	dfiles[ndfiles].mode = sb->st_mode;
+
+	if (!map)
+		map = efs_get_extmap(efs, sb->st_ino, &nents);
+	if (!map)
+		errx(1, "couldn't get extents of '%s'", path);
+
+	covered = 0;
+	for (i = 0; (i < nents) && (covered < (size_t)sb->st_size); i++) {
+		struct dpiece *dp;
+		size_t offset, nbytes, blk;
+
+		for (blk = 0; blk < map[i].length; blk += DPIECE_MAXBLKS) {
+			offset = (map[i].offset + blk) * BLKSIZ;
+			if (offset >= (size_t)sb->st_size)
+				break;
+			nbytes = MIN(map[i].length - blk, DPIECE_MAXBLKS) * BLKSIZ;
+			if (nbytes > sb->st_size - offset)
+				nbytes = sb->st_size - offset;
+
+			if (ndpieces == maxdpieces) {
+				maxdpieces = maxdpieces? maxdpieces * 2: 1024;
+				dpieces = realloc(dpieces, maxdpieces * sizeof(*dpieces));
+				if (!dpieces)
+					err(1, "in realloc");
+			}
+			dp = &dpieces[ndpieces++];
+			dp->bn = map[i].bn + blk;
+			dp->nblks = (nbytes + BLKSIZ - 1) / BLKSIZ;
+			dp->file = ndfiles;
+			dp->offset = offset;
+			dp->nbytes = nbytes;
+			covered += nbytes;
+		}
+	}
+	free(map);
+
+	if (covered < (size_t)sb->st_size)
+		errx(1, "couldn't read from source file '%s'", path);
+
+	ndfiles++;
+}
+
+static int dpiece_compar(const void *a, const void *b)
+{
+	const struct dpiece *pa = a, *pb = b;
+
+	if (pa->bn < pb->bn)
+		return -1;
+	if (pa->bn > pb->bn)
+		return 1;
+	return 0;
+}
+
+void flush_regfiles(efs_t *efs)
+{
+	efs_err_t erc;
+	FILE *dst = NULL;
+	size_t cur = 0;
+	size_t i, sz;
+	uint8_t *buf;
+	int rc;
+
+	buf = malloc(DPIECE_MAXBLKS * BLKSIZ);
+	if (!buf)
+		err(1, "in malloc");
+
+	qsort(dpieces, ndpieces, sizeof(*dpieces), dpiece_compar);
+
+	for (i = 0; i < ndpieces; i++) {
+		struct dpiece *dp = &dpieces[i];
+		const char *path = dfiles[dp->file].path;
+
+		/* keep the last file open, consecutive pieces often share it */
+		if (!dst || (cur != dp->file)) {
+			if (dst && fclose(dst))
+				err(1, "couldn't write to destination file '%s'", dfiles[cur].path);
+			dst = fopen(path, "r+b");
+			if (!dst)
+				err(1, "couldn't open destination file '%s'", path);
+			cur = dp->file;
+		}
+
+		erc = efs_get_blocks(efs, buf, dp->bn, dp->nblks);
+		if (erc != EFS_ERR_OK)
+			errefs(1, erc, "couldn't read from source file '%s'", path);
+		rc = fseek(dst, dp->offset, SEEK_SET);
+		if (rc == -1)
+			err(1, "couldn't seek in destination file '%s'", path);
+		sz = fwrite(buf, dp->nbytes, 1, dst);
 		if (sz != 1)
 			err(1, "couldn't write to destination file '%s'", path);
 	}
+	if (dst && fclose(dst))
+		err(1, "couldn't write to destination file '%s'", dfiles[cur].path);
+	free(buf);
 
-	efs_fclose(src);
-	fclose(dst);
+	for (i = 0; i < ndfiles; i++) {
+		rc = chmod(dfiles[i].path, dfiles[i].mode & 0777);
+		if (rc == -1)
+			err(1, "couldn't set permissions on '%s'", dfiles[i].path);
+		free(dfiles[i].path);
+	}
 
-	rc = chmod(path, sb.st_mode & 0777);
-	if (rc == -1)
-		err(1, "couldn't set permissions on '%s'", path);
+	free(dfiles);
+	dfiles = NULL;
+	ndfiles = maxdfiles = 0;
+	free(dpieces);
+	dpieces = NULL;
+	ndpieces = maxdpieces = 0;
 }
 
-void emit_file(efs_t *efs, const char *path)
-{
+/*
+ * Parallel extraction.
+ *
+ * The tree walk creates directories and other non-regular files
+ * itself, so they exist before anything is written below them, and
+ * hands regular files to the worker pool.
+ */
+struct job {
+	efs_t *efs;	/* with -a, jobs from several partitions share the pool */
+	char *path;
 	struct efs_stat sb;
-	int rc;
+	struct efs_extmap_ent *map;
+	size_t nents;
+};
 
-	rc = efs_stat(efs, path, &sb);
-	if (rc == -1)
-		err(1, "couldn't get stat for '%s'", path);
+static void job_run(void *item, void *arg)
+{
+	struct job *job = item;
+	(void)arg;
+
+	emit_regfile(job->efs, job->path, &job->sb, job->map, job->nents);
+	free(job->path);
+	free(job);
+}
+
+static void submit_regfile(efs_t *efs, const char *path, const struct efs_stat *sb,
+	struct efs_extmap_ent *map, size_t nents)
+{
+	struct job *job;
 
-	switch (sb.st_mode & IFMT) {
+	job = malloc(sizeof(*job));
+	if (!job)
+		err(1, "in malloc");
+	job->efs = efs;
+	job->path = strdup(path);
+	if (!job->path)
+		err(1, "in strdup");
+	job->sb = *sb;
+	job->map = map;
+	job->nents = nents;
+	pool_submit(pool, job);
+}
+
+void emit_file(efs_t *efs, const char *path, const struct efs_stat *sb,
+	struct efs_extmap_ent *map, size_t nents)
+{
+	int rc;
+
+	switch (sb->st_mode & IFMT) {
 	case IFDIR:
 #ifdef __MINGW32__
 		rc = mkdir(path);
 #else
-		rc = mkdir(path, sb.st_mode & 0777);
+		rc = mkdir(path, sb->st_mode & 0777);
 #endif
 		if ((rc == -1) && (errno != EEXIST))
 			err(1, "couldn't make directory '%s'", path);
 		break;
 	case IFREG:
-		emit_regfile(efs, path);
+		if (Dflag)
+			queue_regfile(efs, path, sb, map, nents);
+		else if (pool)
+			submit_regfile(efs, path, sb, map, nents);
+		else
+			emit_regfile(efs, path, sb, map, nents);
+		map = NULL;
 		break;
 	case IFIFO:
 #ifndef __MINGW32__
-		rc = mkfifo(path, sb.st_mode & 0777);
+		rc = mkfifo(path, sb->st_mode & 0777);
 		if (rc == -1)
 			warn("couldn't create fifo '%s'", path);
 #else
@@ -195,7 +426,7 @@ void emit_file(efs_t *efs, const char *path)
 		break;
 	case IFCHR:
 #ifndef __MINGW32__
-		rc = mknod(path, S_IFCHR | (sb.st_mode & 0777), makedev(sb.st_major, sb.st_minor));
+		rc = mknod(path, S_IFCHR | (sb->st_mode & 0777), makedev(sb->st_major, sb->st_minor));
 		if (rc == -1)
 			warn("couldn't create character special '%s'", path);
 #else
@@ -204,7 +435,7 @@ void emit_file(efs_t *efs, const char *path)
 		break;
 	case IFBLK:
 #ifndef __MINGW32__
-		rc = mknod(path, S_IFBLK | (sb.st_mode & 0777), makedev(sb.st_major, sb.st_minor));
+		rc = mknod(path, S_IFBLK | (sb->st_mode & 0777), makedev(sb->st_major, sb->st_minor));
 		if (rc == -1)
 			warn("couldn't create block special '%s'", path);
 #else
@@ -216,29 +447,21 @@ void emit_file(efs_t *efs, const char *path)
 	{
 		__label__ done;
 		char *buf = NULL;
-		efs_file_t *f = NULL;
-		size_t sz;
+		ssize_t len;
 
-		buf = malloc(sb.st_size + 1);
+		buf = malloc(sb->st_size + 1);
 		if (!buf)
 			err(1, "in malloc");
-		f = efs_fopen(efs, path);
-		if (!f) {
-			warnx("couldn't open efs symlink '%s'", path);
-			goto done;
-		}
-		sz = efs_fread(buf, sb.st_size, 1, f);
-		if (sz != 1) {
+		len = efs_readlinki(efs, sb->st_ino, buf, sb->st_size);
+		if (len != sb->st_size) {
 			warnx("couldn't read efs symlink '%s'", path);
 			goto done;
 		}
-		buf[sb.st_size] = '\0';
+		buf[len] = '\0';
 		rc = symlink(buf, path);
 		if (rc == -1)
 			warn("couldn't create symlink '%s'", path);
 done:
-		if (f)
-			efs_fclose(f);
 		free(buf);
 	}
 #else
@@ -251,23 +474,297 @@ done:
 	default:
 		break;
 	}
+	free(map);
+}
+
+/*
+ * Hard links.
+ *
+ * The first path to an inode with several links is extracted as usual
+ * and later ones are made into links to it. The links are only made
+ * after everything else, when the first path is sure to exist even if
+ * a worker was still writing it. If a link can't be made, the file is
+ * extracted again instead.
+ */
+struct dlink {
+	efs_t *efs;
+	char *target;
+	char *path;
+	struct efs_stat sb;
+};
+
+struct dlink *dlinks = NULL;
+size_t ndlinks = 0, maxdlinks = 0;
+
+void queue_link(efs_t *efs, const char *target, const char *path, const struct efs_stat *sb)
+{
+	if (ndlinks == maxdlinks) {
+		maxdlinks = maxdlinks? maxdlinks * 2: 64;
+		dlinks = realloc(dlinks, maxdlinks * sizeof(*dlinks));
+		if (!dlinks)
+			err(1, "in realloc");
+	}
+	dlinks[ndlinks].target = strdup(target);
+	dlinks[ndlinks].path = strdup(path);
+	if (!dlinks[ndlinks].target || !dlinks[ndlinks].path)
+		err(1, "in strdup");
+	dlinks[ndlinks].efs = efs;
+	dlinks[ndlinks].sb = *sb;
+	ndlinks++;
+}
+
+static int make_link(const char *target, const char *path)
+{
+#ifndef __MINGW32__
+	int rc;
+
+	rc = link(target, path);
+	if ((rc == -1) && (errno == EEXIST)) {
+		if (!force) {
+			/* keep what's there, and don't copy over it either */
+			warn("couldn't create link '%s'", path);
+			return 0;
+		}
+		(void)unlink(path);
+		rc = link(target, path);
+	}
+	return rc;
+#else
+	(void)target;
+	(void)path;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+void flush_links(void)
+{
+	size_t i;
+
+	for (i = 0; i < ndlinks; i++) {
+		struct dlink *dl = &dlinks[i];
+
+		if (make_link(dl->target, dl->path) == -1) {
+			if ((dl->sb.st_mode & IFMT) == IFREG)
+				emit_regfile(dl->efs, dl->path, &dl->sb, NULL, 0);
+			else
+				emit_file(dl->efs, dl->path, &dl->sb, NULL, 0);
+		}
+		free(dl->target);
+		free(dl->path);
+	}
+
+	free(dlinks);
+	dlinks = NULL;
+	ndlinks = maxdlinks = 0;
 }
 
 /*
  * This function is used as a callback for a later
- * invocation of efs_nftw().
+ * invocation of efs_nftwi().
  */
-int efs_nftw_callback(const char *fpath, const struct efs_stat *sb) {
-	/* extern: efs, outfile */
+/*
+ * Patterns are matched against whole paths, as with fnmatch(3)'s
+ * FNM_PATHNAME, so `*' never matches a slash. A pattern that matches
+ * a directory selects everything in it, too.
+ */
+enum selection {
+	SEL_NONE,	/* leave it out, and all of it if it's a directory */
+	SEL_PREFIX,	/* a directory that may hold selected files */
+	SEL_INSIDE,	/* inside a selected directory */
+	SEL_MATCH	/* picked out by a pattern */
+};
+
+/* drop any leading "/" and "./", and any trailing "/" */
+static char *clean_pattern(char *pat)
+{
+	size_t len;
+
+	for (;;) {
+		if (*pat == '/')
+			pat++;
+		else if ((pat[0] == '.') && (pat[1] == '/'))
+			pat += 2;
+		else
+			break;
+	}
+	len = strlen(pat);
+	while (len && (pat[len - 1] == '/'))
+		pat[--len] = '\0';
+	return pat;
+}
+
+static bool is_literal(const char *pat)
+{
+	return !strpbrk(pat, "*?[\\");
+}
+
+static bool all_literal(void)
+{
+	int i;
+
+	for (i = 0; i < npatterns; i++)
+		if (!is_literal(patterns[i]))
+			return false;
+	return true;
+}
+
+/*
+ * Returns 2 if pattern matches path, 1 if it matches one of the
+ * directories path is in, or 0.
+ */
+static int path_match(const char *pattern, const char *path)
+{
+	char *buf, *slash;
+	int rc = 0;
+
+	if (!fnmatch(pattern, path, FNM_PATHNAME))
+		return 2;
+	if (!strchr(path, '/'))
+		return 0;
+	buf = strdup(path);
+	if (!buf)
+		err(1, "in strdup");
+	while ((slash = strrchr(buf, '/'))) {
+		*slash = '\0';
+		if (!fnmatch(pattern, buf, FNM_PATHNAME)) {
+			rc = 1;
+			break;
+		}
+	}
+	free(buf);
+	return rc;
+}
+
+/*
+ * Could pattern match anything inside the directory dir? That is, does
+ * each component of dir match the same component of pattern, with
+ * some of pattern left over?
+ */
+static bool path_prefix(const char *pattern, const char *dir)
+{
+	char *pbuf, *dbuf, *pc, *dc, *pnext, *dnext;
+	bool rc = false;
+
+	pbuf = strdup(pattern);
+	dbuf = strdup(dir);
+	if (!pbuf || !dbuf)
+		err(1, "in strdup");
+
+	for (pc = pbuf, dc = dbuf; dc; pc = pnext, dc = dnext) {
+		pnext = strchr(pc, '/');
+		if (!pnext)
+			goto out;
+		*pnext++ = '\0';
+		dnext = strchr(dc, '/');
+		if (dnext)
+			*dnext++ = '\0';
+		if (fnmatch(pc, dc, 0))
+			goto out;
+	}
+	rc = true;
+out:
+	free(pbuf);
+	free(dbuf);
+	return rc;
+}
+
+static enum selection select_path(const char *path, bool isdir)
+{
+	/* extern: patterns, matched, npatterns, excludes, nexcludes */
+	enum selection sel = SEL_NONE;
+	int i;
+
+	if (!npatterns)
+		sel = SEL_INSIDE;
+	for (i = 0; i < npatterns; i++) {
+		switch (path_match(patterns[i], path)) {
+		case 2:
+			matched[i] = true;
+			sel = SEL_MATCH;
+			break;
+		case 1:
+			if (sel < SEL_INSIDE)
+				sel = SEL_INSIDE;
+			break;
+		default:
+			if (isdir && (sel < SEL_PREFIX) && path_prefix(patterns[i], path))
+				sel = SEL_PREFIX;
+			break;
+		}
+	}
+
+	if (sel == SEL_NONE)
+		return sel;
+	for (i = 0; i < nexcludes; i++)
+		if (path_match(excludes[i], path))
+			return SEL_NONE;
+	return sel;
+}
+
+/*
+ * Create the directories leading up to path. Used for files picked
+ * out by a pattern, whose directories weren't extracted themselves.
+ */
+static void make_parents(const char *path)
+{
+	char *buf, *p;
+	int rc;
+
+	buf = strdup(path);
+	if (!buf)
+		err(1, "in strdup");
+	for (p = strchr(buf, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+#ifdef __MINGW32__
+		rc = mkdir(buf);
+#else
+		rc = mkdir(buf, 0777);
+#endif
+		if ((rc == -1) && (errno != EEXIST))
+			err(1, "couldn't make directory '%s'", buf);
+		*p = '/';
+	}
+	free(buf);
+}
+
+int efs_nftw_callback(
+	const char *fpath,
+	efs_ino_t ino,
+	efs_ino_t parent,
+	const struct efs_stat *sb,
+	void *arg
+) {
+	/* extern: efs, prefix, idx, tar, listfp, outfile */
 	int rc;
+	bool parents = false;
+	char *path = NULL;
+	const char *ipath = fpath;	/* as the index has it, without prefix */
+	(void)ino;
+	(void)arg;
+
+	if (npatterns || nexcludes) {
+		switch (select_path(fpath, (sb->st_mode & IFMT) == IFDIR)) {
+		case SEL_NONE:
+			return EFS_FTW_SKIP_SUBTREE;
+		case SEL_PREFIX:
+			return EFS_FTW_CONTINUE;
+		case SEL_MATCH:
+			parents = !lflag && !Wflag && !outfile;
+			break;
+		case SEL_INSIDE:
+			break;
+		}
+	}
 
 	if (Wflag) {
 		/* Only call pdprint if we find a .idb file.
-		 * We need to call it with the path of the pd file, though.
-		 * That means stripping off the .idb suffix.
+		 * We need to call it with the pd file, though, which
+		 * lives in the same directory minus the .idb suffix.
 		 */
-		const char *cdot;
-		char *pdpath, *dot;
+		const char *base, *cdot;
+		char *pdname, *pdpath, *dot;
+		efs_ino_t pdino;
 
 		/* If it's not a file, skip it. */
 		if (IFREG != (sb->st_mode & IFMT))
@@ -278,48 +775,807 @@ int efs_nftw_callback(const char *fpath, const struct efs_stat *sb) {
 		/* If the path doesn't end with ".idb", skip it */
 		if (0 != strcmp(cdot, ".idb"))
 			return 0;
-		pdpath = strdup(fpath);
-		if (pdpath == NULL)
+		base = strrchr(fpath, '/');
+		base = base? base + 1: fpath;
+		pdname = strdup(base);
+		if (pdname == NULL)
 			err(1, "in strdup");
-		dot = strrchr(pdpath, '.');
+		dot = strrchr(pdname, '.');
 		if (!dot)
 			errx(1, "wtf");
 		*dot = '\0';
 
-		pdprint(efs, pdpath);
+		pdpath = NULL;
+		rc = asprintf(&pdpath, "%s%s%.*s", prefix ? prefix : "",
+			prefix ? "/" : "", (int)(cdot - fpath), fpath);
+		if (rc == -1)
+			err(1, "in asprintf");
+
+		if (idx) {
+			struct efs_stat pdsb;
+			char *key;
+			ssize_t n;
+
+			/* the index has the path within the fs, without prefix */
+			if (asprintf(&key, "%.*s", (int)(cdot - ipath), ipath) == -1)
+				err(1, "in asprintf");
+			n = idx_find(idx, key);
+			free(key);
+			if ((n == -1) || (idx_entry(idx, n, NULL, NULL, &pdsb) == -1))
+				pdino = EFS_BADINO;
+			else
+				pdino = pdsb.st_ino;
+		} else {
+			pdino = efs_lookupi(efs, parent, pdname);
+		}
+		if (pdino != EFS_BADINO) {
+			pdprint(efs, pdino, pdpath, Wformat);
+			nproducts++;
+		}
+		free(pdname);
+		pdname = NULL;
 		free(pdpath);
 		pdpath = NULL;
 		return 0;
 	}
+
+	/* patterns match inside the partition, but output goes under prefix */
+	if (prefix) {
+		rc = asprintf(&path, "%s/%s", prefix, fpath);
+		if (rc == -1)
+			err(1, "in asprintf");
+		fpath = path;
+	}
+	if (parents)
+		make_parents(fpath);
+
+	nfiles++;
+	if ((sb->st_mode & IFMT) == IFREG)
+		nbytes += sb->st_size;
 	if (!qflag) {
-		printf("%s\n", fpath);
+		fprintf(listfp, "%s\n", fpath);
 	}
 	if (!lflag) {
+		const char *first = NULL;
+
+		if (links && ((sb->st_mode & IFMT) != IFDIR) && (sb->st_nlink > 1))
+			first = linkmap_add(links, sb->st_ino, fpath);
 		if (outfile) {
-			rc = tar_emit(efs, fpath);
+			if (first)
+				rc = tar_emit_link(tar, fpath, first, sb);
+			else
+				rc = tar_emit(tar, efs, fpath, sb);
 			if (rc == -1)
 				errx(1, "while writing to tar (emit failure): %d", rc);
+		} else if (first) {
+			queue_link(efs, first, fpath, sb);
 		} else {
-			emit_file(efs, fpath);
+			struct efs_extmap_ent *map = NULL;
+			size_t nents = 0;
+			ssize_t n;
+
+			/* the index has the extents, so the inode needn't be read */
+			if (idx && ((sb->st_mode & IFMT) == IFREG)
+			  && ((n = idx_find(idx, ipath)) != -1))
+				map = idx_extmap(idx, n, &nents);
+			emit_file(efs, fpath, sb, map, nents);
+		}
+	}
+
+	free(path);
+	return 0;
+}
+
+/*
+ * Hand the single entry at path to the walk callback, then walk
+ * everything under it if it's a directory. This only reads the
+ * directories along path, rather than the whole file system; with
+ * an index, it reads no metadata at all. Returns -1 if there's no
+ * such path.
+ */
+static int visit_path(const char *path, const char *idxpath)
+{
+	/* extern: efs, idx */
+	struct efs_stat sb, psb;
+	efs_ino_t parent;
+	char *dir, *slash;
+	ssize_t n;
+	int rc;
+
+	if (idx) {
+		n = idx_find(idx, path);
+		if ((n == -1) || (idx_entry(idx, n, NULL, &parent, &sb) == -1))
+			return -1;
+		rc = efs_nftw_callback(path, sb.st_ino, parent, &sb, NULL);
+		if (((sb.st_mode & IFMT) == IFDIR) && (rc == EFS_FTW_CONTINUE)
+		  && (idx_walk_under(idx, sb.st_ino, efs_nftw_callback, NULL) == -1))
+			errx(1, "index '%s' is damaged, rebuild it with -I", idxpath);
+		return 0;
+	}
+
+	if (efs_stat(efs, path, &sb) == -1)
+		return -1;
+	dir = strdup(path);
+	if (!dir)
+		err(1, "in strdup");
+	slash = strrchr(dir, '/');
+	if (slash)
+		*slash = '\0';
+	else
+		dir[0] = '\0';
+	rc = efs_stat(efs, dir, &psb);
+	free(dir);
+	if (rc == -1)
+		return -1;
+
+	rc = efs_nftw_callback(path, sb.st_ino, psb.st_ino, &sb, NULL);
+	if (((sb.st_mode & IFMT) == IFDIR) && (rc == EFS_FTW_CONTINUE))
+		efs_nftwi(efs, path, efs_nftw_callback, NULL);
+	return 0;
+}
+
+/*
+ * Inode scan (-S).
+ *
+ * Every allocated inode is read straight from the inode tables, so
+ * this finds files that no directory leads to any more. Paths are put
+ * back together afterwards from the directories found in the scan:
+ * each inode takes the first name any directory gives it. Inodes
+ * without one are orphans. With -q, no paths are wanted, and each
+ * inode is printed as soon as it is read.
+ */
+struct sinode {
+	struct efs_stat sb;
+	efs_ino_t parent;	/* EFS_BADINO until a directory names it */
+	char *name;
+};
+
+struct sinode *sinodes = NULL;
+size_t nsinodes = 0, maxsinodes = 0;
+
+static void print_sinode(efs_t *fs, const struct efs_stat *sb, const char *path)
+{
+	struct efs_extmap_ent *map;
+	size_t nents, i;
+	char mode[11];
+
+	mode2str(mode, sb->st_mode);
+	printf("%8" PRIu32 "  %s %3d %5u %5u %10" PRId32,
+		(uint32_t)sb->st_ino, mode, sb->st_nlink, sb->st_uid,
+		sb->st_gid, sb->st_size);
+	if (path)
+		printf("  %s", path);
+	printf("\n");
+
+	/* devices and fifos keep other things where extents would be */
+	switch (sb->st_mode & IFMT) {
+	case IFREG:
+	case IFDIR:
+	case IFLNK:
+		break;
+	default:
+		return;
+	}
+	map = efs_get_extmap(fs, sb->st_ino, &nents);
+	if (!map)
+		return;
+	if (nents) {
+		printf("%8s ", "");
+		for (i = 0; i < nents; i++)
+			printf(" %zu+%zu", map[i].bn, map[i].length);
+		printf("\n");
+	}
+	free(map);
+}
+
+static int scan_callback(efs_ino_t ino, const struct efs_stat *sb, void *arg)
+{
+	/* extern: sinodes, qflag */
+	efs_t *fs = arg;
+	(void)ino;
+
+	if (qflag) {
+		print_sinode(fs, sb, NULL);
+		return EFS_FTW_CONTINUE;
+	}
+	if (nsinodes == maxsinodes) {
+		maxsinodes = maxsinodes? maxsinodes * 2: 1024;
+		sinodes = realloc(sinodes, maxsinodes * sizeof(*sinodes));
+		if (!sinodes)
+			err(1, "in realloc");
+	}
+	sinodes[nsinodes].sb = *sb;
+	sinodes[nsinodes].parent = EFS_BADINO;
+	sinodes[nsinodes].name = NULL;
+	nsinodes++;
+	return EFS_FTW_CONTINUE;
+}
+
+/* sinodes is in inode number order, as efs_scani() goes */
+static struct sinode *find_sinode(efs_ino_t ino)
+{
+	size_t lo = 0, hi = nsinodes, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (sinodes[mid].sb.st_ino == ino)
+			return &sinodes[mid];
+		if (sinodes[mid].sb.st_ino < ino)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/*
+ * The path of si, from the names found by scan_inodes(). A path that
+ * doesn't reach the root starts with the orphan it got stuck at.
+ */
+static char *sinode_path(struct sinode *si)
+{
+	struct sinode *cur;
+	efs_ino_t stuck;
+	char *path, *tmp;
+	size_t depth;
+	int rc;
+
+	if (si->sb.st_ino == EFS_ROOTINO)
+		return strdup("/");
+
+	path = strdup("");
+	if (!path)
+		err(1, "in strdup");
+	/* depth stops a loop in a damaged tree */
+	stuck = si->sb.st_ino;
+	for (cur = si, depth = 0; cur && cur->name && (depth < nsinodes); depth++) {
+		rc = asprintf(&tmp, "/%s%s", cur->name, path);
+		if (rc == -1)
+			err(1, "in asprintf");
+		free(path);
+		path = tmp;
+		if (cur->parent == EFS_ROOTINO)
+			return path;
+		/* a parent the scan didn't find is where we're stuck, too */
+		stuck = cur->parent;
+		cur = find_sinode(cur->parent);
+	}
+
+	rc = asprintf(&tmp, "(orphan %" PRIu32 ")%s", (uint32_t)stuck, path);
+	if (rc == -1)
+		err(1, "in asprintf");
+	free(path);
+	return tmp;
+}
+
+static void scan_inodes(efs_t *fs)
+{
+	size_t nbad = 0, norphans = 0, i;
+	struct efs_dirent *de;
+	efs_dir_t *dirp;
+	struct sinode *child;
+	char *path;
+
+	(void)efs_load_inodes(fs);
+	if (efs_scani(fs, scan_callback, fs, &nbad) == -1)
+		errx(1, "no inode tables to scan");
+	if (nbad)
+		warnx("couldn't read %zu inodes", nbad);
+	if (qflag)
+		return;
+
+	for (i = 0; i < nsinodes; i++) {
+		if ((sinodes[i].sb.st_mode & IFMT) != IFDIR)
+			continue;
+		dirp = efs_opendiri(fs, sinodes[i].sb.st_ino);
+		if (!dirp)
+			continue;
+		while ((de = efs_readdir(dirp))) {
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+			child = find_sinode(de->d_ino);
+			if (!child || child->name)
+				continue;
+			child->parent = sinodes[i].sb.st_ino;
+			child->name = strdup(de->d_name);
+			if (!child->name)
+				err(1, "in strdup");
 		}
+		efs_closedir(dirp);
 	}
 
+	for (i = 0; i < nsinodes; i++) {
+		if (!sinodes[i].name && (sinodes[i].sb.st_ino != EFS_ROOTINO))
+			norphans++;
+		path = sinode_path(&sinodes[i]);
+		print_sinode(fs, &sinodes[i].sb, path);
+		free(path);
+	}
+	if (norphans)
+		warnx("%zu inodes are in no directory", norphans);
+
+	for (i = 0; i < nsinodes; i++)
+		free(sinodes[i].name);
+	free(sinodes);
+	sinodes = NULL;
+	nsinodes = maxsinodes = 0;
+}
+
+/*
+ * List, extract or archive what was asked for from fs, putting it all
+ * under the directory pfx if that isn't NULL. Regular files may still
+ * be in the pool, and hard links still queued, when this returns.
+ */
+static void process_fs(efs_t *fs, const char *pfx, const char *idxpath)
+{
+	/* extern: efs, prefix, idx, tar, links, listfp, imgstats */
+	struct efs_stat sb;
+	struct bcache_stats st;
+	int rc;
+
+	efs = fs;
+	prefix = pfx;
+	if (!lflag && !Wflag) {
+		links = linkmap_init();
+		if (!links)
+			err(1, "in linkmap_init");
+	}
+
+	/* the partition's root directory stands in for pfx itself */
+	if (pfx && !npatterns && !Wflag && (efs_stat(fs, "", &sb) != -1)) {
+		if (!qflag)
+			fprintf(listfp, "%s\n", pfx);
+		if (outfile) {
+			if (tar_emit(tar, fs, pfx, &sb) == -1)
+				errx(1, "while writing to tar (emit failure)");
+		} else if (!lflag) {
+			make_parents(pfx);
+			emit_file(fs, pfx, &sb, NULL, 0);
+		}
+	}
+
+	if (npatterns && all_literal()) {
+		int i, j;
+
+		for (i = 0; i < npatterns; i++) {
+			/* skip paths inside (or equal to) one given earlier */
+			for (j = 0; j < npatterns; j++)
+				if ((j != i) && path_match(patterns[j], patterns[i])
+				  && ((j < i) || strcmp(patterns[j], patterns[i])))
+					break;
+			if (j < npatterns)
+				continue;
+			visit_path(patterns[i], idxpath);
+		}
+	} else if (idx) {
+		rc = idx_walk(idx, efs_nftw_callback, NULL);
+		if (rc == -1)
+			errx(1, "index '%s' is damaged, rebuild it with -I", idxpath);
+	} else {
+		efs_nftwi(fs, "", efs_nftw_callback, NULL);
+	}
+	if (idx) {
+		idx_close(idx);
+		idx = NULL;
+	}
+
+	/* pieces and inode numbers only mean anything within one fs */
+	if (Dflag)
+		flush_regfiles(fs);
+	linkmap_free(links);
+	links = NULL;
+
+	efs_get_cache_stats(fs, &st);
+	imgstats.hits += st.hits;
+	imgstats.misses += st.misses;
+	imgstats.evictions += st.evictions;
+}
+
+/*
+ * File systems whose files may still be in the pool, or whose hard
+ * links are still queued, are held open until drain_fs(). So are the
+ * volume headers they were opened from, which are closed after them.
+ */
+efs_t **heldfs = NULL;
+size_t nheldfs = 0, maxheldfs = 0;
+dvh_t **helddvh = NULL;
+size_t nhelddvh = 0, maxhelddvh = 0;
+
+static void drain_fs(void)
+{
+	if (pool)
+		pool_wait(pool);
+	flush_links();
+	while (nheldfs)
+		efs_close(heldfs[--nheldfs]);
+	while (nhelddvh)
+		dvh_close(helddvh[--nhelddvh]);
+}
+
+/* how many file systems -B keeps open at once, for the cache budget */
+static size_t batch_maxopen(void)
+{
+	return pool ? (size_t)njobs + 1 : 1;
+}
+
+/* how much memory each file system gets with -B: its share of -C */
+static size_t batch_share(void)
+{
+	size_t total;
+
+	total = (cachekb != -1)? (size_t)cachekb * 1024: EFS_CACHE_DEFAULT;
+	return total / batch_maxopen();
+}
+
+/*
+ * Hold fs and size its caches. Normally that's just the block cache
+ * from -C; with -B, -C is shared by every file system open at once,
+ * a quarter of each share going to the directory cache and the rest
+ * to the block cache, and older ones are closed first if there are
+ * too many.
+ */
+static void hold_fs(efs_t *fs)
+{
+	efs_err_t erc;
+	size_t nbytes, share;
+
+	if (batchfile) {
+		if (nheldfs >= batch_maxopen())
+			drain_fs();
+		share = batch_share();
+		efs_set_dcache_size(fs, (share / 4)? share / 4: 1);
+		nbytes = share - share / 4;
+	} else {
+		nbytes = (size_t)cachekb * 1024;
+	}
+	if (batchfile || (cachekb != -1)) {
+		erc = efs_set_cache_size(fs, nbytes);
+		if (erc != EFS_ERR_OK)
+			errefs(1, erc, "couldn't set up block cache");
+	}
+
+	if (nheldfs == maxheldfs) {
+		maxheldfs = maxheldfs? maxheldfs * 2: 16;
+		heldfs = realloc(heldfs, maxheldfs * sizeof(*heldfs));
+		if (!heldfs)
+			err(1, "in realloc");
+	}
+	heldfs[nheldfs++] = fs;
+}
+
+/*
+ * Load the inode table of fs, which makes walking it faster. With -B,
+ * the table comes out of the block cache's part of the file system's
+ * share of -C, and isn't loaded if it would take more than half of it.
+ */
+static void load_inodes(efs_t *fs)
+{
+	efs_err_t erc;
+	size_t share, isize;
+
+	if (!batchfile) {
+		(void)efs_load_inodes(fs);
+		return;
+	}
+	share = batch_share();
+	isize = efs_inodes_size(fs);
+	if (!isize || (isize > (share - share / 4) / 2))
+		return;
+	if (efs_load_inodes(fs) != EFS_ERR_OK)
+		return;
+	erc = efs_set_cache_size(fs, share - share / 4 - isize);
+	if (erc != EFS_ERR_OK)
+		errefs(1, erc, "couldn't set up block cache");
+}
+
+static void hold_dvh(dvh_t *dvh)
+{
+	if (!dvh)
+		return;
+	if (nhelddvh == maxhelddvh) {
+		maxhelddvh = maxhelddvh? maxhelddvh * 2: 16;
+		helddvh = realloc(helddvh, maxhelddvh * sizeof(*helddvh));
+		if (!helddvh)
+			err(1, "in realloc");
+	}
+	helddvh[nhelddvh++] = dvh;
+}
+
+/*
+ * Open the image in filename and process its file system, or with -a
+ * all of its EFS partitions, under the directory name if that isn't
+ * NULL. If the image can't be opened, says why and returns -1.
+ */
+static int process_image(const char *filename, const char *name)
+{
+	/* extern: aflag, parnum, Iflag, lflag, Wflag, npatterns, idx */
+	efs_err_t erc;
+	dvh_t *dvh = NULL;
+	efs_t *fs = NULL;
+	fileslice_t *par;
+	char *idxpath = NULL;
+	int rc;
+
+	erc = dvh_open(&dvh, filename);
+	if (erc == EFS_ERR_IS_ISO9660) {
+		/* no volume header, but the whole image is one ISO9660 fs */
+		erc = isofs_easy_open(&fs, filename);
+		if (erc != EFS_ERR_OK) {
+			warnefs(erc, "couldn't open iso9660 in '%s'", filename);
+			return -1;
+		}
+	} else if (erc == EFS_ERR_NOENT) {
+		warn("couldn't open '%s'", filename);
+		return -1;
+	} else if (erc != EFS_ERR_OK) {
+		warnx("couldn't find volume header in '%s'", filename);
+		return -1;
+	}
+
+	if (aflag && dvh) {
+		/*
+		 * Each EFS partition goes into its own parN directory. The
+		 * volume header is only read once. The partitions are walked
+		 * in turn, since the walk state is global, but with -j the
+		 * pool keeps writing files from one partition while the
+		 * next is being walked.
+		 */
+		int i, nopened = 0;
+
+		for (i = 0; i < NPARTAB; i++) {
+			struct dvh_pt_s pt;
+			char *pfx;
+
+			pt = dvh_getParInfo(dvh, i);
+			if (!pt.pt_nblks || ((pt.pt_type != PT_EFS) && (pt.pt_type != PT_SYSV)))
+				continue;
+			par = dvh_getParSlice(dvh, i);
+			if (!par) {
+				warnx("skipping partition %d of '%s' (couldn't get par slice)", i, filename);
+				continue;
+			}
+			erc = efs_open(&fs, par, 0);
+			if (erc != EFS_ERR_OK) {
+				warnefs(erc, "skipping partition %d of '%s'", i, filename);
+				fsclose(par);
+				continue;
+			}
+			hold_fs(fs);
+			nopened++;
+			if (!npatterns)
+				load_inodes(fs);
+			if (name)
+				rc = asprintf(&pfx, "%s/par%d", name, i);
+			else
+				rc = asprintf(&pfx, "par%d", i);
+			if (rc == -1)
+				err(1, "in asprintf");
+			process_fs(fs, pfx, NULL);
+			free(pfx);
+		}
+		hold_dvh(dvh);
+		if (!nopened) {
+			warnx("no EFS partitions in '%s'", filename);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (!fs) {
+		par = dvh_getParSlice(dvh, parnum);
+		if (!par) {
+			warnx("couldn't get par slice %u", parnum);
+			dvh_close(dvh);
+			return -1;
+		}
+		erc = efs_open(&fs, par, 0);
+		if (erc != EFS_ERR_OK) {
+			warnefs(erc, "couldn't open efs in '%s'", filename);
+			fsclose(par);
+			dvh_close(dvh);
+			return -1;
+		}
+	}
+	hold_fs(fs);
+	hold_dvh(dvh);
+
+	if (Sflag) {
+		scan_inodes(fs);
+		return 0;
+	}
+
+	/* Listings and extracting chosen paths can come from the index
+	 * next to the image, if it is still up to date. Anything else
+	 * walks the file system, and that goes faster with all inodes
+	 * loaded up front.
+	 */
+	if (Iflag || lflag || Wflag || npatterns) {
+		struct idx_key key;
+
+		erc = idx_make_key(&key, filename, parnum, fs);
+		if (erc != EFS_ERR_OK) {
+			warnefs(erc, "couldn't read '%s'", filename);
+			return -1;
+		}
+		rc = asprintf(&idxpath, "%s" IDX_SUFFIX, filename);
+		if (rc == -1)
+			err(1, "in asprintf");
+
+		if (Iflag) {
+			load_inodes(fs);
+			erc = idx_write(fs, idxpath, &key);
+			if (erc != EFS_ERR_OK) {
+				warnefs(erc, "couldn't write index '%s'", idxpath);
+				free(idxpath);
+				return -1;
+			}
+			free(idxpath);
+			return 0;
+		}
+		idx = idx_open(idxpath, &key);
+	}
+	if (!idx && !npatterns)
+		load_inodes(fs);
+
+	process_fs(fs, name, idxpath);
+	free(idxpath);
 	return 0;
 }
 
+/*
+ * The directory an image's files go in with -B: its name, less any
+ * suffix. If an earlier image in used[] already has that directory,
+ * -2, -3 and so on are tacked on until it's one of its own.
+ */
+static char *image_dir(const char *filename, char **used, size_t nused)
+{
+	const char *base;
+	char *name, *dot, *stem = NULL;
+	unsigned n;
+	size_t i;
+	int rc;
+
+	base = strrchr(filename, '/');
+	base = base? base + 1: filename;
+	dot = strrchr(base, '.');
+	if (dot && (dot != base))
+		rc = asprintf(&name, "%.*s", (int)(dot - base), base);
+	else
+		rc = asprintf(&name, "%s.d", base);	/* not the image itself */
+	if (rc == -1)
+		err(1, "in asprintf");
+
+	for (n = 2, i = 0; i < nused; i++) {
+		if (strcmp(used[i], name))
+			continue;
+		if (n == 2)
+			stem = name;
+		else
+			free(name);
+		rc = asprintf(&name, "%s-%u", stem, n++);
+		if (rc == -1)
+			err(1, "in asprintf");
+		i = (size_t)-1;		/* start over, that might be taken too */
+	}
+	free(stem);
+	return name;
+}
+
+/*
+ * Batch mode. Process every image named in list, one per line, or on
+ * standard input if list is "-". Images are walked one after another,
+ * but share the pool, the archive and the cache budget, so there's no
+ * startup cost per image and the jobs never sit idle between them.
+ * Only extraction and compression run on the pool; listings and -W
+ * are done on this thread, one image at a time.
+ * Images that can't be opened are reported and skipped. A summary line
+ * is printed for each image. Returns the number of failures.
+ */
+static int process_batch(const char *list)
+{
+	/* extern: listfp, nfiles, nproducts, nbytes, imgstats */
+	FILE *fp;
+	char line[4096];
+	size_t len;
+	char *name;
+	char **used = NULL;	/* directories given out so far */
+	size_t nused = 0, maxused = 0;
+	int nfailed = 0;
+
+	if (!strcmp(list, "-"))
+		fp = stdin;
+	else
+		fp = fopen(list, "r");
+	if (!fp)
+		err(1, "couldn't open image list '%s'", list);
+
+	while (fgets(line, sizeof(line), fp)) {
+		len = strlen(line);
+		while (len && ((line[len - 1] == '\n') || (line[len - 1] == '\r')))
+			line[--len] = '\0';
+		if (!len)
+			continue;
+
+		nfiles = 0;
+		nproducts = 0;
+		nbytes = 0;
+		memset(&imgstats, 0, sizeof(imgstats));
+		name = image_dir(line, used, nused);
+		if (process_image(line, name) == -1) {
+			fprintf(listfp, "%s: failed\n", line);
+			nfailed++;
+		} else if (Wflag) {
+			fprintf(listfp, "%s: ok, %lu products, cache %lu hits, "
+				"%lu misses\n", line, nproducts, imgstats.hits,
+				imgstats.misses);
+		} else {
+			fprintf(listfp, "%s: ok, %lu files, %" PRIu64 " bytes, "
+				"cache %lu hits, %lu misses\n", line, nfiles,
+				nbytes, imgstats.hits, imgstats.misses);
+		}
+		if (nused == maxused) {
+			maxused = maxused? maxused * 2: 16;
+			used = realloc(used, maxused * sizeof(*used));
+			if (!used)
+				err(1, "in realloc");
+		}
+		used[nused++] = name;
+	}
+	if (ferror(fp))
+		err(1, "couldn't read image list '%s'", list);
+	if (fp != stdin)
+		fclose(fp);
+	while (nused)
+		free(used[--nused]);
+	free(used);
+
+	return nfailed;
+}
+
 int main(int argc, char *argv[])
 {
 	char *filename = NULL;
 	int rc;
-	int parnum = -1;
 	efs_err_t erc;
 	dvh_t *dvh;
-	fileslice_t *par;
 
 	progname_init(argc, argv);
 
-	while ((rc = getopt(argc, argv, "fhLlo:p:qVWX")) != -1)
+	while ((rc = getopt(argc, argv, "aB:C:DF:fhIj:Llo:p:qSVWXx:")) != -1)
 		switch (rc) {
+		case 'a':
+			if (aflag) {
+				warnx("multiple use of `-a'");
+				tryhelp();
+			}
+			aflag = 1;
+			break;
+		case 'B':
+			if (batchfile) {
+				warnx("multiple use of `-B'");
+				tryhelp();
+			}
+			batchfile = optarg;
+			break;
+		case 'C':
+			if (cachekb != -1) {
+				warnx("multiple use of `-C'");
+				tryhelp();
+			}
+			{
+				char *ptr = NULL;
+				cachekb = strtol(optarg, &ptr, 10);
+				if (*ptr || (cachekb < 0))
+					errx(1, "bad cache size `%s'", optarg);
+			}
+			break;
+		case 'D':
+			if (Dflag) {
+				warnx("multiple use of `-D'");
+				tryhelp();
+			}
+			Dflag = 1;
+			break;
 		case 'f':
 			if (force) {
 				warnx("multiple use of `-f'");
@@ -327,9 +1583,41 @@ int main(int argc, char *argv[])
 			}
 			force = 1;
 			break;
+		case 'F':
+			if (Fflag) {
+				warnx("multiple use of `-F'");
+				tryhelp();
+			}
+			Fflag = 1;
+			if (!strcmp(optarg, "text"))
+				Wformat = PD_FORMAT_TEXT;
+			else if (!strcmp(optarg, "ndjson"))
+				Wformat = PD_FORMAT_NDJSON;
+			else
+				errx(1, "unknown format `%s'", optarg);
+			break;
 		case 'h':
 			usage();
 			break;
+		case 'I':
+			if (Iflag) {
+				warnx("multiple use of `-I'");
+				tryhelp();
+			}
+			Iflag = 1;
+			break;
+		case 'j':
+			if (njobs != -1) {
+				warnx("multiple use of `-j'");
+				tryhelp();
+			}
+			{
+				char *ptr = NULL;
+				njobs = strtol(optarg, &ptr, 10);
+				if (*ptr || (njobs < 1) || (njobs > 1024))
+					errx(1, "bad number of jobs `%s'", optarg);
+			}
+			break;
 		case 'L':
 			if (Lflag != 0) {
 				warnx("multiple use of `-L'");
@@ -370,6 +1658,13 @@ int main(int argc, char *argv[])
 			}
 			qflag = 1;
 			break;
+		case 'S':
+			if (Sflag) {
+				warnx("multiple use of `-S'");
+				tryhelp();
+			}
+			Sflag = 1;
+			break;
 		case 'V':
 			fprintf(stderr, "%s\n", PROG_EMBLEM);
 			exit(EXIT_SUCCESS);
@@ -388,6 +1683,12 @@ int main(int argc, char *argv[])
 			}
 			Xflag = 1;
 			break;
+		case 'x':
+			excludes = realloc(excludes, (nexcludes + 1) * sizeof(*excludes));
+			if (!excludes)
+				err(1, "in realloc");
+			excludes[nexcludes++] = clean_pattern(optarg);
+			break;
 		default:
 			tryhelp();
 		}
@@ -403,18 +1704,87 @@ int main(int argc, char *argv[])
 		errx(1, "cannot combine -X flag with other flags");
 	if (Xflag && outfile)
 		errx(1, "cannot combine -X flag with -o");
+
+	/* -I flag: cannot be combined with other modes */
+	if (Iflag && (lflag || Lflag || Wflag || Xflag || Dflag || outfile || (njobs != -1)))
+		errx(1, "cannot combine -I flag with other flags");
+
+	/* -F flag: only for -W */
+	if (Fflag && !Wflag)
+		errx(1, "-F flag can only be used with -W");
+
+	/* -D flag: only for extracting files */
+	if (Dflag && (lflag || Lflag || Wflag || Xflag || outfile))
+		errx(1, "-D flag can only be used when extracting files");
+
+	/* -j flag: likewise, or for compressing, and it makes no sense with -D */
+	if ((njobs != -1) && (lflag || Lflag || Wflag || Xflag))
+		errx(1, "-j flag can only be used when extracting files");
+	if ((njobs != -1) && outfile && (compress_fmt_from_path(outfile) == COMPRESS_NONE))
+		errx(1, "-j flag can only be used with -o for a compressed archive");
+
+	/* -o flag: the suffix may ask for a compressor we were built without */
+	if (outfile && !compress_fmt_available(compress_fmt_from_path(outfile)))
+		errx(1, "cannot write '%s': built without %s support", outfile,
+			compress_fmt_name(compress_fmt_from_path(outfile)));
+	if ((njobs != -1) && Dflag)
+		errx(1, "cannot combine -j flag with -D");
+
+	/* -a flag: every partition instead of one, and no index */
+	if (aflag && (parnum != -1))
+		errx(1, "cannot combine -a flag with -p");
+	if (aflag && (Lflag || Xflag || Iflag))
+		errx(1, "cannot combine -a flag with -L, -X or -I");
+
+	/* -S flag: a mode of its own, only -p and -q apply */
+	if (Sflag && (aflag || lflag || Lflag || Wflag || Xflag || Iflag || Dflag
+	  || outfile || (njobs != -1) || batchfile))
+		errx(1, "cannot combine -S flag with other flags");
+
+	/* -B flag: the images come from a list, not the command line */
+	if (batchfile && (Lflag || Xflag))
+		errx(1, "cannot combine -B flag with -L or -X");
 	
 	/* grab filename as first un-flagged argument */
-	if (*argv != NULL) {
+	if (batchfile) {
+		/* nothing to grab */
+	} else if (*argv != NULL) {
 		filename = *argv;
+		argc--;
+		argv++;
 	} else {
 		warnx("must specify a file");
 		tryhelp();
 	}
 
+	/* anything after that is a path or pattern to extract */
+	if (argc > 0) {
+		int i;
+
+		if (Lflag || Xflag || Iflag || Sflag)
+			errx(1, "cannot give paths with -L, -X, -I or -S");
+		npatterns = argc;
+		patterns = calloc(npatterns, sizeof(*patterns));
+		matched = calloc(npatterns, sizeof(*matched));
+		if (!patterns || !matched)
+			err(1, "in calloc");
+		for (i = 0; i < npatterns; i++)
+			patterns[i] = clean_pattern(argv[i]);
+
+		/* "/" cleans down to "", the root: everything is selected */
+		for (i = 0; i < npatterns; i++)
+			if (!*patterns[i])
+				npatterns = 0;
+	}
+
 	if (parnum == -1)
 		parnum = 7;
 
+	/* keep the file listing out of a tar written to stdout */
+	listfp = stdout;
+	if (outfile && !strcmp(outfile, "-"))
+		listfp = stderr;
+
 	if (Lflag) {
 		efs_err_t erc;
 		dvh_t *ctx = NULL;
@@ -466,81 +1836,16 @@ int main(int argc, char *argv[])
 		exit(0);
 	}
 
-	erc = dvh_open(&dvh, filename);
-	if ((erc != EFS_ERR_OK) && !outfile) {
-		errx(1, "couldn't find volume header in '%s'", filename);
-	} else if (erc != EFS_ERR_OK) {
-		/* is it iso9660? */
-		CdioList_t *a;
-		CdioListNode_t *b;
-		iso9660_t *ctx;
-		queue_t q, dirq;
-		int rc;
-		struct qent_s *qe;
-
-		cdio_loglevel_default = CDIO_LOG_ERROR;
-
-		rc = tar_create(outfile);
-		if (rc) {
-			errx(1, "while creating tar");
-		}
-
-		q = queue_init();
-		queue_add_head(q, strdup(""));
-
-		ctx = iso9660_open(filename);
-		if (!ctx)
-			errx(1, "couldn't open '%s'", filename);
-
-		while ((qe = queue_dequeue(q))) {
-			a = iso9660_ifs_readdir(ctx, qe->path);
-			dirq = queue_init();
-			if (a) {
-				_CDIO_LIST_FOREACH(b, a) {
-					iso9660_stat_t *st;
-					char *path;
-
-					st = (iso9660_stat_t *) _cdio_list_node_data(b);
-					path = mkpath(qe->path, st->filename);
-					if (strcmp(st->filename, ".") && strcmp(st->filename, "..")) {
-						if (!qflag && path) {
-							printf("%s\n", path);
-						}
-						switch (st->type) {
-						case _STAT_DIR:
-							queue_add_head(dirq, path);
-							break;
-						case _STAT_FILE:
-							tar_emit_from_iso9660(ctx, path);
-							free(path);
-							break;
-						default:
-							free(path);
-							break;
-						}
-					} else {
-						free(path);
-					}
-				}
-				iso9660_filelist_free(a);
-				a = NULL;
-			}
-			free(qe->path);
-			free(qe);
-			queue_add_queue_head(q, dirq);
-		}
-		queue_free(q);
-
-		iso9660_close(ctx);
-		tar_close();
-		ctx = NULL;
-		return 0;
-	} /* end iso9660 branch */
-
 	if (Xflag) {
 		int fileNum;
 		struct dvh_vd_s vd;
 
+		erc = dvh_open(&dvh, filename);
+		if (erc == EFS_ERR_NOENT)
+			err(1, "couldn't open '%s'", filename);
+		if (erc != EFS_ERR_OK)
+			errx(1, "couldn't find volume header in '%s'", filename);
+
 		for (fileNum = 0; fileNum < NVDIR; fileNum++) {
 			vd = dvh_getFileInfo(dvh, fileNum);
 			if (vd.vd_lbn != 0) {
@@ -569,37 +1874,58 @@ int main(int argc, char *argv[])
 				free(filedata);
 			}
 		}
-		efs_close(efs);
 		dvh_close(dvh);
 		return EXIT_SUCCESS;
 	}
 
-	par = dvh_getParSlice(dvh, parnum);
-	if (!par)
-		errx(1, "couldn't get par slice %u", parnum);
-	erc = efs_open(&efs, par);
-	if (erc != EFS_ERR_OK)
-		errefs(1, erc, "couldn't open efs in '%s'", filename);
-
 	if (outfile) {
-		rc = tar_create(outfile);
-		if (rc) err(1, "couldn't create archive '%s'", outfile);
+		tar = tar_create(outfile, (njobs != -1) ? njobs : 0);
+		if (!tar) err(1, "couldn't create archive '%s'", outfile);
 	}
 
-        if (Wflag) {
+	if ((njobs != -1) && !outfile)
+		pool = pool_create(njobs, job_run, NULL);
+
+        if (Wflag && (Wformat == PD_FORMAT_TEXT)) {
                 printf("   %-30s  %s\n\n", "Name", "Description");
         }
-	efs_nftw(efs, "", efs_nftw_callback);
+	rc = EXIT_SUCCESS;
+	if (batchfile) {
+		if (process_batch(batchfile))
+			rc = EXIT_FAILURE;
+	} else if (process_image(filename, NULL) == -1) {
+		exit(EXIT_FAILURE);
+	}
+	drain_fs();
+	free(heldfs);
+	free(helddvh);
+	if (pool) {
+		pool_destroy(pool);
+		pool = NULL;
+	}
 
 	if (outfile) {
-		rc = tar_close();
-		if (rc) err(1, "couldn't close archive '%s'", outfile);
+		int trc;
+
+		trc = tar_close(tar);
+		tar = NULL;
+		if (trc) err(1, "couldn't close archive '%s'", outfile);
 	}
 
-	efs_close(efs);
-	dvh_close(dvh);
+	{
+		int i;
+		for (i = 0; i < npatterns; i++) {
+			if (!matched[i]) {
+				warnx("%s: not found in image", patterns[i]);
+				rc = EXIT_FAILURE;
+			}
+		}
+	}
+	free(patterns);
+	free(matched);
+	free(excludes);
 
-	return EXIT_SUCCESS;
+	return rc;
 }
 
 static void tryhelp(void)
@@ -612,23 +1938,36 @@ static void tryhelp(void)
 static void usage(void)
 {
 	(void)fprintf(stderr,
-"Usage: %s [OPTION] [FILE]\n"
-"Extract files from the SGI CD image (or EFS file system) in FILE.\n"
+"Usage: %s [OPTION] FILE [PATH]...\n"
+"  or:  %s -B LIST [OPTION] [PATH]...\n"
+"Extract files from the SGI CD image (or EFS or ISO9660 file system) in FILE.\n"
+"If PATHs are given, only extract those. They may contain wildcards.\n"
 "\n"
+"  -a       process every EFS partition, each into its own parN directory\n"
+"  -B LIST  process each image named in the file LIST, or stdin if LIST is -\n"
+"  -C KB    size of the block cache in kilobytes (default: 4096)\n"
+"  -D       extract file data in on-disk order, for slow-seeking media\n"
+"  -F FORMAT\n"
+"           output format for -W: text (default) or ndjson\n"
 "  -f       delete destination files if they already exist\n"
 "  -h       print this help text\n"
+"  -I       write an index of the image for faster listing\n"
+"  -j N     extract files, or compress the archive, using N parallel jobs\n"
 "  -l       list files without extracting\n"
 "  -L       list partitions and bootfiles from the volume header\n"
 "  -o ARCHIVE\n"
-"           create a tar archive instead of extracting\n"
+"           create a tar archive instead of extracting; compress it\n"
+"           if ARCHIVE ends in .gz, .xz or .zst\n"
 "  -p NUM   use partition number (default: 7)\n"
 "  -q       do not show file listing while extracting\n"
+"  -S       list every inode in use, with its extents and path\n"
 "  -V       print program version\n"
 "  -W       scan image for packages and list them\n"
+"  -x PATH  leave out PATH; may be given more than once\n"
 "  -X       extract bootfiles from the volume headers\n"
 "\n"
 "Please report any bugs to <jkbenaim@gmail.com>.\n"
-,		__progname
+,		__progname, __progname
 	);
 	exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,105 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "fnmatch.h"
+
+#if defined(__MINGW32__)
+/*
+ * Match one bracket expression at *pp against c. On return *pp points
+ * past the closing ']'. Returns -1 if the bracket isn't closed, in
+ * which case the '[' is an ordinary character.
+ */
+static int rangematch(const char **pp, char c, int flags)
+{
+	const char *p = *pp;
+	bool negate = false, ok = false;
+	char lo, hi;
+
+	if ((*p == '!') || (*p == '^')) {
+		negate = true;
+		p++;
+	}
+	do {
+		lo = *p++;
+		if ((lo == '\\') && !(flags & FNM_NOESCAPE))
+			lo = *p++;
+		if (!lo)
+			return -1;
+		hi = lo;
+		if ((p[0] == '-') && p[1] && (p[1] != ']')) {
+			hi = p[1];
+			p += 2;
+			if ((hi == '\\') && !(flags & FNM_NOESCAPE))
+				hi = *p++;
+			if (!hi)
+				return -1;
+		}
+		if ((c >= lo) && (c <= hi))
+			ok = true;
+	} while (*p != ']');
+	*pp = p + 1;
+
+	return ok != negate;
+}
+
+int fnmatch(const char *pattern, const char *string, int flags)
+{
+	const char *p = pattern, *s = string;
+	char c;
+	int rc;
+
+	for (;;) {
+		c = *p++;
+		switch (c) {
+		case '\0':
+			return *s? FNM_NOMATCH: 0;
+		case '?':
+			if (!*s)
+				return FNM_NOMATCH;
+			if ((*s == '/') && (flags & FNM_PATHNAME))
+				return FNM_NOMATCH;
+			s++;
+			break;
+		case '*':
+			while (*p == '*')
+				p++;
+			if (!*p) {
+				if (flags & FNM_PATHNAME)
+					return strchr(s, '/')? FNM_NOMATCH: 0;
+				return 0;
+			}
+			for (; *s; s++) {
+				if (!fnmatch(p, s, flags))
+					return 0;
+				if ((*s == '/') && (flags & FNM_PATHNAME))
+					break;
+			}
+			return fnmatch(p, s, flags);
+		case '[':
+			if (!*s)
+				return FNM_NOMATCH;
+			if ((*s == '/') && (flags & FNM_PATHNAME))
+				return FNM_NOMATCH;
+			rc = rangematch(&p, *s, flags);
+			if (rc == -1) {
+				/* not a bracket expression after all */
+				if (*s != '[')
+					return FNM_NOMATCH;
+			} else if (!rc) {
+				return FNM_NOMATCH;
+			}
+			s++;
+			break;
+		case '\\':
+			if (!(flags & FNM_NOESCAPE) && *p)
+				c = *p++;
+			/* fall through */
+		default:
+			if (c != *s)
+				return FNM_NOMATCH;
+			s++;
+			break;
+		}
+	}
+}
+#endif
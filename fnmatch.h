@@ -0,0 +1,10 @@
+#pragma once
+
+#if defined(__MINGW32__)
+#define FNM_NOMATCH	1
+#define FNM_NOESCAPE	(1 << 0)
+#define FNM_PATHNAME	(1 << 1)
+int fnmatch(const char *pattern, const char *string, int flags);
+#else
+#include <fnmatch.h>
+#endif
@@ -0,0 +1,673 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef __MINGW32__
+#define HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#include "asprintf.h"
+#include "efs.h"
+#include "endian.h"
+#include "err.h"
+#include "idx.h"
+#include "isofs.h"
+
+/*
+ * Index file layout. All fields are big-endian, like EFS itself, so
+ * an index can be mapped and read in place on any host:
+ *
+ *	struct idx_hdr
+ *	struct idx_ent[nentries]	in walk order
+ *	uint32_t sorted[nentries]	entry numbers, sorted by path
+ *	struct idx_ext[nextents]
+ *	char strings[strsize]		NUL-terminated paths
+ */
+#define IDX_MAGIC	"efsindex"
+#define IDX_VERSION	1
+
+struct idx_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t nentries;
+	uint64_t imgsize;
+	int64_t imgmtime;
+	int32_t parnum;
+	uint32_t sbsum;
+	uint32_t nextents;
+	uint32_t strsize;
+	uint32_t __pad[4];
+} __attribute__((packed));
+
+struct idx_ent {
+	uint32_t ino;
+	uint32_t parent;
+	uint16_t mode;
+	int16_t  nlink;
+	uint16_t uid;
+	uint16_t gid;
+	int32_t  size;
+	int32_t  atime;
+	int32_t  mtime;
+	int32_t  ctime;
+	uint16_t major;
+	uint16_t minor;
+	uint32_t path;		/* offset into strings */
+	uint32_t firstext;	/* index into extents */
+	uint32_t nextents;
+} __attribute__((packed));
+
+struct idx_ext {
+	uint32_t bn;
+	uint32_t offset;
+	uint32_t length;
+} __attribute__((packed));
+
+struct idx {
+	const uint8_t *data;
+	size_t len;
+	bool mapped;
+
+	size_t nentries;
+	size_t nextents;
+	size_t strsize;
+	const struct idx_ent *ents;
+	const uint32_t *sorted;
+	const struct idx_ext *exts;
+	const char *strs;
+};
+
+static uint32_t _idx_crc32(const uint8_t *p, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	size_t i;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		crc ^= p[i];
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+/*
+ * Fill in the key that ties an index to the image it was made from.
+ */
+efs_err_t idx_make_key(struct idx_key *key, const char *image, int parnum, efs_t *efs)
+{
+	struct stat st;
+	uint8_t sb[BLKSIZ];
+	efs_err_t erc;
+
+	if (stat(image, &st) == -1)
+		return EFS_ERR_READFAIL;
+	/* ISO9660 has no superblock; its volume descriptor will do */
+	erc = efs_get_blocks(efs, sb,
+		(efs->fstype == EFS_FSTYPE_ISO9660) ? ISOFS_PVD_BB : EFS_BLK_SB, 1);
+	if (erc != EFS_ERR_OK)
+		return erc;
+
+	memset(key, 0, sizeof(*key));
+	key->size = st.st_size;
+	key->mtime = st.st_mtime;
+	key->parnum = parnum;
+	key->sbsum = _idx_crc32(sb, sizeof(sb));
+	return EFS_ERR_OK;
+}
+
+/*
+ * An index under construction. Everything is appended in walk order
+ * and converted to big-endian as it goes in.
+ */
+struct idx_builder {
+	efs_t *efs;
+	struct idx_ent *ents;
+	size_t nents, maxents;
+	struct idx_ext *exts;
+	size_t nexts, maxexts;
+	char *strs;
+	size_t strsize, maxstrs;
+	bool error;
+};
+
+/* make room for n more elements of size bytes in *p */
+static bool _idx_grow(void **p, size_t *max, size_t used, size_t n, size_t size)
+{
+	size_t newmax;
+	void *q;
+
+	if (used + n <= *max)
+		return true;
+	newmax = *max? *max: 256;
+	while (newmax < used + n)
+		newmax *= 2;
+	q = realloc(*p, newmax * size);
+	if (!q)
+		return false;
+	*p = q;
+	*max = newmax;
+	return true;
+}
+
+static int _idx_add(
+	const char *fpath,
+	efs_ino_t ino,
+	efs_ino_t parent,
+	const struct efs_stat *sb,
+	void *arg
+) {
+	__label__ out_error;
+	struct idx_builder *b = arg;
+	struct idx_ent *e;
+	struct efs_extmap_ent *map = NULL;
+	size_t len, nmap = 0, i;
+
+	if (b->error)
+		return 0;
+
+	len = strlen(fpath) + 1;
+	if ((b->strsize + len > UINT32_MAX) || (b->nents >= UINT32_MAX))
+		goto out_error;
+	if (!_idx_grow((void **)&b->ents, &b->maxents, b->nents, 1, sizeof(*b->ents)))
+		goto out_error;
+	if (!_idx_grow((void **)&b->strs, &b->maxstrs, b->strsize, len, 1))
+		goto out_error;
+
+	switch (sb->st_mode & IFMT) {
+	case IFREG:
+	case IFDIR:
+	case IFLNK:
+		map = efs_get_extmap(b->efs, ino, &nmap);
+		if (!map)
+			goto out_error;
+		break;
+	}
+	if (!_idx_grow((void **)&b->exts, &b->maxexts, b->nexts, nmap, sizeof(*b->exts)))
+		goto out_error;
+
+	e = &b->ents[b->nents++];
+	memset(e, 0, sizeof(*e));
+	e->ino = htobe32(ino);
+	e->parent = htobe32(parent);
+	e->mode = htobe16(sb->st_mode);
+	e->nlink = htobe16(sb->st_nlink);
+	e->uid = htobe16(sb->st_uid);
+	e->gid = htobe16(sb->st_gid);
+	e->size = htobe32(sb->st_size);
+	e->atime = htobe32(sb->st_atimespec.tv_sec);
+	e->mtime = htobe32(sb->st_mtimespec.tv_sec);
+	e->ctime = htobe32(sb->st_ctimespec.tv_sec);
+	switch (sb->st_mode & IFMT) {
+	case IFCHR:
+	case IFBLK:
+		e->major = htobe16(sb->st_major);
+		e->minor = htobe16(sb->st_minor);
+		break;
+	}
+
+	e->path = htobe32(b->strsize);
+	memcpy(b->strs + b->strsize, fpath, len);
+	b->strsize += len;
+
+	e->firstext = htobe32(b->nexts);
+	e->nextents = htobe32(nmap);
+	for (i = 0; i < nmap; i++) {
+		struct idx_ext *x = &b->exts[b->nexts++];
+		x->bn = htobe32(map[i].bn);
+		x->offset = htobe32(map[i].offset);
+		x->length = htobe32(map[i].length);
+	}
+	free(map);
+	return 0;
+
+out_error:
+	free(map);
+	b->error = true;
+	return 0;
+}
+
+struct idx_sortent {
+	const char *path;
+	uint32_t n;
+};
+
+static int _idx_sortcmp(const void *a, const void *b)
+{
+	const struct idx_sortent *x = a, *y = b;
+	return strcmp(x->path, y->path);
+}
+
+static bool _idx_fwrite(const void *p, size_t size, size_t n, FILE *f)
+{
+	if (!size || !n)
+		return true;
+	return fwrite(p, size, n, f) == n;
+}
+
+/*
+ * Walk the whole file system and write an index of it to path. The
+ * index is written to a temporary file first and renamed into place,
+ * so a reader never sees a half-written one.
+ */
+efs_err_t idx_write(efs_t *efs, const char *path, const struct idx_key *key)
+{
+	__label__ out_error;
+	struct idx_builder b;
+	struct idx_sortent *sorted = NULL;
+	struct idx_hdr hdr;
+	char *tmppath = NULL;
+	FILE *f = NULL;
+	efs_err_t erc = EFS_ERR_NOMEM;
+	size_t i;
+	int rc;
+
+	memset(&b, 0, sizeof(b));
+	b.efs = efs;
+	efs_nftwi(efs, "", _idx_add, &b);
+	if (b.error) {
+		erc = EFS_ERR_READFAIL;
+		goto out_error;
+	}
+
+	sorted = calloc(b.nents + 1, sizeof(*sorted));
+	if (!sorted)
+		goto out_error;
+	for (i = 0; i < b.nents; i++) {
+		sorted[i].path = b.strs + be32toh(b.ents[i].path);
+		sorted[i].n = i;
+	}
+	qsort(sorted, b.nents, sizeof(*sorted), _idx_sortcmp);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, IDX_MAGIC, sizeof(hdr.magic));
+	hdr.version = htobe32(IDX_VERSION);
+	hdr.nentries = htobe32(b.nents);
+	hdr.imgsize = htobe64(key->size);
+	hdr.imgmtime = htobe64(key->mtime);
+	hdr.parnum = htobe32(key->parnum);
+	hdr.sbsum = htobe32(key->sbsum);
+	hdr.nextents = htobe32(b.nexts);
+	hdr.strsize = htobe32(b.strsize);
+
+	rc = asprintf(&tmppath, "%s.tmp", path);
+	if (rc == -1) {
+		tmppath = NULL;
+		goto out_error;
+	}
+	erc = EFS_ERR_WRITEFAIL;
+	f = fopen(tmppath, "wb");
+	if (!f)
+		goto out_error;
+
+	if (!_idx_fwrite(&hdr, sizeof(hdr), 1, f))
+		goto out_error;
+	if (!_idx_fwrite(b.ents, sizeof(*b.ents), b.nents, f))
+		goto out_error;
+	for (i = 0; i < b.nents; i++) {
+		uint32_t n = htobe32(sorted[i].n);
+		if (!_idx_fwrite(&n, sizeof(n), 1, f))
+			goto out_error;
+	}
+	if (!_idx_fwrite(b.exts, sizeof(*b.exts), b.nexts, f))
+		goto out_error;
+	if (!_idx_fwrite(b.strs, 1, b.strsize, f))
+		goto out_error;
+	rc = fclose(f);
+	f = NULL;
+	if (rc)
+		goto out_error;
+
+#ifdef __MINGW32__
+	/* rename() won't replace an existing file here */
+	unlink(path);
+#endif
+	if (rename(tmppath, path) == -1)
+		goto out_error;
+
+	free(tmppath);
+	free(sorted);
+	free(b.ents);
+	free(b.exts);
+	free(b.strs);
+	return EFS_ERR_OK;
+
+out_error:
+	if (f)
+		fclose(f);
+	if (tmppath) {
+		unlink(tmppath);
+		free(tmppath);
+	}
+	free(sorted);
+	free(b.ents);
+	free(b.exts);
+	free(b.strs);
+	return erc;
+}
+
+/*
+ * Open the index at path. Returns NULL if there is no index there, if
+ * it is damaged, or if it was made from something other than the
+ * image described by key.
+ */
+idx_t *idx_open(const char *path, const struct idx_key *key)
+{
+	__label__ out_error;
+	idx_t *idx = NULL;
+	const struct idx_hdr *hdr;
+	struct stat st;
+	uint64_t need;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1)
+		goto out_error;
+	if ((st.st_size < (off_t)sizeof(*hdr)) || ((uint64_t)st.st_size > SIZE_MAX))
+		goto out_error;
+
+	idx = calloc(1, sizeof(*idx));
+	if (!idx)
+		goto out_error;
+	idx->len = st.st_size;
+
+#ifdef HAVE_MMAP
+	{
+		void *map;
+		map = mmap(NULL, idx->len, PROT_READ, MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED) {
+			idx->data = map;
+			idx->mapped = true;
+		}
+	}
+#endif
+	if (!idx->data) {
+		uint8_t *buf;
+		size_t got = 0;
+		ssize_t rc;
+
+		buf = malloc(idx->len);
+		if (!buf)
+			goto out_error;
+		idx->data = buf;
+		while (got < idx->len) {
+			rc = read(fd, buf + got, idx->len - got);
+			if (rc <= 0)
+				goto out_error;
+			got += rc;
+		}
+	}
+	close(fd);
+	fd = -1;
+
+	hdr = (const struct idx_hdr *)idx->data;
+	if (memcmp(hdr->magic, IDX_MAGIC, sizeof(hdr->magic)))
+		goto out_error;
+	if (be32toh(hdr->version) != IDX_VERSION)
+		goto out_error;
+	if ((be64toh(hdr->imgsize) != key->size)
+	  || ((int64_t)be64toh(hdr->imgmtime) != key->mtime)
+	  || ((int32_t)be32toh(hdr->parnum) != key->parnum)
+	  || (be32toh(hdr->sbsum) != key->sbsum))
+		goto out_error;
+
+	idx->nentries = be32toh(hdr->nentries);
+	idx->nextents = be32toh(hdr->nextents);
+	idx->strsize = be32toh(hdr->strsize);
+	need = sizeof(*hdr);
+	need += (uint64_t)idx->nentries * (sizeof(struct idx_ent) + sizeof(uint32_t));
+	need += (uint64_t)idx->nextents * sizeof(struct idx_ext);
+	need += idx->strsize;
+	if (need != idx->len)
+		goto out_error;
+	if (idx->strsize && (idx->data[idx->len - 1] != '\0'))
+		goto out_error;
+
+	idx->ents = (const struct idx_ent *)(hdr + 1);
+	idx->sorted = (const uint32_t *)(idx->ents + idx->nentries);
+	idx->exts = (const struct idx_ext *)(idx->sorted + idx->nentries);
+	idx->strs = (const char *)(idx->exts + idx->nextents);
+
+	return idx;
+
+out_error:
+	if (fd != -1)
+		close(fd);
+	idx_close(idx);
+	return NULL;
+}
+
+void idx_close(idx_t *idx)
+{
+	if (!idx)
+		return;
+#ifdef HAVE_MMAP
+	if (idx->mapped) {
+		munmap((void *)idx->data, idx->len);
+		idx->data = NULL;
+	}
+#endif
+	free((void *)idx->data);
+	free(idx);
+}
+
+size_t idx_count(idx_t *idx)
+{
+	return idx->nentries;
+}
+
+/*
+ * Look up entry n. The fields are checked as they are read, rather
+ * than all at once in idx_open(), so listing a huge index only costs
+ * what is printed. Returns -1 if the entry is damaged.
+ */
+int idx_entry(idx_t *idx, size_t n, const char **path, efs_ino_t *parent, struct efs_stat *sb)
+{
+	const struct idx_ent *e;
+	uint32_t off;
+
+	if (n >= idx->nentries)
+		return -1;
+	e = &idx->ents[n];
+
+	off = be32toh(e->path);
+	if (off >= idx->strsize)
+		return -1;
+	if (path)
+		*path = idx->strs + off;
+	if (parent)
+		*parent = be32toh(e->parent);
+
+	if (sb) {
+		memset(sb, 0, sizeof(*sb));
+		sb->st_ino = be32toh(e->ino);
+		sb->st_mode = be16toh(e->mode);
+		sb->st_nlink = be16toh(e->nlink);
+		sb->st_uid = be16toh(e->uid);
+		sb->st_gid = be16toh(e->gid);
+		sb->st_size = be32toh(e->size);
+		sb->st_major = be16toh(e->major);
+		sb->st_minor = be16toh(e->minor);
+		sb->st_atimespec.tv_sec = (int32_t)be32toh(e->atime);
+		sb->st_mtimespec.tv_sec = (int32_t)be32toh(e->mtime);
+		sb->st_ctimespec.tv_sec = (int32_t)be32toh(e->ctime);
+	}
+
+	return 0;
+}
+
+/*
+ * Find the entry for path. Returns its number, or -1 if there's no
+ * such path in the index.
+ */
+ssize_t idx_find(idx_t *idx, const char *path)
+{
+	size_t lo = 0, hi = idx->nentries;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		uint32_t n = be32toh(idx->sorted[mid]);
+		const char *p;
+		int cmp;
+
+		if (idx_entry(idx, n, &p, NULL, NULL) == -1)
+			return -1;
+		cmp = strcmp(path, p);
+		if (!cmp)
+			return n;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return -1;
+}
+
+/*
+ * Return the extent map of entry n, like efs_get_extmap(). The caller
+ * frees it. Returns NULL if the entry is damaged.
+ */
+struct efs_extmap_ent *idx_extmap(idx_t *idx, size_t n, size_t *nents)
+{
+	const struct idx_ent *e;
+	struct efs_extmap_ent *out;
+	uint32_t first, count;
+	size_t i;
+
+	if (n >= idx->nentries)
+		return NULL;
+	e = &idx->ents[n];
+	first = be32toh(e->firstext);
+	count = be32toh(e->nextents);
+	if ((first > idx->nextents) || (count > idx->nextents - first))
+		return NULL;
+
+	out = calloc(count + 1, sizeof(*out));
+	if (!out)
+		return NULL;
+	for (i = 0; i < count; i++) {
+		const struct idx_ext *x = &idx->exts[first + i];
+		out[i].bn = be32toh(x->bn);
+		out[i].offset = be32toh(x->offset);
+		out[i].length = be32toh(x->length);
+	}
+	*nents = count;
+	return out;
+}
+
+/* a bitmap of inode numbers, grown as needed */
+static bool _idx_bit_test(const uint8_t *bits, size_t nbytes, efs_ino_t ino)
+{
+	return ((ino / 8) < nbytes) && (bits[ino / 8] & (1 << (ino % 8)));
+}
+
+static void _idx_bit_set(uint8_t **bits, size_t *nbytes, efs_ino_t ino)
+{
+	if ((ino / 8) >= *nbytes) {
+		size_t n = (ino / 8) + 1;
+		uint8_t *p;
+
+		n += n / 2;
+		p = realloc(*bits, n);
+		if (!p)
+			err(1, "in realloc");
+		memset(p + *nbytes, 0, n - *nbytes);
+		*bits = p;
+		*nbytes = n;
+	}
+	(*bits)[ino / 8] |= 1 << (ino % 8);
+}
+
+/*
+ * Call fn for every entry, in the same order and with the same
+ * arguments efs_nftwi() would, and with the same EFS_FTW_* return
+ * codes. Entries come in walk order, so a directory is always seen
+ * before anything in it; pruned directories are remembered in a
+ * bitmap of inode numbers. Returns EFS_FTW_STOP if fn stopped the
+ * walk, or -1 if the index is damaged.
+ */
+int idx_walk(idx_t *idx, efs_nftwi_fn fn, void *arg)
+{
+	__label__ out;
+	struct efs_stat sb;
+	const char *path;
+	efs_ino_t parent;
+	uint8_t *pruned = NULL;
+	size_t npruned = 0;	/* bytes in pruned */
+	size_t i;
+	int rc = 0;
+
+	for (i = 0; i < idx->nentries; i++) {
+		bool isdir;
+
+		if (idx_entry(idx, i, &path, &parent, &sb) == -1) {
+			rc = -1;
+			goto out;
+		}
+		isdir = ((sb.st_mode & IFMT) == IFDIR);
+
+		if (_idx_bit_test(pruned, npruned, parent)) {
+			rc = EFS_FTW_SKIP_SUBTREE;
+		} else {
+			rc = fn(path, sb.st_ino, parent, &sb, arg);
+			if (rc == EFS_FTW_STOP)
+				goto out;
+		}
+
+		if (isdir && (rc == EFS_FTW_SKIP_SUBTREE))
+			_idx_bit_set(&pruned, &npruned, sb.st_ino);
+	}
+	rc = 0;
+
+out:
+	free(pruned);
+	return rc;
+}
+
+/*
+ * Like idx_walk(), but only for the entries below directory dir, as
+ * efs_nftwi() on its path would give them. This time the bitmap holds
+ * the directories being walked: dir, and every directory in one of
+ * them that fn didn't prune.
+ */
+int idx_walk_under(idx_t *idx, efs_ino_t dir, efs_nftwi_fn fn, void *arg)
+{
+	__label__ out;
+	struct efs_stat sb;
+	const char *path;
+	efs_ino_t parent;
+	uint8_t *inside = NULL;
+	size_t ninside = 0;	/* bytes in inside */
+	size_t i;
+	int rc = 0;
+
+	_idx_bit_set(&inside, &ninside, dir);
+	for (i = 0; i < idx->nentries; i++) {
+		if (idx_entry(idx, i, &path, &parent, &sb) == -1) {
+			rc = -1;
+			goto out;
+		}
+		if (!_idx_bit_test(inside, ninside, parent))
+			continue;
+
+		rc = fn(path, sb.st_ino, parent, &sb, arg);
+		if (rc == EFS_FTW_STOP)
+			goto out;
+		if (((sb.st_mode & IFMT) == IFDIR) && (rc != EFS_FTW_SKIP_SUBTREE))
+			_idx_bit_set(&inside, &ninside, sb.st_ino);
+	}
+	rc = 0;
+
+out:
+	free(inside);
+	return rc;
+}
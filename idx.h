@@ -0,0 +1,36 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include "efs.h"
+
+/*
+ * A sidecar index of an EFS file system: every path in it, with its
+ * inode metadata and extent map, in the order efs_nftwi() visits them.
+ * An index is only used while the image it was made from is unchanged,
+ * which is checked with an idx_key.
+ */
+
+/* the index of image FILE is written to FILE IDX_SUFFIX */
+#define IDX_SUFFIX	".efsidx"
+
+struct idx_key {
+	uint64_t size;		/* of the image file, in bytes */
+	int64_t mtime;		/* of the image file */
+	int32_t parnum;		/* partition the file system is in */
+	uint32_t sbsum;		/* CRC-32 of the raw superblock */
+};
+
+typedef struct idx idx_t;
+
+extern efs_err_t idx_make_key(struct idx_key *key, const char *image, int parnum, efs_t *efs);
+extern efs_err_t idx_write(efs_t *efs, const char *path, const struct idx_key *key);
+
+extern idx_t *idx_open(const char *path, const struct idx_key *key);
+extern void idx_close(idx_t *idx);
+
+extern size_t idx_count(idx_t *idx);
+extern int idx_entry(idx_t *idx, size_t n, const char **path, efs_ino_t *parent, struct efs_stat *sb);
+extern ssize_t idx_find(idx_t *idx, const char *path);
+extern struct efs_extmap_ent *idx_extmap(idx_t *idx, size_t n, size_t *nents);
+extern int idx_walk(idx_t *idx, efs_nftwi_fn fn, void *arg);
+extern int idx_walk_under(idx_t *idx, efs_ino_t dir, efs_nftwi_fn fn, void *arg);
@@ -0,0 +1,861 @@
+#define _FILE_OFFSET_BITS 64
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dcache.h"
+#include "efs.h"
+#include "err.h"
+#include "isofs.h"
+
+#define MIN(a,b) (a>b?b:a)
+
+/* directory record flags */
+#define ISO_FLAG_DIR	0x02
+#define ISO_FLAG_ASSOC	0x04
+#define ISO_FLAG_MULTI	0x80
+
+/* smallest directory record: the fixed part and a one-byte name */
+#define ISO_DR_MINLEN	34
+/* inode number = sector << this | index of the record in the sector */
+#define ISOFS_INOSHIFT	6
+#define ISOFS_MAXLBN	((uint32_t)1 << (32 - ISOFS_INOSHIFT))
+
+/* give up after this many continuation areas for one record */
+#define ISOFS_MAXCE	16
+/* or this many sections of one file */
+#define ISOFS_MAXSECTIONS	1024
+
+#define ISOFS_DIRENT_INCR	(100)
+
+struct isofs {
+	uint32_t rootlbn;	/* where the root directory starts */
+	bool rr;		/* Rock Ridge entries are present */
+	unsigned skip;		/* bytes to skip at the start of each SUA */
+};
+
+/*
+ * One directory record, decoded, with the Rock Ridge entries we use
+ * applied on top.
+ */
+struct isofs_rec {
+	size_t reclen;
+	uint32_t lbn;		/* first block of the data, after any XAR */
+	uint32_t size;
+	uint8_t flags;
+	bool interleaved;
+	uint16_t mode;
+	int16_t nlink;
+	uint16_t uid;
+	uint16_t gid;
+	uint32_t major;
+	uint32_t minor;
+	int32_t atime;
+	int32_t mtime;
+	int32_t ctime;
+	uint32_t cl;		/* where a relocated directory really is */
+	bool re;		/* this is a relocated directory */
+	char name[EFS_MAX_NAME + 1];
+	char *link;		/* symlink target, malloc'd */
+	size_t linklen;
+};
+
+static uint32_t _iso_733(const uint8_t *p)
+{
+	/* both-endian; the little-endian half comes first */
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t _iso_723(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+/*
+ * Days from 1970-01-01 to y-m-d.
+ */
+static int64_t _isofs_days(int64_t y, unsigned m, unsigned d)
+{
+	int64_t era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+static int32_t _isofs_mktime(int64_t y, unsigned m, unsigned d,
+	unsigned hh, unsigned mm, unsigned ss, int8_t gmtoff)
+{
+	int64_t t;
+
+	if ((m < 1) || (m > 12) || (d < 1) || (d > 31))
+		return 0;
+	t = _isofs_days(y, m, d) * 86400 + hh * 3600 + mm * 60 + ss;
+	t -= gmtoff * 15 * 60;
+	return (int32_t)t;
+}
+
+/* the 7-byte form, in directory records and short TF entries */
+static int32_t _isofs_time7(const uint8_t *p)
+{
+	return _isofs_mktime(1900 + p[0], p[1], p[2], p[3], p[4], p[5], (int8_t)p[6]);
+}
+
+/* the 17-byte form: "YYYYMMDDHHMMSScc" and an offset */
+static int32_t _isofs_time17(const uint8_t *p)
+{
+	unsigned v[6];
+	static const unsigned widths[6] = {4, 2, 2, 2, 2, 2};
+	unsigned i, j;
+
+	for (i = 0; i < 6; i++) {
+		v[i] = 0;
+		for (j = 0; j < widths[i]; j++, p++) {
+			if ((*p < '0') || (*p > '9'))
+				return 0;
+			v[i] = v[i] * 10 + (*p - '0');
+		}
+	}
+	return _isofs_mktime(v[0], v[1], v[2], v[3], v[4], v[5], (int8_t)p[2]);
+}
+
+/*
+ * Read len bytes at byte offset off of the image. All of it is
+ * metadata, so it is read in runs short enough to be cached.
+ */
+static efs_err_t _isofs_pread(efs_t *ctx, void *buf, uint64_t off, size_t len)
+{
+	uint8_t tmp[EFS_CACHE_MAXRUN * BLKSIZ];
+	uint8_t *p = buf;
+	size_t skip, nblks, n;
+	efs_err_t erc;
+
+	while (len) {
+		skip = off % BLKSIZ;
+		nblks = MIN(EFS_CACHE_MAXRUN, (skip + len + BLKSIZ - 1) / BLKSIZ);
+		erc = efs_get_blocks(ctx, tmp, off / BLKSIZ, nblks);
+		if (erc != EFS_ERR_OK)
+			return erc;
+		n = MIN(len, nblks * BLKSIZ - skip);
+		memcpy(p, tmp + skip, n);
+		p += n;
+		off += n;
+		len -= n;
+	}
+
+	return EFS_ERR_OK;
+}
+
+/*
+ * Is there a whole directory record at pos in sector?
+ */
+static bool _isofs_rec_ok(const uint8_t *sector, size_t pos)
+{
+	size_t len;
+
+	if (pos + ISO_DR_MINLEN > ISOFS_SECTOR)
+		return false;
+	len = sector[pos];
+	return (len >= ISO_DR_MINLEN) && (pos + len <= ISOFS_SECTOR)
+		&& (33 + (size_t)sector[pos + 32] <= len);
+}
+
+/*
+ * Plain ISO9660 names are upper case, with a version, and with a dot
+ * even if there is no extension. Turn "README.;1" into "readme".
+ */
+static void _isofs_name(const uint8_t *p, size_t len, char *out)
+{
+	size_t i, n = 0;
+
+	if ((len == 1) && (p[0] <= 1)) {
+		strcpy(out, p[0] ? ".." : ".");
+		return;
+	}
+
+	for (i = 0; (i < len) && (p[i] != ';') && (n < EFS_MAX_NAME); i++) {
+		if ((p[i] >= 'A') && (p[i] <= 'Z'))
+			out[n++] = p[i] - 'A' + 'a';
+		else if ((p[i] == '/') || !p[i])
+			out[n++] = '_';
+		else
+			out[n++] = p[i];
+	}
+	if ((n > 1) && (out[n - 1] == '.'))
+		n--;
+	out[n] = '\0';
+}
+
+static void _isofs_link_append(struct isofs_rec *r, const void *p, size_t n)
+{
+	char *q;
+
+	q = realloc(r->link, r->linklen + n + 1);
+	if (!q)
+		err(1, "in realloc");
+	memcpy(q + r->linklen, p, n);
+	r->linklen += n;
+	q[r->linklen] = '\0';
+	r->link = q;
+}
+
+/*
+ * Add the components of one SL entry to the symlink target. *sep says
+ * whether a slash goes before the next component; it carries over to
+ * the next SL entry of the same record.
+ */
+static void _isofs_parse_sl(struct isofs_rec *r, const uint8_t *p, size_t len, bool *sep)
+{
+	size_t clen;
+	uint8_t cflags;
+
+	while (len >= 2) {
+		cflags = p[0];
+		clen = p[1];
+		if (clen + 2 > len)
+			break;
+
+		if (*sep)
+			_isofs_link_append(r, "/", 1);
+		*sep = true;
+		if (cflags & 0x02) {
+			_isofs_link_append(r, ".", 1);
+		} else if (cflags & 0x04) {
+			_isofs_link_append(r, "..", 2);
+		} else if (cflags & 0x08) {
+			_isofs_link_append(r, "/", 1);
+			*sep = false;
+		} else {
+			_isofs_link_append(r, p + 2, clen);
+		}
+		/* the component goes on in the next one */
+		if (cflags & 0x01)
+			*sep = false;
+
+		p += clen + 2;
+		len -= clen + 2;
+	}
+}
+
+static void _isofs_parse_tf(struct isofs_rec *r, const uint8_t *p, size_t len)
+{
+	uint8_t tflags;
+	size_t sz;
+	unsigned bit;
+	int32_t t;
+
+	if (len < 1)
+		return;
+	tflags = *p++;
+	len--;
+	sz = (tflags & 0x80) ? 17 : 7;
+
+	/* creation, modify, access, attributes, backup, expiration, effective */
+	for (bit = 0; bit < 7; bit++) {
+		if (!(tflags & (1 << bit)))
+			continue;
+		if (len < sz)
+			break;
+		t = (sz == 17) ? _isofs_time17(p) : _isofs_time7(p);
+		switch (bit) {
+		case 1:
+			r->mtime = t;
+			break;
+		case 2:
+			r->atime = t;
+			break;
+		case 3:
+			r->ctime = t;
+			break;
+		}
+		p += sz;
+		len -= sz;
+	}
+}
+
+#define SIG(a,b) (((a) << 8) | (b))
+
+/*
+ * Apply the Rock Ridge entries in a System Use area to r, following
+ * continuation areas.
+ */
+static void _isofs_parse_susp(efs_t *ctx, const uint8_t *sua, size_t len, struct isofs_rec *r)
+{
+	char nm[EFS_MAX_NAME + 1];
+	size_t nmlen = 0;
+	bool have_nm = false;
+	bool sep = false;
+	uint8_t *ce = NULL;
+	uint64_t ceoff = 0;
+	size_t celen, elen, n;
+	unsigned nce = 0;
+	uint32_t high, low;
+	const uint8_t *e;
+
+	for (;;) {
+		celen = 0;
+		while (len >= 4) {
+			e = sua;
+			elen = e[2];
+			if ((elen < 4) || (elen > len))
+				break;
+
+			switch (SIG(e[0], e[1])) {
+			case SIG('P','X'):
+				if (elen < 36)
+					break;
+				r->mode = _iso_733(e + 4);
+				r->nlink = _iso_733(e + 12);
+				r->uid = _iso_733(e + 20);
+				r->gid = _iso_733(e + 28);
+				break;
+			case SIG('P','N'):
+				if (elen < 20)
+					break;
+				high = _iso_733(e + 4);
+				low = _iso_733(e + 12);
+				/* an old-style dev_t, all in the low word */
+				if (!high && (low & ~0xffu)) {
+					high = low >> 8;
+					low &= 0xff;
+				}
+				r->major = high;
+				r->minor = low;
+				break;
+			case SIG('S','L'):
+				if (elen < 5)
+					break;
+				_isofs_parse_sl(r, e + 5, elen - 5, &sep);
+				break;
+			case SIG('N','M'):
+				/* "." and ".." have names already */
+				if ((elen < 5) || (e[4] & 0x06))
+					break;
+				n = MIN(elen - 5, EFS_MAX_NAME - nmlen);
+				memcpy(nm + nmlen, e + 5, n);
+				nmlen += n;
+				have_nm = true;
+				break;
+			case SIG('T','F'):
+				_isofs_parse_tf(r, e + 4, elen - 4);
+				break;
+			case SIG('C','L'):
+				if (elen >= 12)
+					r->cl = _iso_733(e + 4);
+				break;
+			case SIG('R','E'):
+				r->re = true;
+				break;
+			case SIG('C','E'):
+				if (elen < 28)
+					break;
+				ceoff = (uint64_t)_iso_733(e + 4) * ISOFS_SECTOR
+					+ _iso_733(e + 12);
+				celen = _iso_733(e + 20);
+				break;
+			case SIG('S','T'):
+				len = elen;
+				break;
+			}
+
+			sua += elen;
+			len -= elen;
+		}
+
+		if (!celen || (celen > ISOFS_SECTOR) || (++nce > ISOFS_MAXCE))
+			break;
+		free(ce);
+		ce = malloc(celen);
+		if (!ce)
+			break;
+		if (_isofs_pread(ctx, ce, ceoff, celen) != EFS_ERR_OK)
+			break;
+		sua = ce;
+		len = celen;
+	}
+	free(ce);
+
+	if (have_nm && nmlen) {
+		for (n = 0; n < nmlen; n++)
+			if ((nm[n] == '/') || !nm[n])
+				nm[n] = '_';
+		memcpy(r->name, nm, nmlen);
+		r->name[nmlen] = '\0';
+	}
+}
+
+#undef SIG
+
+/*
+ * Decode the directory record at rec, which _isofs_rec_ok() has
+ * passed. The caller must free r->link.
+ */
+static void _isofs_parse_rec(efs_t *ctx, const uint8_t *rec, struct isofs_rec *r)
+{
+	struct isofs *iso = ctx->iso;
+	size_t namelen, sua;
+
+	memset(r, 0, sizeof(*r));
+	r->reclen = rec[0];
+	r->lbn = _iso_733(rec + 2) + rec[1];
+	r->size = _iso_733(rec + 10);
+	r->flags = rec[25];
+	r->interleaved = rec[26] || rec[27];
+	r->atime = r->mtime = r->ctime = _isofs_time7(rec + 18);
+	/* without Rock Ridge, give what extraction needs to fill them in */
+	if (r->flags & ISO_FLAG_DIR) {
+		r->mode = IFDIR | 0755;
+		r->nlink = 2;
+	} else {
+		r->mode = IFREG | 0644;
+		r->nlink = 1;
+	}
+
+	namelen = rec[32];
+	_isofs_name(rec + 33, namelen, r->name);
+
+	if (!iso->rr)
+		return;
+	/* the name is padded to an even length */
+	sua = 33 + namelen + !(namelen & 1) + iso->skip;
+	if (sua < r->reclen)
+		_isofs_parse_susp(ctx, rec + sua, r->reclen - sua, r);
+}
+
+/*
+ * Read and decode the directory record of inode ino. Its byte offset
+ * in the image is stored in *offp.
+ */
+static efs_err_t _isofs_get_rec(efs_t *ctx, efs_ino_t ino, struct isofs_rec *r, uint64_t *offp)
+{
+	uint8_t sector[ISOFS_SECTOR];
+	uint64_t lbn;
+	size_t pos;
+	unsigned idx;
+	efs_err_t erc;
+
+	if (ino == EFS_ROOTINO) {
+		lbn = ctx->iso->rootlbn;
+		idx = 0;
+	} else {
+		lbn = ino >> ISOFS_INOSHIFT;
+		idx = ino & ((1 << ISOFS_INOSHIFT) - 1);
+	}
+
+	erc = _isofs_pread(ctx, sector, lbn * ISOFS_SECTOR, ISOFS_SECTOR);
+	if (erc != EFS_ERR_OK)
+		return erc;
+	for (pos = 0; idx; idx--) {
+		if (!_isofs_rec_ok(sector, pos))
+			return EFS_ERR_INVAL;
+		pos += sector[pos];
+	}
+	if (!_isofs_rec_ok(sector, pos))
+		return EFS_ERR_INVAL;
+
+	_isofs_parse_rec(ctx, sector + pos, r);
+	*offp = lbn * ISOFS_SECTOR + pos;
+	return EFS_ERR_OK;
+}
+
+/*
+ * The inode number of the directory starting at block lbn: that of
+ * its "." record.
+ */
+static efs_ino_t _isofs_dir_ino(efs_t *ctx, uint32_t lbn)
+{
+	if (lbn == ctx->iso->rootlbn)
+		return EFS_ROOTINO;
+	if (lbn >= ISOFS_MAXLBN)
+		return EFS_BADINO;
+	return lbn << ISOFS_INOSHIFT;
+}
+
+/*
+ * Map the sections of the file whose first directory record is at
+ * off, and r, into BBs of the image. Sections after the first have
+ * records of their own, following the first one. The total size is
+ * stored in *size.
+ */
+static struct efs_extmap_ent *_isofs_sections(efs_t *ctx, uint64_t off,
+	struct isofs_rec *r, size_t *nents, uint64_t *size)
+{
+	__label__ out_error;
+	struct efs_extmap_ent *map = NULL, *newmap;
+	struct isofs_rec next;
+	uint8_t sector[ISOFS_SECTOR];
+	uint64_t total = 0;
+	size_t n = 0, pos;
+	unsigned nsections = 0;
+
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		goto out_error;
+
+	for (;;) {
+		if (r->interleaved)
+			goto out_error;
+		if (r->size) {
+			/* only the last section may end part way through a BB */
+			if (total % BLKSIZ)
+				goto out_error;
+			newmap = realloc(map, (n + 2) * sizeof(*map));
+			if (!newmap)
+				goto out_error;
+			map = newmap;
+			map[n].bn = (uint64_t)r->lbn * (ISOFS_SECTOR / BLKSIZ);
+			map[n].offset = total / BLKSIZ;
+			map[n].length = (r->size + BLKSIZ - 1) / BLKSIZ;
+			n++;
+			memset(&map[n], 0, sizeof(*map));
+		}
+		total += r->size;
+		if (!(r->flags & ISO_FLAG_MULTI))
+			break;
+		if (++nsections > ISOFS_MAXSECTIONS)
+			goto out_error;
+
+		/* the next record; skip the unused end of the sector */
+		off += r->reclen;
+		for (;;) {
+			pos = off % ISOFS_SECTOR;
+			if (_isofs_pread(ctx, sector, off - pos, ISOFS_SECTOR) != EFS_ERR_OK)
+				goto out_error;
+			if (pos && !sector[pos]) {
+				off += ISOFS_SECTOR - pos;
+				continue;
+			}
+			break;
+		}
+		if (!_isofs_rec_ok(sector, pos))
+			goto out_error;
+		_isofs_parse_rec(ctx, sector + pos, &next);
+		free(next.link);
+		next.link = NULL;
+		r = &next;
+	}
+
+	*nents = n;
+	*size = total;
+	return map;
+
+out_error:
+	free(map);
+	return NULL;
+}
+
+struct efs_dinode isofs_get_inode(efs_t *ctx, efs_ino_t ino)
+{
+	struct efs_dinode out = {0,};
+	struct efs_extmap_ent *map;
+	struct isofs_rec r;
+	uint64_t off, size;
+	size_t nents;
+
+	if (_isofs_get_rec(ctx, ino, &r, &off) != EFS_ERR_OK)
+		return out;
+
+	out.di_mode = r.mode;
+	out.di_nlink = r.nlink;
+	out.di_uid = r.uid;
+	out.di_gid = r.gid;
+	out.di_atime = r.atime;
+	out.di_mtime = r.mtime;
+	out.di_ctime = r.ctime;
+
+	switch (r.mode & IFMT) {
+	case IFLNK:
+		size = r.linklen;
+		break;
+	case IFCHR:
+	case IFBLK:
+		out.di_u.di_dev.odev = ((r.major & 0xff) << 8) | (r.minor & 0xff);
+		out.di_u.di_dev.ndev = (r.major << 18) | (r.minor & 0x3ffff);
+		size = 0;
+		break;
+	case IFREG:
+		size = r.size;
+		if (r.flags & ISO_FLAG_MULTI) {
+			map = _isofs_sections(ctx, off, &r, &nents, &size);
+			if (!map)
+				size = 0;
+			free(map);
+		}
+		break;
+	default:
+		size = r.size;
+		break;
+	}
+	/* too big to describe; nothing will read it */
+	out.di_size = (size > INT32_MAX) ? -1 : (int32_t)size;
+
+	free(r.link);
+	return out;
+}
+
+/*
+ * Like efs_get_extmap(). Only regular files and directories have
+ * extents; anything else gets an empty map.
+ */
+struct efs_extmap_ent *isofs_get_extmap(efs_t *ctx, efs_ino_t ino, size_t *nents)
+{
+	struct efs_extmap_ent *map;
+	struct isofs_rec r;
+	uint64_t off, size;
+
+	if (_isofs_get_rec(ctx, ino, &r, &off) != EFS_ERR_OK)
+		return NULL;
+
+	switch (r.mode & IFMT) {
+	case IFREG:
+	case IFDIR:
+		map = _isofs_sections(ctx, off, &r, nents, &size);
+		break;
+	default:
+		map = calloc(1, sizeof(*map));
+		*nents = 0;
+		break;
+	}
+
+	free(r.link);
+	return map;
+}
+
+/*
+ * Like _efs_read_dirblks(): every entry of directory ino, including
+ * "." and "..", in a malloc'd array ended by one with d_ino == 0.
+ */
+struct efs_dirent *isofs_read_dir(efs_t *ctx, efs_ino_t ino)
+{
+	__label__ out_error;
+	struct efs_dirent *out = NULL, *newout;
+	size_t out_size = 0, out_used = 0;
+	struct isofs_rec dir, r;
+	uint8_t sector[ISOFS_SECTOR];
+	uint64_t start, end, lbn, off;
+	size_t pos;
+	unsigned idx;
+	bool cont = false;
+	efs_ino_t eino;
+
+	if (_isofs_get_rec(ctx, ino, &dir, &off) != EFS_ERR_OK)
+		return NULL;
+	free(dir.link);
+	if (!(dir.flags & ISO_FLAG_DIR))
+		return NULL;
+
+	out_size = ISOFS_DIRENT_INCR;
+	out = calloc(out_size, sizeof(*out));
+	if (!out)
+		return NULL;
+
+	start = dir.lbn;
+	end = start + (dir.size + ISOFS_SECTOR - 1) / ISOFS_SECTOR;
+	for (lbn = start; lbn < end; lbn++) {
+		if (_isofs_pread(ctx, sector, lbn * ISOFS_SECTOR, ISOFS_SECTOR) != EFS_ERR_OK)
+			goto out_error;
+
+		for (pos = 0, idx = 0; _isofs_rec_ok(sector, pos); pos += sector[pos], idx++) {
+			bool skip;
+
+			_isofs_parse_rec(ctx, sector + pos, &r);
+			free(r.link);
+
+			/* later sections of a file, Mac resource forks, and
+			 * directories that Rock Ridge shows somewhere else
+			 */
+			skip = cont || r.re || (r.flags & ISO_FLAG_ASSOC);
+			cont = r.flags & ISO_FLAG_MULTI;
+			if (skip)
+				continue;
+
+			if (!strcmp(r.name, "."))
+				eino = ino;
+			else if (r.cl)
+				eino = _isofs_dir_ino(ctx, r.cl);
+			else if (r.flags & ISO_FLAG_DIR)
+				eino = _isofs_dir_ino(ctx, r.lbn);
+			else if (lbn < ISOFS_MAXLBN)
+				eino = (lbn << ISOFS_INOSHIFT) | idx;
+			else
+				eino = EFS_BADINO;
+			if (!eino || (eino == EFS_BADINO))
+				continue;
+
+			if (out_used + 1 >= out_size) {
+				out_size += ISOFS_DIRENT_INCR;
+				newout = realloc(out, out_size * sizeof(*out));
+				if (!newout)
+					goto out_error;
+				out = newout;
+			}
+			out[out_used].d_ino = eino;
+			strcpy(out[out_used].d_name, r.name);
+			out_used++;
+		}
+	}
+
+	out[out_used].d_ino = 0;
+	return out;
+
+out_error:
+	free(out);
+	return NULL;
+}
+
+ssize_t isofs_readlinki(efs_t *ctx, efs_ino_t ino, char *buf, size_t bufsiz)
+{
+	struct isofs_rec r;
+	uint64_t off;
+	size_t len;
+
+	if (_isofs_get_rec(ctx, ino, &r, &off) != EFS_ERR_OK) {
+		errno = EIO;
+		return -1;
+	}
+	if ((r.mode & IFMT) != IFLNK) {
+		free(r.link);
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = MIN(r.linklen, bufsiz);
+	if (len)
+		memcpy(buf, r.link, len);
+	free(r.link);
+	return len;
+}
+
+/*
+ * Open the ISO9660 file system in fs, which must start at the start
+ * of the image.
+ */
+efs_err_t isofs_open(efs_t **ctx, fileslice_t *fs)
+{
+	__label__ out_error;
+	uint8_t buf[ISOFS_SECTOR];
+	struct isofs *iso;
+	const uint8_t *rec;
+	efs_err_t erc;
+	size_t sector, sua;
+
+	*ctx = calloc(1, sizeof(efs_t));
+	if (!*ctx) {
+		erc = EFS_ERR_NOMEM;
+		goto out_error;
+	}
+	(*ctx)->fs = fs;
+	(*ctx)->fstype = EFS_FSTYPE_ISO9660;
+	(*ctx)->readahead = EFS_READAHEAD_DEFAULT;
+	iso = (*ctx)->iso = calloc(1, sizeof(struct isofs));
+	if (!iso) {
+		erc = EFS_ERR_NOMEM;
+		goto out_error;
+	}
+
+	erc = efs_set_cache_size(*ctx, EFS_CACHE_DEFAULT);
+	if (erc != EFS_ERR_OK)
+		goto out_error;
+	(*ctx)->dcache = dcache_init(DCACHE_DEFAULT_DIRS, DCACHE_DEFAULT_PATHS);
+	if (!(*ctx)->dcache) {
+		erc = EFS_ERR_NOMEM;
+		goto out_error;
+	}
+
+	/* Find the primary volume descriptor. Joliet's is ignored. */
+	for (sector = 16; ; sector++) {
+		erc = _isofs_pread(*ctx, buf, sector * ISOFS_SECTOR, ISOFS_SECTOR);
+		if (erc != EFS_ERR_OK)
+			goto out_error;
+		if (memcmp(buf + 1, "CD001", 5) || (buf[0] == 255)
+		  || (sector > 16 + 32)) {
+			erc = EFS_ERR_SBMAGIC;
+			goto out_error;
+		}
+		if (buf[0] == 1)
+			break;
+	}
+
+	/* every CD ever made uses 2048-byte blocks */
+	if (_iso_723(buf + 128) != ISOFS_SECTOR) {
+		erc = EFS_ERR_INVAL;
+		goto out_error;
+	}
+	rec = buf + 156;
+	iso->rootlbn = _iso_733(rec + 2) + rec[1];
+
+	/*
+	 * Rock Ridge is announced by an SP entry at the start of the
+	 * root's "." record. Until then, iso->rr is false and the
+	 * record is parsed as plain ISO9660.
+	 */
+	erc = _isofs_pread(*ctx, buf, (uint64_t)iso->rootlbn * ISOFS_SECTOR, ISOFS_SECTOR);
+	if (erc != EFS_ERR_OK)
+		goto out_error;
+	if (!_isofs_rec_ok(buf, 0)) {
+		erc = EFS_ERR_INVAL;
+		goto out_error;
+	}
+	sua = 33 + buf[32] + !(buf[32] & 1);
+	if ((sua + 7 <= buf[0]) && !memcmp(buf + sua, "SP", 2)
+	  && (buf[sua + 2] >= 7) && (buf[sua + 4] == 0xbe) && (buf[sua + 5] == 0xef)) {
+		iso->rr = true;
+		iso->skip = buf[sua + 6];
+	}
+
+	return EFS_ERR_OK;
+
+out_error:
+	if (*ctx) {
+		bcache_free((*ctx)->bcache);
+		dcache_free((*ctx)->dcache);
+		free((*ctx)->iso);
+		free(*ctx);
+	}
+	*ctx = NULL;
+	return erc;
+}
+
+/*
+ * Open filename, which has no volume header, as an ISO9660 image.
+ */
+efs_err_t isofs_easy_open(efs_t **ctx, const char *filename)
+{
+	__label__ out_error;
+	efs_err_t erc;
+	dvh_t *dvh;
+	fileslice_t *fs = NULL;
+
+	/* There's no volume header, but the dvh owns the descriptor. */
+	dvh = calloc(1, sizeof(dvh_t));
+	if (!dvh)
+		return EFS_ERR_NOMEM;
+	dvh->fd = open(filename, O_RDONLY | O_BINARY);
+	if (dvh->fd == -1) {
+		free(dvh);
+		return EFS_ERR_NOENT;
+	}
+
+	fs = fsopen(dvh->fd, 0, 0);
+	if (!fs) {
+		erc = EFS_ERR_READFAIL;
+		goto out_error;
+	}
+	erc = isofs_open(ctx, fs);
+	if (erc != EFS_ERR_OK)
+		goto out_error;
+
+	(*ctx)->dvh = dvh;
+	return EFS_ERR_OK;
+
+out_error:
+	fsclose(fs);
+	dvh_close(dvh);
+	return erc;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <stddef.h>
+#include "efs.h"
+
+/*
+ * ISO9660 file systems, with Rock Ridge if present, read through the
+ * same efs_t as EFS: the same slice, block cache and directory cache,
+ * and the same inode-number based API. efs.c hands every ISO9660 call
+ * that touches on-disk structures to the functions below.
+ *
+ * There are no inodes in ISO9660. A file's inode number is made from
+ * the sector holding its directory record and the record's place in
+ * that sector; a directory's is that of its "." record, so every name
+ * for it agrees. The root is always EFS_ROOTINO.
+ */
+
+#define ISOFS_SECTOR	2048
+/* BB of the primary volume descriptor */
+#define ISOFS_PVD_BB	(16 * ISOFS_SECTOR / BLKSIZ)
+
+extern efs_err_t isofs_open(efs_t **ctx, fileslice_t *fs);
+extern efs_err_t isofs_easy_open(efs_t **ctx, const char *filename);
+
+extern struct efs_dinode isofs_get_inode(efs_t *ctx, efs_ino_t ino);
+extern struct efs_extmap_ent *isofs_get_extmap(efs_t *ctx, efs_ino_t ino, size_t *nents);
+extern struct efs_dirent *isofs_read_dir(efs_t *ctx, efs_ino_t ino);
+extern ssize_t isofs_readlinki(efs_t *ctx, efs_ino_t ino, char *buf, size_t bufsiz);
@@ -0,0 +1,122 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "efs.h"
+#include "err.h"
+#include "linkmap.h"
+
+/*
+ * A chained hash on inode number, doubled whenever it holds more
+ * entries than buckets. Only inodes with more than one link are ever
+ * added, so it stays small next to the file system.
+ */
+
+#define LINKMAP_INITIAL	256
+
+struct linkmap_ent {
+	efs_ino_t ino;
+	char *path;
+	struct linkmap_ent *hnext;
+};
+
+struct linkmap {
+	struct linkmap_ent **buckets;
+	size_t nbuckets;	/* power of two */
+	size_t nents;
+};
+
+static size_t linkmap_hash(linkmap_t *lm, efs_ino_t ino)
+{
+	return ((uint32_t)ino * 2654435761u) & (lm->nbuckets - 1);
+}
+
+linkmap_t *linkmap_init(void)
+{
+	linkmap_t *lm;
+
+	lm = calloc(1, sizeof(*lm));
+	if (!lm)
+		return NULL;
+	lm->nbuckets = LINKMAP_INITIAL;
+	lm->buckets = calloc(lm->nbuckets, sizeof(*lm->buckets));
+	if (!lm->buckets) {
+		free(lm);
+		return NULL;
+	}
+	return lm;
+}
+
+void linkmap_free(linkmap_t *lm)
+{
+	struct linkmap_ent *e, *next;
+	size_t i;
+
+	if (!lm)
+		return;
+
+	for (i = 0; i < lm->nbuckets; i++) {
+		for (e = lm->buckets[i]; e; e = next) {
+			next = e->hnext;
+			free(e->path);
+			free(e);
+		}
+	}
+	free(lm->buckets);
+	free(lm);
+}
+
+static void _linkmap_grow(linkmap_t *lm)
+{
+	struct linkmap_ent **old, *e, *next;
+	size_t nold, i, h;
+
+	old = lm->buckets;
+	nold = lm->nbuckets;
+	lm->buckets = calloc(nold * 2, sizeof(*lm->buckets));
+	if (!lm->buckets) {
+		/* keep the old table; chains just get longer */
+		lm->buckets = old;
+		return;
+	}
+	lm->nbuckets = nold * 2;
+
+	for (i = 0; i < nold; i++) {
+		for (e = old[i]; e; e = next) {
+			next = e->hnext;
+			h = linkmap_hash(lm, e->ino);
+			e->hnext = lm->buckets[h];
+			lm->buckets[h] = e;
+		}
+	}
+	free(old);
+}
+
+/*
+ * If ino has been added before, return the path it was added with.
+ * Otherwise, remember path for it and return NULL.
+ */
+const char *linkmap_add(linkmap_t *lm, efs_ino_t ino, const char *path)
+{
+	struct linkmap_ent *e;
+	size_t h;
+
+	h = linkmap_hash(lm, ino);
+	for (e = lm->buckets[h]; e; e = e->hnext)
+		if (e->ino == ino)
+			return e->path;
+
+	e = malloc(sizeof(*e));
+	if (!e)
+		err(1, "in malloc");
+	e->ino = ino;
+	e->path = strdup(path);
+	if (!e->path)
+		err(1, "in strdup");
+	e->hnext = lm->buckets[h];
+	lm->buckets[h] = e;
+
+	if (++lm->nents > lm->nbuckets)
+		_linkmap_grow(lm);
+
+	return NULL;
+}
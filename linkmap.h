@@ -0,0 +1,13 @@
+#pragma once
+#include "efs.h"
+
+/*
+ * Remembers the first path each multiply-linked inode was seen at,
+ * so later paths to it can be made into hard links.
+ */
+
+typedef struct linkmap linkmap_t;
+
+extern linkmap_t *linkmap_init(void);
+extern void linkmap_free(linkmap_t *lm);
+extern const char *linkmap_add(linkmap_t *lm, efs_ino_t ino, const char *path);
@@ -19,7 +19,7 @@
 const bool verbose = false;
 
 /* returns true or false, or a negative to indicate error */
-int is_pd(efs_t *efs, const char *path)
+int is_pd(efs_t *efs, efs_ino_t ino)
 {
 	struct efs_stat sb;
 	efs_file_t *f;
@@ -27,7 +27,7 @@ int is_pd(efs_t *efs, const char *path)
 	uint8_t buf[BLKSIZ];
 	size_t sz;
 
-	rc = efs_stat(efs, path, &sb);
+	rc = efs_stati(efs, ino, &sb);
 	if (rc == -1)
 		return -1;
 
@@ -36,7 +36,7 @@ int is_pd(efs_t *efs, const char *path)
 	if (sb.st_size < 16) {
 		return false;
 	}
-	f = efs_fopen(efs, path);
+	f = efs_fopeni(efs, ino);
 	if (!f)
 		return -2;
 
@@ -55,15 +55,15 @@ int is_pd(efs_t *efs, const char *path)
 	}
 }
 
-void pdprint(efs_t *efs, const char *path)
+void pdprint(efs_t *efs, efs_ino_t ino, const char *path, enum pd_format fmt)
 {
 	struct efs_stat sb;
 	efs_file_t *f;
 	int rc;
 
-	rc = efs_stat(efs, path, &sb);
+	rc = efs_stati(efs, ino, &sb);
 	if (rc == -1)
-		err(1, "couldn't get stat for '%s'", path);
+		err(1, "couldn't get stat for inode %u", ino);
 
 	if (IFREG != (sb.st_mode & IFMT)) {
 		return;
@@ -71,77 +71,103 @@ void pdprint(efs_t *efs, const char *path)
 	if (sb.st_size < 16) {
 		return;
 	}
-	f = efs_fopen(efs, path);
+	f = efs_fopeni(efs, ino);
 	if (f) {
-		pdscan(f);
+		pdscan(f, path, fmt);
 		efs_fclose(f);
 		f = NULL;
 	} else {
 #if 0
-		warnx("couldn't open efs file '%s'\n", path);
+		warnx("couldn't open efs inode %u\n", ino);
 #endif
 	}
 }
 
-uint16_t getShort(efs_file_t *f)
+/*
+ * The parser works on a product file that has been read into memory.
+ * Reads past the end of the buffer don't abort: they return zeroes
+ * and empty strings and set the cursor's error flag, which the parser
+ * checks before trusting any counts.
+ */
+struct pdcur {
+	const uint8_t *data;
+	size_t len;
+	size_t pos;
+	bool error;
+};
+
+static const uint8_t *getBytes(struct pdcur *c, size_t n)
 {
-	uint16_t out = 0;
-	size_t sz;
+	const uint8_t *out;
 
-	sz = efs_fread(&out, 2, 1, f);
-	if (sz != 1)
-		errx(1, "couldn't read short");
-	out = be16toh(out);
+	if (c->error || (n > c->len - c->pos)) {
+		c->error = true;
+		return NULL;
+	}
+	out = c->data + c->pos;
+	c->pos += n;
 	return out;
 }
 
-uint32_t getInt(efs_file_t *f)
+static uint16_t getShort(struct pdcur *c)
+{
+	const uint8_t *p;
+
+	p = getBytes(c, 2);
+	if (!p)
+		return 0;
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t getInt(struct pdcur *c)
 {
 	uint32_t out = 0;
-	out = getShort(f);
+	out = getShort(c);
 	out <<= 16;
-	out += getShort(f);
+	out += getShort(c);
 	return out;
 }
 
-char *getCstring(efs_file_t *f)
+static char *getBuf(const uint8_t *p, size_t len)
 {
-	char *out = NULL;
-	size_t len = 0;
-	long oldpos;
-	char a = '\0';
-	size_t sz;
+	char *out;
 
-	oldpos = efs_ftell(f);
-	do {
-		sz = efs_fread(&a, 1, 1, f);
-		if (sz != 1) errx(1, "in getCstring 1");
-		if (a) len++;
-	} while (a);
-	efs_fseek(f, oldpos, SEEK_SET);
 	out = malloc(len + 1);
-	if (!out) errx(1, "in malloc");
-	sz = efs_fread(out, len + 1, 1, f);
-	if (sz != 1)
-		errx(1, "in getCstring 2");
+	if (!out) err(1, "in malloc");
+	if (len)
+		memcpy(out, p, len);
 	out[len] = '\0';
 	return out;
 }
 
-char *getString(efs_file_t *f)
+static char *getCstring(struct pdcur *c)
 {
-	char *out = NULL;
-	size_t len = 0;
-	size_t sz;
-	len = getShort(f);
-	out = malloc(len + 1);
-	if (!out) err(1, "in malloc");
-	if (len) {
-		sz = efs_fread(out, len, 1, f);
-		if (sz != 1)
-			errx(1, "in getString");
+	const uint8_t *p, *end;
+	size_t len;
+
+	if (c->error)
+		return getBuf(NULL, 0);
+
+	p = c->data + c->pos;
+	end = memchr(p, '\0', c->len - c->pos);
+	if (!end) {
+		c->error = true;
+		return getBuf(NULL, 0);
 	}
-	out[len] = '\0';
+	len = end - p;
+	c->pos += len + 1;
+	return getBuf(p, len);
+}
+
+static char *getString(struct pdcur *c)
+{
+	const uint8_t *p;
+	size_t len = 0;
+
+	len = getShort(c);
+	p = getBytes(c, len);
+	if (!p)
+		return getBuf(NULL, 0);
 #if 0
 	for (size_t i = 0; i < len; i++) {
 		if (out[i] == '\x01') {
@@ -149,14 +175,131 @@ char *getString(efs_file_t *f)
 		}
 	}
 #endif
-	return out;
+	return getBuf(p, len);
+}
+
+/*
+ * In ndjson mode each product, image and subsystem becomes one JSON
+ * object on a line of its own. A record is built up here while its
+ * fields are parsed and written out as soon as it is complete, so only
+ * one record is ever held in memory.
+ */
+struct pdjson {
+	char *s;
+	size_t len;
+	size_t cap;
+};
+
+static void jsPut(struct pdjson *j, const char *s, size_t n)
+{
+	if (j->len + n + 1 > j->cap) {
+		size_t cap = j->cap? j->cap: 256;
+		char *p;
+
+		while (j->len + n + 1 > cap)
+			cap *= 2;
+		p = realloc(j->s, cap);
+		if (!p) err(1, "in realloc");
+		j->s = p;
+		j->cap = cap;
+	}
+	memcpy(j->s + j->len, s, n);
+	j->len += n;
+	j->s[j->len] = '\0';
+}
+
+/* put a comma between this value and the previous one, if any */
+static void jsSep(struct pdjson *j)
+{
+	char last;
+
+	if (!j->len)
+		return;
+	last = j->s[j->len - 1];
+	if ((last != '{') && (last != '[') && (last != ':'))
+		jsPut(j, ",", 1);
+}
+
+static void jsOpen(struct pdjson *j, char ch)
+{
+	jsSep(j);
+	jsPut(j, &ch, 1);
+}
+
+static void jsClose(struct pdjson *j, char ch)
+{
+	jsPut(j, &ch, 1);
+}
+
+/*
+ * Strings in product files are bytes with no particular encoding.
+ * Anything outside of printable ASCII is escaped as if it were
+ * Latin-1, which keeps the output valid UTF-8.
+ */
+static void jsString(struct pdjson *j, const char *s)
+{
+	const unsigned char *p;
+	char esc[8];
+
+	jsSep(j);
+	jsPut(j, "\"", 1);
+	for (p = (const unsigned char *)s; *p; p++) {
+		if ((*p == '"') || (*p == '\\')) {
+			esc[0] = '\\';
+			esc[1] = *p;
+			jsPut(j, esc, 2);
+		} else if ((*p < 0x20) || (*p >= 0x7f)) {
+			snprintf(esc, sizeof(esc), "\\u%04x", *p);
+			jsPut(j, esc, 6);
+		} else {
+			jsPut(j, (const char *)p, 1);
+		}
+	}
+	jsPut(j, "\"", 1);
+}
+
+static void jsKey(struct pdjson *j, const char *key)
+{
+	jsString(j, key);
+	jsPut(j, ":", 1);
+}
+
+static void jsInt(struct pdjson *j, int64_t v)
+{
+	char buf[32];
+
+	jsSep(j);
+	snprintf(buf, sizeof(buf), "%" PRId64, v);
+	jsPut(j, buf, strlen(buf));
+}
+
+static void jsBool(struct pdjson *j, bool v)
+{
+	jsSep(j);
+	if (v)
+		jsPut(j, "true", 4);
+	else
+		jsPut(j, "false", 5);
+}
+
+static void jsNull(struct pdjson *j)
+{
+	jsSep(j);
+	jsPut(j, "null", 4);
+}
+
+/* write out the finished record and start a new one */
+static void jsEmit(struct pdjson *j)
+{
+	printf("%s\n", j->s);
+	j->len = 0;
 }
 
-char *getTriplet(efs_file_t *f)
+static char *getTriplet(struct pdcur *c)
 {
-	char *a1 = getString(f);
-	char *a2 = getString(f);
-	char *a3 = getString(f);
+	char *a1 = getString(c);
+	char *a2 = getString(c);
+	char *a3 = getString(c);
 	char *triplet = NULL;
 	int rc;
 	rc = asprintf(&triplet, "%s.%s.%s", a1, a2, a3);
@@ -167,23 +310,47 @@ char *getTriplet(efs_file_t *f)
 	return triplet;
 }
 
-char *getMatcher(efs_file_t *f, const char *prefix)
+/*
+ * The get* helpers below take a struct pdjson, which is NULL in text
+ * mode. Otherwise they append what they parse to it as a JSON value.
+ */
+static char *getMatcher(struct pdcur *c, const char *prefix, struct pdjson *j)
 {
 	/* a matcher is 3 strings and 2 ints */
 	char *out = NULL;
 	int rc;
-	char *triplet = getTriplet(f);
-	int32_t from = getInt(f);
-	int32_t to = getInt(f);
+	char *triplet = getTriplet(c);
+	int32_t from = getInt(c);
+	int32_t to = getInt(c);
 	const char *my_prefix;
+	bool rule = false;
 	if (!prefix) {
 		my_prefix = "";
-	} else if (!strcmp(prefix, "replaces ") && (from < 0)) {
-		from = -from;
-		my_prefix = "follows ";
+	} else if (!strcmp(prefix, "replaces ")) {
+		rule = true;
+		if (from < 0) {
+			from = -from;
+			my_prefix = "follows ";
+		} else {
+			my_prefix = prefix;
+		}
 	} else {
 		my_prefix = prefix;
 	}
+	if (j) {
+		jsOpen(j, '{');
+		jsKey(j, "name");
+		jsString(j, triplet);
+		if (rule) {
+			jsKey(j, "follows");
+			jsBool(j, my_prefix != prefix);
+		}
+		jsKey(j, "from");
+		jsInt(j, from);
+		jsKey(j, "to");
+		jsInt(j, to);
+		jsClose(j, '}');
+	}
 	if (to == 2147483647u) {
 		rc = asprintf(&out, "%s'%s' %d maxint", my_prefix, triplet, from);
 	} else {
@@ -194,92 +361,168 @@ char *getMatcher(efs_file_t *f, const char *prefix)
 	return out;
 }
 
-void getRules(efs_file_t *f)
+static void getRules(struct pdcur *c, struct pdjson *j)
 {
 	uint16_t rulesCount;
 	int rule;
 
-	rulesCount = getShort(f);
+	rulesCount = getShort(c);
 	if (verbose)
 		printf("\t\trulesCount: %d\n", rulesCount);
-	if (rulesCount > 2000) errx(1, "diagnostic abort (too many rules)");
-	for (rule = 0; rule < rulesCount; rule++) {
-		char *matcher = getMatcher(f, "replaces ");
+	/* diagnostic: more rules than this means we're lost */
+	if (rulesCount > 2000) {
+		c->error = true;
+		return;
+	}
+	if (j)
+		jsOpen(j, '[');
+	for (rule = 0; (rule < rulesCount) && !c->error; rule++) {
+		char *matcher = getMatcher(c, "replaces ", j);
 		if (verbose)
 			printf("\t\t\t%s\n", matcher);
 		free(matcher);
 	}
+	if (j)
+		jsClose(j, ']');
 }
 
-void getMachInfo(efs_file_t *f)
+static void getMachInfo(struct pdcur *c, struct pdjson *j)
 {
 	/* get machine info */
 	size_t i;
-	uint32_t machCount = getInt(f);
+	uint32_t machCount = getInt(c);
 	if (verbose)
 		printf("machCount: %d\n", machCount);
-	for (i = 0; i < machCount; i++) {
-		char *m = getString(f);
+	if (j)
+		jsOpen(j, '[');
+	for (i = 0; (i < machCount) && !c->error; i++) {
+		char *m = getString(c);
 		if (verbose)
 			printf("\tmach '%s'\n", m);
+		if (j)
+			jsString(j, m);
 		free(m);
 	}
+	if (j)
+		jsClose(j, ']');
 }
 
-void getPrereqs(efs_file_t *f)
+static void getPrereqs(struct pdcur *c, struct pdjson *j)
 {
 	int set;
-	uint16_t prereqSets = getShort(f);
+	uint16_t prereqSets = getShort(c);
 	if (verbose)
 		printf("\t\tprereq sets: %d\n", prereqSets);
-	for (set = 0; set < prereqSets; set++) {
+	if (j)
+		jsOpen(j, '[');
+	for (set = 0; (set < prereqSets) && !c->error; set++) {
 		int a;
-		uint16_t prereqsCount = getShort(f);
+		uint16_t prereqsCount = getShort(c);
 		if (verbose)
 			printf("\t\tprereqs: %d (\n", prereqsCount);
-		for (a = 0; a < prereqsCount; a++) {
-			char *matcher = getMatcher(f, NULL);
+		if (j)
+			jsOpen(j, '[');
+		for (a = 0; (a < prereqsCount) && !c->error; a++) {
+			char *matcher = getMatcher(c, NULL, j);
 			if (verbose)
 				printf("\t\t\t%s\n", matcher);
 			free(matcher);
 		}
+		if (j)
+			jsClose(j, ']');
 		if (verbose)
 			printf("\t\t)\n");
 	}
+	if (j)
+		jsClose(j, ']');
 }
 
-void getAttrs(efs_file_t *f, const char *prefix)
+static void getAttrs(struct pdcur *c, const char *prefix, struct pdjson *j)
 {
 	size_t i;
-	uint32_t attrs = getInt(f);
+	uint32_t attrs = getInt(c);
 	if (verbose)
 		printf("%sattrs: %d\n", prefix, attrs);
-	for (i = 0; i < attrs; i++) {
-		char *attr = getString(f);
+	if (j)
+		jsOpen(j, '[');
+	for (i = 0; (i < attrs) && !c->error; i++) {
+		char *attr = getString(c);
 		if (verbose)
 			printf("%s\t'%s'\n", prefix, attr);
+		if (j)
+			jsString(j, attr);
 		free(attr);
 	}
+	if (j)
+		jsClose(j, ']');
 }
 
-void getUpdates(efs_file_t *f)
+static void getUpdates(struct pdcur *c, struct pdjson *j)
 {
 	int i;
-	uint16_t updatesCount = getShort(f);
+	uint16_t updatesCount = getShort(c);
 	if (verbose)
 		printf("\t\tupdatesCount: %d\n", updatesCount);
-	for (i = 0; i < updatesCount; i++) {
-		char *matcher = getMatcher(f, "updates ");
+	if (j)
+		jsOpen(j, '[');
+	for (i = 0; (i < updatesCount) && !c->error; i++) {
+		char *matcher = getMatcher(c, "updates ", j);
 		if (verbose)
 			printf("\t\t\t%s\n", matcher);
 		free(matcher);
 	}
+	if (j)
+		jsClose(j, ']');
 }
 
-int pdscan(efs_file_t *f)
+/*
+ * Read all of f into memory and parse it. Product files are small;
+ * anything bigger than PD_MAXSIZE is not one.
+ */
+int pdscan(efs_file_t *f, const char *path, enum pd_format fmt)
 {
+	struct efs_stat sb;
+	uint8_t *buf;
 	size_t sz;
-	char buf[999] = {0,};
+	int rc;
+
+	rc = efs_fstat(f, &sb);
+	if (rc == -1)
+		return 1;
+	if ((sb.st_size < 2) || (sb.st_size > PD_MAXSIZE))
+		return 1;
+
+	buf = malloc(sb.st_size);
+	if (!buf)
+		err(1, "in malloc");
+	sz = efs_fread(buf, sb.st_size, 1, f);
+	if (sz != 1) {
+		free(buf);
+		return 1;
+	}
+
+	rc = pdscan_buf(buf, sb.st_size, path, fmt);
+	free(buf);
+	return rc;
+}
+
+/*
+ * Parse the product file in buf and print its products, images and
+ * subsystems. Returns 0 on success, or 1 if buf isn't a product file
+ * or is truncated or corrupt; whatever was parsed before the problem
+ * has been printed by then.
+ *
+ * In PD_FORMAT_NDJSON mode, each record is printed once all of its
+ * fields have been read, and tagged with path if that isn't NULL.
+ * A record cut short by an error is not printed.
+ */
+int pdscan_buf(const void *buf, size_t len, const char *path, enum pd_format fmt)
+{
+	struct pdcur cur = { buf, len, 0, false };
+	struct pdcur *c = &cur;
+	struct pdjson js = { NULL, 0, 0 };
+	struct pdjson *j = (fmt == PD_FORMAT_NDJSON)? &js: NULL;
+	const uint8_t *hdr;
 	char *prodId;
 	uint16_t magic;
 	uint16_t noOfProds;
@@ -296,34 +539,34 @@ int pdscan(efs_file_t *f)
 #define FMT "%-30s"
 
 	/* product */
-	sz = efs_fread(buf, 2, 1, f);
-	if (sz != 1) {
+	hdr = getBytes(c, 2);
+	if (!hdr) {
 #if 0
 		errx(1, "while reading header");
 #endif
 		return 1;
 	}
-	if ((buf[0] != 'p') || (buf[1] != 'd')) {
+	if ((hdr[0] != 'p') || (hdr[1] != 'd')) {
 #if 0
 		errx(1, "bad file format");
 #endif
 		return 1;
 	}
-	prodId = getCstring(f);
-	magic = getShort(f);
-	noOfProds = getShort(f);
+	prodId = getCstring(c);
+	magic = getShort(c);
+	noOfProds = getShort(c);
 	if (verbose) {
 		printf("prodId: %s\n", prodId);
 		printf("magic: %04x %s\n", magic, (magic==1988)?"(ok)":"(BAD)");
 		printf("noOfProds: %04x %s\n", noOfProds, (noOfProds>=1)?"(ok)":"(BAD)");
 	}
 
-	for (prodNum = 0; prodNum < noOfProds; prodNum++) {
+	for (prodNum = 0; (prodNum < noOfProds) && !c->error; prodNum++) {
 	int image;
 
 	/* root */
-	prodMagic = getShort(f);
-	prodFormat = getShort(f);
+	prodMagic = getShort(c);
+	prodFormat = getShort(c);
 	if (verbose) {
 		printf("prodMagic: %04x %s\n", prodMagic, (prodMagic==1987)?"(ok)":"(BAD)");
 		printf("prodFormat: %04x\n", prodFormat);
@@ -335,57 +578,100 @@ int pdscan(efs_file_t *f)
 #if 0
 		errx(1, "bad prodFormat: %d not between 5 and 9 inclusive", prodFormat);
 #endif
-		return 1;
+		c->error = true;
+		continue;
 	}
 
-	shortName = getString(f);
-	longName = getString(f);
-	prodFlags = getShort(f);
+	shortName = getString(c);
+	longName = getString(c);
+	prodFlags = getShort(c);
 	if (verbose) {
 		printf("shortName: '%s'\n", shortName);
 		printf("longName:  '%s'\n", longName);
 		printf("prodFlags: %04x\n", prodFlags);
 	}
+	if (j) {
+		jsOpen(j, '{');
+		jsKey(j, "type");
+		jsString(j, "product");
+		if (path) {
+			jsKey(j, "file");
+			jsString(j, path);
+		}
+		jsKey(j, "prodId");
+		jsString(j, prodId);
+		jsKey(j, "name");
+		jsString(j, shortName);
+		jsKey(j, "description");
+		jsString(j, longName);
+		jsKey(j, "format");
+		jsInt(j, prodFormat);
+		jsKey(j, "flags");
+		jsInt(j, prodFlags);
+	}
 	if (prodFormat >= 5) {
-		time_t prodDateTime = getInt(f);
+		time_t prodDateTime = getInt(c);
 		if (verbose) {
 			printf("datetime: %s", ctime(&prodDateTime));
 		}
+		if (j) {
+			jsKey(j, "date");
+			jsInt(j, prodDateTime);
+		}
 	}
 
 	if (prodFormat >= 5) {
-		char *prodIdk = getString(f);
+		char *prodIdk = getString(c);
 		if (verbose) {
 			printf("prodIdk: '%s'\n", prodIdk);
 		}
+		if (j) {
+			jsKey(j, "idk");
+			jsString(j, prodIdk);
+		}
 		free(prodIdk);
 	}
 
 	if (prodFormat == 7) {
-		getMachInfo(f);
+		if (j)
+			jsKey(j, "machines");
+		getMachInfo(c, j);
 	}
 
 	if (prodFormat >= 8) {
-		getAttrs(f, "");
+		if (j)
+			jsKey(j, "attrs");
+		getAttrs(c, "", j);
 	}
 
-	line = NULL;
-	rc = asprintf(&line, "%s", shortName);
-	if (rc == -1) err(1, "in asprintf");
-	printf("   " FMT "  %s\n", line, longName);
-	free(line);
-	line = NULL;
+	if (c->error) {
+		free(shortName);
+		free(longName);
+		break;
+	}
 
-	imageCount = getShort(f);
+	if (j) {
+		jsClose(j, '}');
+		jsEmit(j);
+	} else {
+		line = NULL;
+		rc = asprintf(&line, "%s", shortName);
+		if (rc == -1) err(1, "in asprintf");
+		printf("   " FMT "  %s\n", line, longName);
+		free(line);
+		line = NULL;
+	}
+
+	imageCount = getShort(c);
 	if (verbose) {
 		printf("imageCount: %04x\n", imageCount);
 	}
 
-	for (image = 0; image < imageCount; image++) {
-		uint16_t imageFlags = getShort(f);
-		char *imageName = getString(f);
-		char *imageId = getString(f);
-		uint16_t imageFormat = getShort(f);
+	for (image = 0; (image < imageCount) && !c->error; image++) {
+		uint16_t imageFlags = getShort(c);
+		char *imageName = getString(c);
+		char *imageId = getString(c);
+		uint16_t imageFormat = getShort(c);
 		uint32_t imageVersion;
 		char *derivedFrom;
 		char *line;
@@ -401,51 +687,99 @@ int pdscan(efs_file_t *f)
 			printf("\timageFormat: %04x\n", imageFormat);
 		}
 
+		line = NULL;
+		rc = asprintf(&line, "%s.%s", shortName, imageName);
+		if (rc == -1) err(1, "in asprintf");
+		if (j) {
+			jsOpen(j, '{');
+			jsKey(j, "type");
+			jsString(j, "image");
+			if (path) {
+				jsKey(j, "file");
+				jsString(j, path);
+			}
+			jsKey(j, "name");
+			jsString(j, line);
+			jsKey(j, "product");
+			jsString(j, shortName);
+			jsKey(j, "description");
+			jsString(j, imageId);
+			jsKey(j, "format");
+			jsInt(j, imageFormat);
+			jsKey(j, "flags");
+			jsInt(j, imageFlags);
+		}
+
 		if (prodFormat >= 5) {
 			uint16_t imageOrder;
-			imageOrder = getShort(f);
+			imageOrder = getShort(c);
 			if (verbose) {
 				printf("\timageOrder: %04x (%u)\n", imageOrder, imageOrder);
 			}
+			if (j) {
+				jsKey(j, "order");
+				jsInt(j, imageOrder);
+			}
 		}
 
-		imageVersion = getInt(f);
+		imageVersion = getInt(c);
 		if (verbose) {
 			printf("\timageVersion: %u\n", imageVersion);
 		}
+		if (j) {
+			jsKey(j, "version");
+			jsInt(j, imageVersion);
+		}
 
 		if (prodFormat == 5) {
 			uint32_t a, b;
-			a = getInt(f);
-			b = getInt(f);
+			a = getInt(c);
+			b = getInt(c);
 			if (a || b) {
-				printf("a: %08x\n", a);
-				printf("b: %08x\n", b);
-				errx(1, "diagnostic abort (has a or b)");
+				/* diagnostic: never seen these set */
+				if (verbose) {
+					printf("a: %08x\n", a);
+					printf("b: %08x\n", b);
+				}
+				c->error = true;
 			}
 		}
 
-		derivedFrom = getString(f);
+		derivedFrom = getString(c);
 		if (verbose && strlen(derivedFrom)) {
 			printf("\tderivedFrom: '%s'\n", derivedFrom);
 		}
+		if (j) {
+			jsKey(j, "derivedFrom");
+			jsString(j, derivedFrom);
+		}
 		free(derivedFrom);
 		if (prodFormat >= 8) {
-			getAttrs(f, "\t");
+			if (j)
+				jsKey(j, "attrs");
+			getAttrs(c, "\t", j);
+		}
+		if (c->error) {
+			free(line);
+			free(imageName);
+			free(imageId);
+			break;
+		}
+		if (j) {
+			jsClose(j, '}');
+			jsEmit(j);
+		} else {
+			printf("   " FMT "  %s\n", line, imageId);
 		}
-		line = NULL;
-		rc = asprintf(&line, "%s.%s", shortName, imageName);
-		if (rc == -1) err(1, "in asprintf");
-		printf("   " FMT "  %s\n", line, imageId);
 		free(line);
 		line = NULL;
 
-		subsysCount = getShort(f);
+		subsysCount = getShort(c);
 		if (verbose) {
 			printf("\tsubsysCount: %04x\n", subsysCount);
 		}
 
-		for(subsys = 0; subsys < subsysCount; subsys++) {
+		for(subsys = 0; (subsys < subsysCount) && !c->error; subsys++) {
 			uint16_t subsysFlags;
 			char *subsysName;
 			char *subsysId;
@@ -454,7 +788,7 @@ int pdscan(efs_file_t *f)
 			char *subsysExpr;
 			time_t subsysInstallDate;
 
-			subsysFlags = getShort(f);
+			subsysFlags = getShort(c);
 			if (verbose) {
 				printf("\tsubsys #%d:\n", subsys);
 				printf("\t\tsubsysFlags: %04x\n", subsysFlags);
@@ -471,8 +805,13 @@ int pdscan(efs_file_t *f)
 					printf("\t\toverlays (see 'b' attribute)\n");
 				}
 			}
-			subsysName = getString(f);
-			subsysId = getString(f);
+			subsysName = getString(c);
+			subsysId = getString(c);
+			if (c->error) {
+				free(subsysName);
+				free(subsysId);
+				break;
+			}
 
 			if (verbose) {
 				printf("\t\tsubsysName: '%s'\n", subsysName);
@@ -481,41 +820,87 @@ int pdscan(efs_file_t *f)
 
 			rc = asprintf(&line, "%s.%s.%s", shortName, imageName, subsysName);
 			if (rc == -1) err(1, "in asprintf");
-			printf("   " FMT "  %s\n", line, subsysId);
+			if (j) {
+				jsOpen(j, '{');
+				jsKey(j, "type");
+				jsString(j, "subsys");
+				if (path) {
+					jsKey(j, "file");
+					jsString(j, path);
+				}
+				jsKey(j, "name");
+				jsString(j, line);
+				jsKey(j, "product");
+				jsString(j, shortName);
+				jsKey(j, "image");
+				jsString(j, imageName);
+				jsKey(j, "description");
+				jsString(j, subsysId);
+				jsKey(j, "flags");
+				jsInt(j, subsysFlags);
+			} else {
+				printf("   " FMT "  %s\n", line, subsysId);
+			}
 			free(line);
 			line = NULL;
-			subsysExpr = getString(f);
-			subsysInstallDate = getInt(f);
+			subsysExpr = getString(c);
+			subsysInstallDate = getInt(c);
 			if (verbose) {
 				printf("\t\tsubsysExpr: '%s'\n", subsysExpr);
 				if (subsysFlags & 0x0080) {
 					printf("\t\tsubsysInstallDate: %s", ctime(&subsysInstallDate));
 				}
 			}
+			if (j) {
+				jsKey(j, "expr");
+				jsString(j, subsysExpr);
+				jsKey(j, "installDate");
+				if (subsysFlags & 0x0080)
+					jsInt(j, subsysInstallDate);
+				else
+					jsNull(j);
+				jsKey(j, "replaces");
+			}
 
-			getRules(f);
-			getPrereqs(f);
+			getRules(c, j);
+			if (j)
+				jsKey(j, "prereqs");
+			getPrereqs(c, j);
 			free(subsysName);
 			free(subsysId);
 			free(subsysExpr);
 			if (prodFormat >= 5) {
-				char *altName = getString(f);
+				char *altName = getString(c);
 				if (verbose) {
 					printf("\t\taltName: '%s'\n", altName);
 				}
+				if (j) {
+					jsKey(j, "altName");
+					jsString(j, altName);
+				}
 				free(altName);
 			}
 			if (prodFormat >= 6) {
 				if (verbose) {
 					printf("\t\tincompats:\n");
 				}
-				getRules(f);
+				if (j)
+					jsKey(j, "incompats");
+				getRules(c, j);
 			}
 			if (prodFormat >= 8) {
-				getAttrs(f, "\t\t");
+				if (j)
+					jsKey(j, "attrs");
+				getAttrs(c, "\t\t", j);
 			}
 			if (prodFormat >= 9) {
-				getUpdates(f);
+				if (j)
+					jsKey(j, "updates");
+				getUpdates(c, j);
+			}
+			if (j && !c->error) {
+				jsClose(j, '}');
+				jsEmit(j);
 			}
 		}
 
@@ -525,10 +910,11 @@ int pdscan(efs_file_t *f)
 
 	free(shortName);
 	free(longName);
-	printf("\n");
+	if (!j)
+		printf("\n");
 	} /* end of foreach(prod) */
 	free(prodId);
+	free(js.s);
 
-	return 0;
+	return c->error? 1: 0;
 }
-
@@ -1,5 +1,16 @@
 #pragma once
 #include "efs.h"
-extern int is_pd(efs_t *efs, const char *path);
-extern void pdprint(efs_t *efs, const char *path);
-extern int pdscan(efs_file_t *f);
+
+enum pd_format {
+	PD_FORMAT_TEXT,		/* aligned name/description columns */
+	PD_FORMAT_NDJSON	/* one JSON object per line */
+};
+
+extern int is_pd(efs_t *efs, efs_ino_t ino);
+extern void pdprint(efs_t *efs, efs_ino_t ino, const char *path, enum pd_format fmt);
+
+/* product files bigger than this are not parsed */
+#define PD_MAXSIZE	(16 * 1024 * 1024)
+
+extern int pdscan(efs_file_t *f, const char *path, enum pd_format fmt);
+extern int pdscan_buf(const void *buf, size_t len, const char *path, enum pd_format fmt);
@@ -0,0 +1,149 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "err.h"
+#include "pool.h"
+
+/* queued items per worker before pool_submit() blocks */
+#define POOL_QUEUE_PER_THREAD	64
+
+struct pool {
+	pool_fn fn;
+	void *arg;
+
+	pthread_t *threads;
+	unsigned nthreads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t notempty;	/* signalled when an item is queued */
+	pthread_cond_t notfull;		/* signalled when an item is taken */
+	pthread_cond_t idle;		/* signalled when all work is done */
+
+	/* ring of pending items */
+	void **items;
+	size_t nitems, maxitems, head;
+
+	size_t busy;		/* items taken but not finished */
+	bool stopping;
+};
+
+static void *pool_worker(void *p)
+{
+	pool_t *pool = p;
+	void *item;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->nitems && !pool->stopping)
+			pthread_cond_wait(&pool->notempty, &pool->lock);
+		if (!pool->nitems)
+			break;
+
+		item = pool->items[pool->head];
+		pool->head = (pool->head + 1) % pool->maxitems;
+		pool->nitems--;
+		pool->busy++;
+		pthread_cond_signal(&pool->notfull);
+		pthread_mutex_unlock(&pool->lock);
+
+		pool->fn(item, pool->arg);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->busy--;
+		if (!pool->nitems && !pool->busy)
+			pthread_cond_broadcast(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+pool_t *pool_create(unsigned nthreads, pool_fn fn, void *arg)
+{
+	pool_t *pool;
+	unsigned i;
+	int rc;
+
+	if (!nthreads)
+		nthreads = 1;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		err(1, "in calloc");
+	pool->fn = fn;
+	pool->arg = arg;
+
+	pool->maxitems = nthreads * POOL_QUEUE_PER_THREAD;
+	pool->items = calloc(pool->maxitems, sizeof(*pool->items));
+	pool->threads = calloc(nthreads, sizeof(*pool->threads));
+	if (!pool->items || !pool->threads)
+		err(1, "in calloc");
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->notempty, NULL);
+	pthread_cond_init(&pool->notfull, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		rc = pthread_create(&pool->threads[i], NULL, pool_worker, pool);
+		if (rc) {
+			errno = rc;
+			err(1, "couldn't start worker thread");
+		}
+		pool->nthreads++;
+	}
+
+	return pool;
+}
+
+/*
+ * Queue item for a worker. Blocks while the queue is full.
+ */
+void pool_submit(pool_t *pool, void *item)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->nitems == pool->maxitems)
+		pthread_cond_wait(&pool->notfull, &pool->lock);
+	pool->items[(pool->head + pool->nitems) % pool->maxitems] = item;
+	pool->nitems++;
+	pthread_cond_signal(&pool->notempty);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Wait until every submitted item has been processed.
+ */
+void pool_wait(pool_t *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->nitems || pool->busy)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Finish all submitted work, stop the workers and free the pool.
+ */
+void pool_destroy(pool_t *pool)
+{
+	unsigned i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->notempty);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->notfull);
+	pthread_cond_destroy(&pool->notempty);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool->items);
+	free(pool);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+/*
+ * A fixed set of worker threads consuming items from a bounded queue.
+ * Each item is handed to fn(item, arg) on one of the workers.
+ */
+
+typedef void (*pool_fn)(void *item, void *arg);
+
+typedef struct pool pool_t;
+
+extern pool_t *pool_create(unsigned nthreads, pool_fn fn, void *arg);
+extern void pool_submit(pool_t *pool, void *item);
+extern void pool_wait(pool_t *pool);
+extern void pool_destroy(pool_t *pool);
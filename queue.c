@@ -39,6 +39,12 @@ int queue_add_tail(queue_t q, char *path)
 
 /* add to head of queue */
 int queue_add_head(queue_t q, char *path)
+{
+	return queue_add_head_ino(q, path, 0);
+}
+
+/* add to head of queue, along with an inode number */
+int queue_add_head_ino(queue_t q, char *path, uint32_t ino)
 {
 	struct qent_s *qe;
 
@@ -46,6 +52,7 @@ int queue_add_head(queue_t q, char *path)
 	if (!qe) err(1, "in malloc");
 
 	qe->path = path;
+	qe->ino = ino;
 
 	if (q->head)
 		q->head->prev = qe;
@@ -72,7 +79,7 @@ int queue_add_queue_head(queue_t dst, queue_t src)
 
 	struct qent_s *qe;
 	while ((qe = queue_dequeue(src))) {
-		queue_add_head(dst, qe->path);
+		queue_add_head_ino(dst, qe->path, qe->ino);
 		free(qe);
 	}
 
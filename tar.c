@@ -1,369 +1,551 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __MINGW32__
+#include <io.h>
+#endif
 
-#include <cdio/iso9660.h>
-
+#include "asprintf.h"
+#include "compress.h"
 #include "efs.h"
 #include "err.h"
 #include "tar.h"
 
-FILE *f;
-
-char tar_mode_lookup(uint16_t mode)
+#define MIN(a,b) (a>b?b:a)
+
+/*
+ * The archive is assembled in one big buffer, which is written out
+ * with write(2) whenever it fills up. Headers and file data are
+ * always whole 512-byte blocks, so the buffer never holds a partial
+ * block. A compressed archive goes through a compress_t instead.
+ */
+struct tar {
+	int fd;
+	bool close_fd;		/* false for stdout */
+	compress_t *z;		/* NULL if not compressing */
+	uint8_t *buf;
+	size_t size;		/* TAR_BUFSIZ */
+	size_t len;		/* bytes waiting in buf */
+	uint64_t pos;		/* bytes written so far, including buf */
+	bool error;
+};
+
+static char tar_mode_lookup(uint16_t mode)
 {
 	switch (mode & IFMT) {
 	case IFREG:
-		return '0';
+		return TAR_TYPE_REG;
 	case IFLNK:
-		return '2';
+		return TAR_TYPE_SYM;
 	case IFCHR:
-		return '3';
+		return TAR_TYPE_CHAR;
 	case IFBLK:
-		return '4';
+		return TAR_TYPE_BLOCK;
 	case IFDIR:
-		return '5';
+		return TAR_TYPE_DIR;
 	case IFIFO:
-		return '6';
+		return TAR_TYPE_FIFO;
 	default:
 		return '\0';
 	}
 }
 
-uint32_t tar_getsum(struct tarblk_s blk)
+static uint32_t tar_getsum(const struct tarblk_s *blk)
 {
 	uint32_t sum = 0;
-	uint8_t buf[512];
+	const uint8_t *buf = (const uint8_t *)blk;
 	size_t i;
-	memcpy(buf, &blk, sizeof(buf));
-	for (i = 0; i < sizeof(buf); i++) {
+	for (i = 0; i < sizeof(*blk); i++) {
 		sum += buf[i];
 	}
 	return sum;
 }
 
-int tar_create(const char *path)
+static int _tar_flush(tar_t *tar)
 {
-	__label__ out_error;
+	size_t done = 0;
+	ssize_t rc;
 
-	if (!strcmp(path,"-")) {
-		f = stdout;
+	if (tar->z) {
+		if (compress_write(tar->z, tar->buf, tar->len)) {
+			tar->error = true;
+			return -1;
+		}
+		tar->len = 0;
 		return 0;
 	}
 
-	f = fopen(path, "wb");
-	if (!f)
-		goto out_error;
-
+	while (done < tar->len) {
+		rc = write(tar->fd, tar->buf + done, tar->len - done);
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			tar->error = true;
+			return -1;
+		}
+		done += rc;
+	}
+	tar->len = 0;
 	return 0;
-
-out_error:
-	if (f)
-		fclose(f);
-	return -1;
 }
 
-int tar_close(void)
+/* Append nbytes from p to the archive. */
+static int _tar_put(tar_t *tar, const void *p, size_t nbytes)
 {
-	/* Pad up to a multiple of 4096 bytes. */
-	long pos;
-	uint8_t buf[4096];
-
-	pos = ftell(f);
-	if (pos & (long)(4096 - 1)) {
-		size_t nbytes;
-		nbytes = 4096 - (pos & (long)(4096 - 1));
-		memset(buf, 0, sizeof(buf));
-		fwrite(buf, nbytes, 1, f);
+	const uint8_t *src = p;
+	size_t n;
+
+	while (nbytes) {
+		if ((tar->len == tar->size) && _tar_flush(tar))
+			return -1;
+		n = MIN(nbytes, tar->size - tar->len);
+		memcpy(tar->buf + tar->len, src, n);
+		tar->len += n;
+		tar->pos += n;
+		src += n;
+		nbytes -= n;
 	}
-
-	fclose(f);
 	return 0;
 }
 
-int tar_emit(efs_t *efs, const char *filename)
+/* Append zeroes up to the next multiple of align bytes. */
+static int _tar_pad(tar_t *tar, size_t align)
 {
-	__label__ out_error;
-	int rc;
-	size_t sz;
-	struct tarblk_s blk = {0,};
-	struct efs_stat sb = {0,};
-	int retval;
-	size_t filename_len;
-	uint32_t sum;
+	size_t n;
 
-	if (!filename) {
-		retval = -3;
-		goto out_error;
+	n = tar->pos % align;
+	if (!n)
+		return 0;
+	n = align - n;
+	while (n) {
+		size_t chunk;
+		if ((tar->len == tar->size) && _tar_flush(tar))
+			return -1;
+		chunk = MIN(n, tar->size - tar->len);
+		memset(tar->buf + tar->len, 0, chunk);
+		tar->len += chunk;
+		tar->pos += chunk;
+		n -= chunk;
 	}
+	return 0;
+}
 
-	rc = efs_stat(efs, filename, &sb);
-	if (rc == -1) {
-		/* file not found */
-		retval = -2;
+/*
+ * Open an archive at path, or on standard output if path is "-".
+ * If the suffix of path names a compressed format, the archive is
+ * compressed on nthreads threads (0 for one per CPU).
+ */
+tar_t *tar_create(const char *path, unsigned nthreads)
+{
+	__label__ out_error;
+	tar_t *tar;
+	struct stat st;
+	enum compress_fmt fmt;
+	int saved_errno;
+
+	tar = calloc(1, sizeof(*tar));
+	if (!tar)
+		return NULL;
+	tar->fd = -1;
+
+	tar->size = TAR_BUFSIZ;
+#ifdef __MINGW32__
+	tar->buf = malloc(tar->size);
+#else
+	if (posix_memalign((void **)&tar->buf, 4096, tar->size))
+		tar->buf = NULL;
+#endif
+	if (!tar->buf)
 		goto out_error;
-	}
-
-	filename_len = strlen(filename);
-	if ((sb.st_mode & IFMT) == IFDIR) {
-		/* For directories, we append a '/' to the filename. */
-		filename_len++;
-	}
 
-	if (filename_len > (sizeof(blk.name) + sizeof(blk.nameprefix))) {
-		/* file name too long for tar format */
-		retval = -1;
-		goto out_error;
-	} else if (filename_len > sizeof(blk.name)) {
-		/* long file name */
-		char *split = strrchr(filename, '/');
-		if (!split)
-			errx(1, "while splitting tar filename: '%s'", filename);
-		strncpy(blk.nameprefix, filename, split-filename);
-		strcpy(blk.name, split + 1);
+	if (!strcmp(path, "-")) {
+		tar->fd = STDOUT_FILENO;
+		tar->close_fd = false;
+#ifdef __MINGW32__
+		_setmode(tar->fd, O_BINARY);
+#endif
 	} else {
-		/* short file name */
-		strncpy(blk.name, filename, sizeof(blk.name));
+		tar->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+		if (tar->fd == -1)
+			goto out_error;
+		tar->close_fd = true;
 	}
 
-	/*
-	 * if we are writing a directory, then append a '/' to the end
-	 * of the filename.
-	 */
-	if ((sb.st_mode & IFMT) == IFDIR) {
-		size_t sz;
-		sz = strlen(blk.name);
-		blk.name[sz] = '/';
-
-		/* Null-terminate the name, unless we ran out of space. */
-		if (sz < (sizeof(blk.name) -1))
-			blk.name[sz + 1] = '\0';
+	fmt = strcmp(path, "-") ? compress_fmt_from_path(path) : COMPRESS_NONE;
+	if (fmt != COMPRESS_NONE) {
+		tar->z = compress_create(tar->fd, fmt, nthreads);
+		if (!tar->z)
+			goto out_error;
 	}
 
-	rc = snprintf(blk.mode, sizeof(blk.mode), "%06o ", sb.st_mode & 0777);
-	rc = snprintf(blk.uid, sizeof(blk.uid), "%06o ", sb.st_uid);
-	rc = snprintf(blk.gid, sizeof(blk.gid), "%06o ", sb.st_gid);
-	if ((sb.st_mode & IFMT) == IFDIR) {
-		rc = snprintf(blk.size, sizeof(blk.size), "%011o", 0);
-	} else {
-		rc = snprintf(blk.size, sizeof(blk.size), "%011o", sb.st_size);
-	}
-	rc = snprintf(blk.mtime, sizeof(blk.mtime), "%011o", (unsigned int)sb.st_mtimespec.tv_sec);
-
-	/*
-	 * actually, we want certain values to be space-terminated,
-	 * not null-terminated...
-	 */
-	blk.size[sizeof(blk.size) - 1] = ' ';
-	blk.mtime[sizeof(blk.mtime) - 1] = ' ';
-
-	memset(blk.sum, ' ', sizeof(blk.sum));	/* we'll fix the checksum later */
-
-	blk.type = tar_mode_lookup(sb.st_mode);
-
-	if ((sb.st_mode & IFMT) == IFLNK) {
-		efs_file_t *src;
-		src = efs_fopen(efs, filename);
-		if (!src) err(1, "couldn't open efs file '%s' as link", filename);
-		efs_fread(blk.lnk, sb.st_size, 1, src);
-		efs_fclose(src);
-		/* also, set size to zero */
-		rc = snprintf(blk.size, sizeof(blk.size), "%011o", 0);
+#ifdef F_SETPIPE_SZ
+	/* Let a pipe hold a whole buffer, so each flush is one write. */
+	if ((fstat(tar->fd, &st) == 0) && S_ISFIFO(st.st_mode))
+		(void)fcntl(tar->fd, F_SETPIPE_SZ, (int)tar->size);
+#else
+	(void)st;
+#endif
+
+	return tar;
+
+out_error:
+	saved_errno = errno;
+	if (tar->close_fd)
+		close(tar->fd);
+	errno = saved_errno;
+	free(tar->buf);
+	free(tar);
+	return NULL;
+}
+
+/*
+ * Finish the archive with two zero blocks, pad it to a whole record,
+ * and close it. Returns -1 if anything couldn't be written.
+ */
+int tar_close(tar_t *tar)
+{
+	static const uint8_t zeroes[2 * sizeof(struct tarblk_s)];
+	int rc = 0;
+
+	if (!tar)
+		return 0;
+
+	if (_tar_put(tar, zeroes, sizeof(zeroes))
+	  || _tar_pad(tar, TAR_RECORDSIZE)
+	  || _tar_flush(tar))
+		rc = -1;
+	if (compress_close(tar->z))
+		rc = -1;
+	if (tar->error)
+		rc = -1;
+	if (tar->close_fd && (close(tar->fd) == -1))
+		rc = -1;
+
+	free(tar->buf);
+	free(tar);
+	return rc;
+}
+
+/*
+ * Copy the data of a regular file into the archive. Whole extents are
+ * read from the image straight into the output buffer, and the end of
+ * the last block is zeroed, which is the padding tar wants anyway.
+ */
+static int _tar_copy_extents(tar_t *tar, efs_t *efs, const struct efs_stat *sb)
+{
+	__label__ out_error;
+	struct efs_extmap_ent *map;
+	size_t nents, i, next = 0, nblks, tail;
+	efs_err_t erc;
+
+	nblks = ((size_t)sb->st_size + BLKSIZ - 1) / BLKSIZ;
+	if (!nblks)
+		return 0;
+
+	map = efs_get_extmap(efs, sb->st_ino, &nents);
+	if (!map)
+		return -1;
+
+	for (i = 0; (i < nents) && (next < nblks); i++) {
+		size_t bn, n;
+
+		/* EFS files have no holes */
+		if (map[i].offset != next)
+			goto out_error;
+		bn = map[i].bn;
+		n = MIN(map[i].length, nblks - next);
+		while (n) {
+			size_t chunk;
+
+			if (((tar->size - tar->len) < BLKSIZ) && _tar_flush(tar))
+				goto out_error;
+			chunk = MIN(n, (tar->size - tar->len) / BLKSIZ);
+			erc = efs_get_blocks(efs, tar->buf + tar->len, bn, chunk);
+			if (erc != EFS_ERR_OK)
+				goto out_error;
+			tar->len += chunk * BLKSIZ;
+			tar->pos += chunk * BLKSIZ;
+			bn += chunk;
+			n -= chunk;
+			next += chunk;
+		}
 	}
+	if (next != nblks)
+		goto out_error;
 
-	memcpy(blk.magic, "ustar", sizeof(blk.magic));
+	/* the last block is still in the buffer */
+	tail = (size_t)sb->st_size % BLKSIZ;
+	if (tail)
+		memset(tar->buf + tar->len - (BLKSIZ - tail), 0, BLKSIZ - tail);
 
-	blk.ver[0] = blk.ver[1] = '0';
+	free(map);
+	return 0;
 
-#if 0
-	strncpy(blk.username, "root", sizeof(blk.username));
-	strncpy(blk.groupname, "sys", sizeof(blk.groupname));
-#else
-	blk.username[0] = '\0';
-	blk.groupname[0] = '\0';
-#endif
+out_error:
+	free(map);
+	return -1;
+}
 
-	if (((sb.st_mode & IFMT) == IFCHR)
-	  || ((sb.st_mode & IFMT) == IFBLK)) {
-		rc = snprintf(blk.devmajor, sizeof(blk.devmajor), "%06o ", sb.st_major);
-		rc = snprintf(blk.devminor, sizeof(blk.devminor), "%06o ", sb.st_minor);
-	} else {
-		memcpy(blk.devmajor, "000000 ", 8);
-		memcpy(blk.devminor, "000000 ", 8);
+/*
+ * Everything that goes into a member's header, whatever the source.
+ */
+struct tar_ent {
+	const char *path;	/* directories end in '/' */
+	const char *linkpath;	/* NULL unless a symlink */
+	char type;
+	uint32_t mode;		/* permission bits only */
+	uint32_t uid, gid;
+	uint64_t size;
+	int64_t mtime;
+	uint32_t devmajor, devminor;
+};
+
+/*
+ * Write v in octal into the first ndigits bytes of field, followed by
+ * a space. Returns false, leaving zeroes, if it needs more digits.
+ */
+static bool _tar_num(char *field, size_t ndigits, uint64_t v)
+{
+	char tmp[24];
+
+	snprintf(tmp, sizeof(tmp), "%0*" PRIo64, (int)ndigits, v);
+	if (strlen(tmp) > ndigits) {
+		memset(field, '0', ndigits);
+		field[ndigits] = ' ';
+		return false;
 	}
+	memcpy(field, tmp, ndigits);
+	field[ndigits] = ' ';
+	return true;
+}
 
-	/* calculate checksum */
-	sum = 0;
-	sum = tar_getsum(blk);
-	rc = snprintf(blk.sum, sizeof(blk.sum), "%06o", sum);
+/*
+ * Put path in the name field, or split it at a '/' between the prefix
+ * and name fields. Returns false if it can't be done.
+ */
+static bool _tar_split(struct tarblk_s *blk, const char *path)
+{
+	size_t len, p;
 
-	sz = fwrite(&blk, sizeof(blk), 1, f);
-	if (sz != 1)
-		err(1, "couldn't write to archive");
+	len = strlen(path);
+	if (len <= sizeof(blk->name)) {
+		memcpy(blk->name, path, len);
+		return true;
+	}
 
-	if ((sb.st_mode & IFMT) == IFREG) {
-		size_t tailBytes;
-		efs_file_t *src;
-		const size_t bufsiz = 512;
-		size_t blockNum;
-		uint8_t *buf;
-
-		buf = calloc(bufsiz, 1);
-		if (!buf) err(1, "calloc");
-		tailBytes = (size_t)(sb.st_size) % bufsiz;
-#if 0
-		printf("sb.st_size: %d, tailBytes: %zu\n", sb.st_size, tailBytes);
-#endif
-		src = efs_fopen(efs, filename);
-		if (!src) errx(1, "couldn't open efs file '%s' as regular file", filename);
-		for (blockNum = 0; blockNum < (sb.st_size / bufsiz); blockNum++) {
-			sz = efs_fread(buf, bufsiz, 1, src);
-			if (sz != 1)
-				errx(1, "couldn't read from source file '%s'", filename);
-			sz = fwrite(buf, bufsiz, 1, f);
-			if (sz != 1)
-				err(1, "while writing to tar (main blocks)");
-		}
-		if (tailBytes) {
-			sz = efs_fread(buf, tailBytes, 1, src);
-			if (sz != 1)
-				errx(1, "couldn't read from source file '%s'", filename);
-			sz = fwrite(buf, tailBytes, 1, f);
-			if (sz != 1)
-				err(1, "while writing to tar (tail bytes)");
-		}
-		/* pad out to a multiple of 512 bytes */
-		if (sb.st_size % 512) {
-			size_t zeroesToWrite;
-			zeroesToWrite = 512 - (sb.st_size % 512);
-			memset(buf, 0, zeroesToWrite);
-			sz = fwrite(buf, zeroesToWrite, 1, f);
-			if (sz != 1)
-				errx(1, "while writing to tar (padding)");
+	/* the leftmost '/' that leaves a short enough name */
+	for (p = len - sizeof(blk->name) - 1;
+	  (p < len - 1) && (p <= sizeof(blk->nameprefix)); p++) {
+		if (path[p] == '/') {
+			memcpy(blk->nameprefix, path, p);
+			memcpy(blk->name, path + p + 1, len - p - 1);
+			return true;
 		}
+	}
+	return false;
+}
+
+/*
+ * Append a pax record "LEN KEY=VALUE\n" to *recs. LEN counts itself.
+ */
+static void _tar_pax_add(char **recs, size_t *len, const char *key, const char *value)
+{
+	size_t n, digits, total;
+	char *p;
+
+	n = strlen(key) + strlen(value) + 3;	/* ' ', '=', '\n' */
+	for (digits = 1, total = 10; total <= n + digits; total *= 10)
+		digits++;
+	n += digits;
+
+	p = realloc(*recs, *len + n + 1);
+	if (!p)
+		err(1, "in realloc");
+	*recs = p;
+	snprintf(p + *len, n + 1, "%zu %s=%s\n", n, key, value);
+	*len += n;
+}
 
-		efs_fclose(src);
-		free(buf);
+/*
+ * Write the header of one member. Fields that don't fit in a ustar
+ * header go into a pax extended header in front of it.
+ */
+static int _tar_header(tar_t *tar, const struct tar_ent *e)
+{
+	struct tarblk_s blk = {0,}, xblk = {0,};
+	char *recs = NULL, num[24];
+	size_t nrecs = 0;
+	int rc = 0;
+
+	if (!_tar_split(&blk, e->path)) {
+		_tar_pax_add(&recs, &nrecs, "path", e->path);
+		strncpy(blk.name, e->path, sizeof(blk.name));
+	}
+	if (e->linkpath) {
+		if (strlen(e->linkpath) > sizeof(blk.lnk))
+			_tar_pax_add(&recs, &nrecs, "linkpath", e->linkpath);
+		strncpy(blk.lnk, e->linkpath, sizeof(blk.lnk));
 	}
 
-	return 0;
-out_error:
-	return retval;
+	_tar_num(blk.mode, 6, e->mode & 07777);
+	if (!_tar_num(blk.uid, 6, e->uid)) {
+		snprintf(num, sizeof(num), "%lu", (unsigned long)e->uid);
+		_tar_pax_add(&recs, &nrecs, "uid", num);
+	}
+	if (!_tar_num(blk.gid, 6, e->gid)) {
+		snprintf(num, sizeof(num), "%lu", (unsigned long)e->gid);
+		_tar_pax_add(&recs, &nrecs, "gid", num);
+	}
+	if (!_tar_num(blk.size, 11, e->size)) {
+		snprintf(num, sizeof(num), "%" PRIu64, (uint64_t)e->size);
+		_tar_pax_add(&recs, &nrecs, "size", num);
+	}
+	if ((e->mtime < 0) || !_tar_num(blk.mtime, 11, e->mtime)) {
+		_tar_num(blk.mtime, 11, 0);
+		snprintf(num, sizeof(num), "%" PRId64, (int64_t)e->mtime);
+		_tar_pax_add(&recs, &nrecs, "mtime", num);
+	}
+	blk.type = e->type;
+	memcpy(blk.magic, "ustar", sizeof(blk.magic));
+	blk.ver[0] = blk.ver[1] = '0';
+	_tar_num(blk.devmajor, 6, e->devmajor);
+	_tar_num(blk.devminor, 6, e->devminor);
+
+	if (recs) {
+		const char *base;
+		size_t len;
+
+		/* named after the member, like GNU tar does */
+		len = strlen(e->path);
+		if (len && (e->path[len - 1] == '/'))
+			len--;
+		for (base = e->path + len; (base > e->path) && (base[-1] != '/'); base--)
+			;
+		snprintf(xblk.name, sizeof(xblk.name), "PaxHeaders/%.*s",
+			(int)(e->path + len - base), base);
+		_tar_num(xblk.mode, 6, 0644);
+		_tar_num(xblk.uid, 6, 0);
+		_tar_num(xblk.gid, 6, 0);
+		_tar_num(xblk.size, 11, nrecs);
+		memcpy(xblk.mtime, blk.mtime, sizeof(blk.mtime));
+		xblk.type = TAR_TYPE_PAX;
+		memcpy(xblk.magic, "ustar", sizeof(xblk.magic));
+		xblk.ver[0] = xblk.ver[1] = '0';
+		memset(xblk.sum, ' ', sizeof(xblk.sum));
+		snprintf(xblk.sum, sizeof(xblk.sum), "%06o", tar_getsum(&xblk));
+
+		if (_tar_put(tar, &xblk, sizeof(xblk))
+		  || _tar_put(tar, recs, nrecs)
+		  || _tar_pad(tar, sizeof(xblk)))
+			rc = -1;
+		free(recs);
+	}
+
+	memset(blk.sum, ' ', sizeof(blk.sum));	/* the sum counts itself as spaces */
+	snprintf(blk.sum, sizeof(blk.sum), "%06o", tar_getsum(&blk));
+
+	if (_tar_put(tar, &blk, sizeof(blk)))
+		rc = -1;
+	return rc;
 }
 
-int tar_emit_from_iso9660(iso9660_t *ctx, const char *filename)
+int tar_emit(tar_t *tar, efs_t *efs, const char *filename, const struct efs_stat *sb)
 {
 	__label__ out_error;
-	int rc;
-	size_t sz;
-	struct tarblk_s blk = {0,};
-	iso9660_stat_t *st = NULL;
+	struct tar_ent e = {0,};
+	char *path = NULL, *target = NULL;
 	int retval;
-	uint32_t sum;
 
-	if (!filename) {
+	if (!filename || !sb) {
 		retval = -3;
 		goto out_error;
 	}
 
-	st = iso9660_ifs_stat_translate(ctx, filename);
-	if (!st) {
-		/* file not found */
-		retval = -2;
-		goto out_error;
-	}
+	e.type = tar_mode_lookup(sb->st_mode);
+	e.mode = sb->st_mode & 0777;
+	e.uid = sb->st_uid;
+	e.gid = sb->st_gid;
+	e.mtime = (uint32_t)sb->st_mtimespec.tv_sec;
 
-	if (strlen(st->filename) > (sizeof(blk.name) + sizeof(blk.nameprefix))) {
-		/* file name too long for tar format */
-		retval = -1;
-		goto out_error;
-	} else if (strlen(filename) > sizeof(blk.name)) {
-		/* long file name */
-		char *split = strrchr(filename, '/');
-		if (!split)
-			errx(1, "while splitting tar filename: '%s'", filename);
-		strncpy(blk.nameprefix, filename, split-filename);
-		strcpy(blk.name, split + 1);
-	} else {
-		/* short file name */
-		strncpy(blk.name, filename, sizeof(blk.name));
+	switch (sb->st_mode & IFMT) {
+	case IFDIR:
+		/* directories get a trailing '/' */
+		if (asprintf(&path, "%s/", filename) == -1)
+			err(1, "in asprintf");
+		e.path = path;
+		break;
+	case IFLNK: {
+		ssize_t len;
+
+		target = calloc(1, sb->st_size + 1);
+		if (!target)
+			err(1, "in calloc");
+		len = efs_readlinki(efs, sb->st_ino, target, sb->st_size);
+		if (len == -1) err(1, "couldn't read efs symlink '%s'", filename);
+		e.linkpath = target;
+		e.path = filename;
+		break;
 	}
-
-	rc = snprintf(blk.mode, sizeof(blk.mode), "%07o", iso9660_get_posix_filemode(st));
-	if (rc < 0) errx(1, "in snprintf");
-	rc = snprintf(blk.uid, sizeof(blk.uid), "%07o", 0);
-	if (rc < 0) errx(1, "in snprintf");
-	rc = snprintf(blk.gid, sizeof(blk.gid), "%07o", 0);
-	if (rc < 0) errx(1, "in snprintf");
-	rc = snprintf(blk.size, sizeof(blk.size), "%011o", st->size);
-	if (rc < 0) errx(1, "in snprintf");
-	rc = snprintf(blk.mtime, sizeof(blk.mtime), "%011lo", mktime(&st->tm));
-	if (rc < 0) errx(1, "in snprintf");
-
-	memset(blk.sum, ' ', sizeof(blk.sum));	/* we'll fix the checksum later */
-
-	switch (st->type) {
-	case _STAT_FILE:
-		blk.type = TAR_TYPE_REG;
+	case IFCHR:
+	case IFBLK:
+		e.devmajor = sb->st_major;
+		e.devminor = sb->st_minor;
+		e.path = filename;
 		break;
-	case _STAT_DIR:
-		blk.type = TAR_TYPE_DIR;
+	case IFREG:
+		e.size = sb->st_size;
+		e.path = filename;
 		break;
 	default:
-		errx(1, "unsupported file type '%d' for file '%s'", st->type, filename);
+		e.path = filename;
 		break;
 	}
 
-	memcpy(blk.magic, "ustar", sizeof(blk.magic));
-
-	blk.ver[0] = blk.ver[1] = '0';
-
-	blk.username[0] = '\0';
-	blk.groupname[0] = '\0';
-
-	/* calculate checksum */
-	sum = 0;
-	sum = tar_getsum(blk);
-	rc = snprintf(blk.sum, sizeof(blk.sum), "%07o", sum);
-	if (rc < 0) errx(1, "in snprintf");
-
-	sz = fwrite(&blk, sizeof(blk), 1, f);
-	if (sz != 1)
+	if (_tar_header(tar, &e))
 		err(1, "couldn't write to archive");
+	free(path);
+	free(target);
 
-	if ((st->type == _STAT_FILE) && st->size) {
-		size_t bufsiz = st->size + ISO_BLOCKSIZE;
-		uint8_t *buf = calloc(bufsiz, 1);
-		long int z;
-		size_t numblks;
-
-		if (!buf) err(1, "calloc");
-
-		numblks = (st->size + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE;
-		z = iso9660_iso_seek_read(ctx, buf, st->lsn, numblks);
-		if (!z) err(1, "couldn't read file from image: '%s'", filename);
-
-		sz = fwrite(buf, st->size, 1, f);
-		if (sz != 1)
-			err(1, "while writing to tar (main blocks)");
-
-		/* pad out to a multiple of 512 bytes */
-		if (st->size % 512) {
-			size_t zeroesToWrite;
-			zeroesToWrite = 512 - (st->size % 512);
-			memset(buf, 0, zeroesToWrite);
-			sz = fwrite(buf, zeroesToWrite, 1, f);
-			if (sz != 1)
-				errx(1, "while writing to tar (padding)");
+	if ((sb->st_mode & IFMT) == IFREG) {
+		if (_tar_copy_extents(tar, efs, sb)) {
+			if (tar->error)
+				err(1, "while writing to tar (main blocks)");
+			errx(1, "couldn't read from source file '%s'", filename);
 		}
-
-		free(buf);
 	}
 
-	iso9660_stat_free(st);
-
 	return 0;
 out_error:
-	iso9660_stat_free(st);
 	return retval;
 }
+
+/*
+ * Add filename as a hard link to target, which is already in the archive.
+ */
+int tar_emit_link(tar_t *tar, const char *filename, const char *target, const struct efs_stat *sb)
+{
+	struct tar_ent e = {0,};
+
+	if (!filename || !target || !sb)
+		return -3;
+
+	e.path = filename;
+	e.linkpath = target;
+	e.type = TAR_TYPE_LINK;
+	e.mode = sb->st_mode & 0777;
+	e.uid = sb->st_uid;
+	e.gid = sb->st_gid;
+	e.mtime = (uint32_t)sb->st_mtimespec.tv_sec;
+
+	if (_tar_header(tar, &e))
+		err(1, "couldn't write to archive");
+
+	return 0;
+}
@@ -22,16 +22,24 @@ struct tarblk_s {
 } __attribute__((packed));
 
 enum tar_type_e {
-        TAR_TYPE_REG = 0,
-        TAR_TYPE_LINK = 1,
-        TAR_TYPE_SYM = 2,
-        TAR_TYPE_CHAR = 3,
-        TAR_TYPE_BLOCK = 4,
-        TAR_TYPE_DIR = 5,
-        TAR_TYPE_FIFO = 6
+        TAR_TYPE_REG = '0',
+        TAR_TYPE_LINK = '1',
+        TAR_TYPE_SYM = '2',
+        TAR_TYPE_CHAR = '3',
+        TAR_TYPE_BLOCK = '4',
+        TAR_TYPE_DIR = '5',
+        TAR_TYPE_FIFO = '6',
+        TAR_TYPE_PAX = 'x'	/* pax extended header for the next member */
 };
 
-extern int tar_create(const char *path);
-extern int tar_close(void);
-extern int tar_emit(efs_t *efs, const char *filename);
-extern int tar_emit_from_iso9660(iso9660_t *ctx, const char *filename);
+/* output is collected and written in chunks of this many bytes */
+#define TAR_BUFSIZ	(1024 * 1024)
+/* the finished archive is padded to a multiple of this */
+#define TAR_RECORDSIZE	10240
+
+typedef struct tar tar_t;
+
+extern tar_t *tar_create(const char *path, unsigned nthreads);
+extern int tar_close(tar_t *tar);
+extern int tar_emit(tar_t *tar, efs_t *efs, const char *filename, const struct efs_stat *sb);
+extern int tar_emit_link(tar_t *tar, const char *filename, const char *target, const struct efs_stat *sb);
@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# -B -W must list the same products whether or not the image has an
+# index next to it.
+#
+# usage: batch-index.sh EFSEXTRACT
+#
+bin=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+tests=$(cd "$(dirname "$0")" && pwd)
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+python3 "$tests/mkimage.py" img1.img || exit 1
+echo "$dir/img1.img" > list
+
+# the summary lines carry cache counts, which the index changes
+"$bin" -B list -W | grep -v ': ok,' > noidx.txt || exit 1
+"$bin" -I img1.img || exit 1
+"$bin" -B list -W | grep -v ': ok,' > idx.txt || exit 1
+
+grep -q 'foo\.sw\.base' noidx.txt || { echo "no products without index"; exit 1; }
+if ! cmp -s noidx.txt idx.txt; then
+	echo "-B -W lists different products with an index:"
+	diff noidx.txt idx.txt
+	exit 1
+fi
+echo "batch-index: ok"
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+#
+# Write a small SGI disk image for the tests: a volume header with one
+# EFS partition (7) holding an inst distribution, dist/foo with its
+# foo.idb and foo.sw, next to a few plain files.
+#
+# usage: mkimage.py IMAGE
+#
+import struct
+import sys
+
+BB = 512
+FIRSTCG = 20
+CGFSIZE = 400
+CGISIZE = 10            # 40 inodes per cylinder group
+NCG = 1
+
+
+def be16(x):
+    return struct.pack('>H', x & 0xffff)
+
+
+def be32(x):
+    return struct.pack('>I', x & 0xffffffff)
+
+
+def pstr(s):
+    b = s.encode()
+    return be16(len(b)) + b
+
+
+class EFS:
+    def __init__(self):
+        self.size = FIRSTCG + NCG * CGFSIZE
+        self.img = bytearray(self.size * BB)
+        self.next_ino = 3
+        self.next_bb = FIRSTCG + CGISIZE
+
+    def alloc_ino(self):
+        self.next_ino += 1
+        return self.next_ino - 1
+
+    def write_data(self, data):
+        nbb = (len(data) + BB - 1) // BB
+        assert nbb <= 248 and self.next_bb + nbb <= FIRSTCG + CGFSIZE
+        bn = self.next_bb
+        self.next_bb += nbb
+        self.img[bn * BB:bn * BB + len(data)] = data
+        return [(bn, nbb, 0)] if nbb else []
+
+    def put_inode(self, ino, mode, nlink, size, exts, mtime=700000000):
+        raw = be16(mode) + be16(nlink) + be16(0) + be16(0) + be32(size)
+        raw += be32(mtime) + be32(mtime) + be32(mtime) + be32(1)
+        raw += be16(len(exts)) + b'\0\0'
+        area = b''.join(bytes([0]) + be32(bn)[1:] + bytes([n]) + be32(off)[1:]
+                        for (bn, n, off) in exts)
+        raw += area.ljust(96, b'\0')
+        pos = (FIRSTCG + (ino >> 2)) * BB + (ino & 3) * 128
+        self.img[pos:pos + 128] = raw
+
+    def dirblock(self, entries):
+        blk = bytearray(BB)
+        top = BB
+        offs = []
+        for (name, ino) in entries:
+            nb = name.encode()
+            sz = 5 + len(nb)
+            sz += sz & 1
+            top -= sz
+            blk[top:top + 4] = be32(ino)
+            blk[top + 4] = len(nb)
+            blk[top + 5:top + 5 + len(nb)] = nb
+            offs.append(top >> 1)
+        assert 4 + len(offs) < top
+        blk[0:2] = be16(0xbeef)
+        blk[2] = top >> 1
+        blk[3] = len(entries)
+        for i, off in enumerate(offs):
+            blk[4 + i] = off
+        return bytes(blk)
+
+    def mkdir(self, tree, ino, parent):
+        entries = [('.', ino), ('..', parent)]
+        nsub = 0
+        for name, data in tree.items():
+            child = self.alloc_ino()
+            entries.append((name, child))
+            if isinstance(data, dict):
+                nsub += 1
+                self.mkdir(data, child, ino)
+            else:
+                self.put_inode(child, 0o100644, 1, len(data),
+                               self.write_data(data))
+        d = self.dirblock(entries)
+        self.put_inode(ino, 0o040755, 2 + nsub, len(d), self.write_data(d))
+
+    def superblock(self):
+        sb = be32(self.size) + be32(FIRSTCG) + be32(CGFSIZE)
+        sb += be16(CGISIZE) + be16(10) + be16(10) + be16(NCG)
+        sb += be16(0) + be16(0) + be32(700000000) + be32(0x0007295A)
+        sb += b'test\0\0' + b'pack\0\0'
+        self.img[BB:BB + len(sb)] = sb
+
+
+def product():
+    def rule(prod, img, sub, lo, hi):
+        return pstr(prod) + pstr(img) + pstr(sub) + be32(lo) + be32(hi)
+    out = b'pd' + b'prodid\0' + be16(1988) + be16(1)
+    out += be16(1987) + be16(9) + pstr('foo') + pstr('Foo Product 1.0')
+    out += be16(0) + be32(800000000) + pstr('idk')
+    out += be32(1) + pstr('attr1')
+    out += be16(1)
+    out += be16(0) + pstr('sw') + pstr('Foo Software') + be16(0)
+    out += be16(100) + be32(1234) + pstr('') + be32(0) + be16(2)
+    for sub in ('base', 'dev'):
+        out += be16(0x0082) + pstr(sub) + pstr('Foo %s' % sub)
+        out += pstr('expr') + be32(810000000)
+        out += be16(1) + rule('foo', 'sw', sub, -5, 2147483647)
+        out += be16(1) + be16(1) + rule('eoe', 'sw', 'base', 1, 2)
+        out += pstr('alt') + be16(0) + be32(0)
+        out += be16(1) + rule('old', 'sw', sub, 1, 3)
+    return out
+
+
+def main(path):
+    fs = EFS()
+    fs.mkdir({
+        'etc': {
+            'motd': b'Welcome to IRIX\n',
+        },
+        'dist': {
+            'foo': product(),
+            'foo.idb': b'f 0755 root sys usr/bin/foo foo foo.sw.base\n',
+            'foo.sw': b'\0' * 100,
+        },
+    }, 2, 2)
+    fs.superblock()
+
+    start = 64
+    nblks = len(fs.img) // BB
+    img = bytearray((start + nblks + 8) * BB)
+    img[start * BB:(start + nblks) * BB] = fs.img
+
+    dvh = bytearray(BB)
+    struct.pack_into('>IHH', dvh, 0, 0x0be5a941, 0, 1)
+    pt = 8 + 16 + 48 + 15 * 16
+    struct.pack_into('>iii', dvh, pt + 7 * 12, nblks, start, 7)
+    struct.pack_into('>iii', dvh, pt + 8 * 12, start, 0, 0)
+    struct.pack_into('>iii', dvh, pt + 10 * 12, len(img) // BB, 0, 6)
+    csum = sum(struct.unpack('>128I', bytes(dvh))) & 0xffffffff
+    struct.pack_into('>I', dvh, pt + 16 * 12, -csum & 0xffffffff)
+    img[0:BB] = dvh
+
+    with open(path, 'wb') as f:
+        f.write(img)
+
+
+main(sys.argv[1])